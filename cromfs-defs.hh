@@ -32,6 +32,8 @@ enum CROMFS_OPTS
     CROMFS_OPT_16BIT_BLOCKNUMS     = 0x00000200,
     CROMFS_OPT_PACKED_BLOCKS       = 0x00000400,
     CROMFS_OPT_VARIABLE_BLOCKSIZES = 0x00000800,
+    CROMFS_OPT_CHUNKED_BLKTAB      = 0x00001000,
+    CROMFS_OPT_FBLOCK_CODECS       = 0x00002000,
     CROMFS_OPT_USE_BWT             = 0x00010000,
     CROMFS_OPT_USE_MTF             = 0x00020000
 };
@@ -88,6 +90,7 @@ public:
 struct cromfs_superblock_internal
 {
     uint_fast64_t blktab_offs,  blktab_size,  blktab_room;
+    uint_fast64_t fblkdir_offs, fblkdir_size, fblkdir_room; /* size 0 = no fblkdir */
     uint_fast64_t fblktab_offs;
     uint_fast64_t inotab_offs,  inotab_size,  inotab_room;
     uint_fast64_t rootdir_offs, rootdir_size, rootdir_room;
@@ -96,14 +99,15 @@ struct cromfs_superblock_internal
     uint_fast64_t bytes_of_files;
     uint_fast64_t sig;
 
-    enum { MaxBufferSize = 0x50 };
+    enum { MaxBufferSize = 0x60 };
     typedef unsigned char BufferType[MaxBufferSize];
 
     void RecalcRoom()
     {
         rootdir_room = inotab_offs  - rootdir_offs;
         inotab_room  = blktab_offs  - inotab_offs;
-        blktab_room  = fblktab_offs - blktab_offs;
+        blktab_room  = fblkdir_offs - blktab_offs;
+        fblkdir_room = fblktab_offs - fblkdir_offs;
     }
 
     void SetOffsets(unsigned headersize)
@@ -111,7 +115,8 @@ struct cromfs_superblock_internal
         rootdir_offs = headersize;
         inotab_offs  = rootdir_offs + rootdir_room;
         blktab_offs  = inotab_offs  + inotab_room;
-        fblktab_offs = blktab_offs  + blktab_room;
+        fblkdir_offs = blktab_offs  + blktab_room;
+        fblktab_offs = fblkdir_offs + fblkdir_room;
     }
     void SetOffsets(bool extended_header)
     {
@@ -119,10 +124,13 @@ struct cromfs_superblock_internal
     }
     void SetOffsets()
     {
-        SetOffsets(
-            rootdir_size != rootdir_room
-         || inotab_size != inotab_room
-         || blktab_size != blktab_room);
+        if(fblkdir_room)
+            SetOffsets(0x60u);
+        else
+            SetOffsets(
+                rootdir_size != rootdir_room
+             || inotab_size != inotab_room
+             || blktab_size != blktab_room);
     }
 
     void ReadFromBuffer(const BufferType& Superblock)
@@ -136,6 +144,19 @@ struct cromfs_superblock_internal
         bsize                   = get_32(Superblock+0x002C);
         bytes_of_files          = get_64(Superblock+0x0030);
 
+        fblkdir_offs = fblktab_offs;
+        fblkdir_size = 0;
+        if(GetSize() >= 0x60)
+        {
+            fblkdir_offs = get_64(Superblock+0x0050);
+            fblkdir_size = get_64(Superblock+0x0058);
+            if(fblkdir_offs < blktab_offs || fblkdir_offs > fblktab_offs)
+            {
+                fblkdir_offs = fblktab_offs;
+                fblkdir_size = 0;
+            }
+        }
+
         RecalcRoom();
 
         rootdir_size = rootdir_room;
@@ -166,6 +187,11 @@ struct cromfs_superblock_internal
             put_64(Superblock+0x0040, inotab_size);
             put_64(Superblock+0x0048, blktab_size);
         }
+        if(rootdir_offs >= 0x60)
+        {
+            put_64(Superblock+0x0050, fblkdir_offs);
+            put_64(Superblock+0x0058, fblkdir_size);
+        }
     }
 
     unsigned GetSize(bool sparse_mode) const
@@ -175,10 +201,12 @@ struct cromfs_superblock_internal
         {
             return 0x38;
         }
-        return sparse_mode ? MaxBufferSize : 0x38;
+        return sparse_mode ? 0x50 : 0x38;
     }
     unsigned GetSize() const
     {
+        if(rootdir_offs >= 0x60 && GetSize(true) >= 0x50)
+            return 0x60; // With the location of fblkdir
         return GetSize(rootdir_offs >= 0x50);
     }
 };
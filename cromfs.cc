@@ -3,8 +3,6 @@ cromfs - Copyright (C) 1992,2014 Bisqwit (http://iki.fi/bisqwit/)
 Licence: GPL3
 
 cromfs.cc: The cromfs filesystem engine.
-The class cromfs should actually be a singleton, because of the signal
-handling herein, but that hasn't been written yet...
 
 See doc/FORMAT for the documentation of the filesystem structure.
 
@@ -23,6 +21,7 @@ See doc/FORMAT for the documentation of the filesystem structure.
 
 #include <sstream>
 #include <deque>
+#include <pthread.h>
 
 #include <cstdio>
 
@@ -36,7 +35,10 @@ extern "C" {
 #include "lib/longfileread.hh"
 #include "lib/cromfs-inodefun.hh"
 #include "lib/cromfs-blockfun.hh"
+#include "lib/cromfs-directoryfun.hh"
 #include "lib/fadvise.hh"
+#include "lib/batchread.hh"
+#include "lib/cromfs-fblockcodec.hh"
 #include "lib/util.hh"
 #include "cromfs.hh"
 
@@ -51,10 +53,15 @@ extern "C" {
 #define READDIR_DEBUG   0
 #define DEBUG_INOTAB    0
 
-#define BLKTAB_CACHE_TIMEOUT 0
-
-unsigned READDIR_CACHE_MAX_SIZE = 5;
-unsigned FBLOCK_CACHE_MAX_SIZE = 10;
+size_t READDIR_CACHE_MAX_BYTES = 1048576 * 4;
+size_t FBLOCK_CACHE_MAX_BYTES  = 1048576 * 32;
+size_t BLKTAB_CACHE_MAX_BYTES  = 1048576 * 4;
+std::string DISK_CACHE_FILE;
+uint_fast64_t DISK_CACHE_MAX_BYTES = UINT64_C(1048576) * 1024;
+bool USE_INODE_TABLE = false;
+bool USE_MMAP = false;
+unsigned PREFETCH_FBLOCKS = 2;
+unsigned PREFETCH_THREADS = 1;
 
 template<typename T>
 static void EraseRandomlyOne(T& container)
@@ -125,10 +132,221 @@ static const std::vector<unsigned char> LZMADeCompress
     goto clearly_not_ok;
 }
 
-static const std::vector<unsigned char>
-    DoLZMALoading(int fd, uint_fast64_t pos, uint_fast64_t size)
+/* The state of an fblock that has not been decoded completely.
+ * The decoder uses the fblock's own buffer as its dictionary.
+ * The compressed data is either owned by the decoder,
+ * or lives in the memory-mapped image.
+ * For the other codecs than LZMA, state is not used.
+ */
+struct cromfs_fblock_decoder
+{
+    CromfsFblockCodec          codec;
+    CLzmaDec                   state;
+    std::vector<unsigned char> owned;
+    const unsigned char*       input;
+    size_t                     input_size;
+    size_t                     input_pos;
+
+    cromfs_fblock_decoder()
+        : codec(CROMFS_FBLOCK_LZMA), state(), owned(), input(0), input_size(0), input_pos(0) { }
+};
+
+static ISzAlloc fblock_alloc = { SzAlloc, SzFree };
+
+cromfs_fblock_buffer::cromfs_fblock_buffer(std::vector<unsigned char>& compressed)
+    throw (cromfs_exception, std::bad_alloc)
+    : ptrable(), unread_prefetch(0), buffer(0), total(0), done(0), cheap(false),
+      lock(), decoder(0), decoder_bytes(0)
+{
+    if(compressed.empty()) throw EBADF;
+    Init(&compressed[0], compressed.size());
+    decoder->owned.swap(compressed);
+    decoder_bytes += decoder->owned.size();
+}
+
+cromfs_fblock_buffer::cromfs_fblock_buffer(const unsigned char* compressed, size_t length)
+    throw (cromfs_exception, std::bad_alloc)
+    : ptrable(), unread_prefetch(0), buffer(0), total(0), done(0), cheap(false),
+      lock(), decoder(0), decoder_bytes(0)
+{
+    Init(compressed, length);
+}
+
+void cromfs_fblock_buffer::Init(const unsigned char* compressed, size_t length)
+    throw (cromfs_exception, std::bad_alloc)
+{
+    const uint_fast64_t out_size = GetFblockRawSize(compressed, length);
+    if(out_size >= (size_t)~0ULL) throw EBADF;
+
+    const CromfsFblockCodec codec = GetFblockCodec(compressed, length);
+    if(codec != CROMFS_FBLOCK_LZMA)
+    {
+        buffer  = new unsigned char[out_size];
+        total   = out_size;
+        cheap   = true;
+        decoder = new cromfs_fblock_decoder;
+        decoder->codec      = codec;
+        decoder->input      = compressed;
+        decoder->input_size = length;
+        decoder_bytes = sizeof(*decoder);
+        return;
+    }
+
+    /* Left uninitialized on purpose: the pages of a large allocation
+     * take no RAM until something is decoded into them. */
+    buffer = new unsigned char[out_size];
+    total  = out_size;
+
+    decoder = new cromfs_fblock_decoder;
+    LzmaDec_Construct(&decoder->state);
+    if(LzmaDec_AllocateProbs(&decoder->state, &compressed[0], LZMA_PROPS_SIZE, &fblock_alloc) != SZ_OK)
+    {
+        delete decoder;
+        delete[] buffer;
+        throw EBADF;
+    }
+    decoder->state.dic        = buffer;
+    decoder->state.dicBufSize = total;
+    LzmaDec_Init(&decoder->state);
+
+    decoder->input      = compressed;
+    decoder->input_size = length;
+    decoder->input_pos  = LZMA_PROPS_SIZE+8;
+    decoder_bytes = sizeof(*decoder) + decoder->state.numProbs * sizeof(CLzmaProb);
+}
+
+cromfs_fblock_buffer::cromfs_fblock_buffer(size_t length)
+    throw (std::bad_alloc)
+    : ptrable(), unread_prefetch(0),
+      buffer(new unsigned char[length]), total(length), done(length), cheap(false),
+      lock(), decoder(0), decoder_bytes(0)
+{
+}
+
+cromfs_fblock_buffer::~cromfs_fblock_buffer()
+{
+    if(decoder)
+    {
+        LzmaDec_FreeProbs(&decoder->state, &fblock_alloc);
+        delete decoder;
+    }
+    delete[] buffer;
+}
+
+bool cromfs_fblock_buffer::decode(size_t upto) const
+    throw (cromfs_exception, std::bad_alloc)
+{
+    if(upto > total) upto = total;
+    if(upto <= done) return false;
+
+    ScopedLock lck(lock);
+    if(upto <= done) return false; // Another thread did it meanwhile
+
+    if(decoder->codec != CROMFS_FBLOCK_LZMA)
+    {
+        if(!DecodeTaggedFblock(decoder->input, decoder->input_size, buffer))
+            throw EBADF;
+        delete decoder;
+        decoder = 0;
+        decoder_bytes = 0;
+
+        __sync_synchronize();
+        done = total;
+        return true;
+    }
+
+    /* Decode at least 64 kB at a time, so that a series of
+     * small reads does not become a series of small decodes. */
+    const size_t target = std::min(total, std::max(upto, done + (size_t)65536));
+    const bool finishing = target == total;
+
+    ELzmaStatus status;
+    SizeT in_done = decoder->input_size - decoder->input_pos;
+    SRes res = LzmaDec_DecodeToDic(
+        &decoder->state, target,
+        decoder->input + decoder->input_pos, &in_done,
+        finishing ? LZMA_FINISH_END : LZMA_FINISH_ANY,
+        &status);
+    decoder->input_pos += in_done;
+
+    if(res != SZ_OK || decoder->state.dicPos != target) throw EBADF;
+
+    if(finishing)
+    {
+        if((status != LZMA_STATUS_FINISHED_WITH_MARK
+         && status != LZMA_STATUS_MAYBE_FINISHED_WITHOUT_MARK)
+        || decoder->input_pos != decoder->input_size)
+        {
+            throw EBADF;
+        }
+        LzmaDec_FreeProbs(&decoder->state, &fblock_alloc);
+        delete decoder;
+        decoder = 0;
+        decoder_bytes = 0;
+    }
+
+    /* Make sure the data is there before anyone can see the new size. */
+    __sync_synchronize();
+    done = target;
+    return true;
+}
+
+size_t cromfs_fblock_buffer::num_bytes() const
+{
+    /* Read without locking; only an estimate. */
+    return sizeof(*this) + done + decoder_bytes;
+}
+
+cromfs_latency_histogram::cromfs_latency_histogram()
+    : count(0), total_usec(0)
+{
+    for(unsigned a=0; a<NumBuckets; ++a) buckets[a] = 0;
+}
+
+void cromfs_latency_histogram::Add(uint_fast64_t usec)
+{
+    unsigned bucket = 0;
+    while(bucket+1 < NumBuckets && (usec >> bucket) > 0) ++bucket;
+    __sync_fetch_and_add(&buckets[bucket], 1);
+    __sync_fetch_and_add(&total_usec, usec);
+    __sync_fetch_and_add(&count, 1);
+}
+
+void cromfs_latency_histogram::Format(std::string& out, const char* prefix) const
+{
+    char Buf[128];
+    std::sprintf(Buf, "%s.count %llu\n%s.usec %llu\n",
+        prefix, (unsigned long long)count,
+        prefix, (unsigned long long)total_usec);
+    out += Buf;
+
+    unsigned last = NumBuckets-1;
+    while(last > 0 && !buckets[last]) --last;
+    uint_fast64_t sum = 0;
+    for(unsigned a=0; a<=last && a+1 < NumBuckets; ++a)
+    {
+        sum += buckets[a];
+        std::sprintf(Buf, "%s.usec_lt_%llu %llu\n",
+            prefix, 1ULL << a, (unsigned long long)sum);
+        out += Buf;
+    }
+}
+
+cromfs_statistics::cromfs_statistics()
+    : fblock_hits(0), fblock_misses(0), fblock_evictions(0),
+      fblocks_read(0), compressed_bytes_read(0), decompressed_bytes(0),
+      disk_cache_hits(0), disk_cache_writes(0), disk_cache_skipped(0),
+      blktab_chunk_loads(0), readdir_hits(0), readdir_misses(0),
+      prefetch_queued(0), prefetch_loaded(0), prefetch_used(0), prefetch_wasted(0),
+      decompress_time()
+{
+}
+
+static std::vector<unsigned char>
+    DoLZMALoading(int fd, const unsigned char* mapped, uint_fast64_t pos, uint_fast64_t size)
         throw(cromfs_exception, std::bad_alloc)
 {
+    if(mapped) return LZMADeCompress(mapped, size);
     LongFileRead reader(fd, pos, size);
     return LZMADeCompress(reader.GetAddr(), size);
 }
@@ -194,9 +412,10 @@ void cromfs::reread_superblock()
     && sig != CROMFS_SIGNATURE_03
     ) throw EINVAL;
 
-    fblock_cache.clear();
+    forget_fblocks();
+    open_disk_cache(Superblock);
 
-    FadviseWillNeed(fd, 0, sblock.fblktab_offs); // Will need all data up to first fblock.
+    advise_image(0, sblock.fblktab_offs, FadviseWillNeed, MadviseWillNeed); // Will need all data up to first fblock.
 
 #if SBLOCK_DEBUG
     fprintf(stderr,
@@ -216,7 +435,7 @@ void cromfs::reread_superblock()
         (unsigned)CROMFS_FSIZE,
         (unsigned)CROMFS_BSIZE,
         (unsigned)fblktab.size(),
-        (unsigned)blktab.size(),
+        (unsigned)blktab_blocks,
         (unsigned long long)sblock.bytes_of_files);
 #endif
 
@@ -252,13 +471,11 @@ void cromfs::reread_superblock()
 
         /* As rootdir and inotab have now been read, it's safe to forget
          * them from the page cache. */
-        FadviseDontNeed(fd, 0, sblock.blktab_offs);
+        advise_image(0, sblock.blktab_offs, FadviseDontNeed, MadviseDontNeed);
      }
 
      #pragma omp section
      {
-        FadviseWillNeed(fd, sblock.blktab_offs, sblock.blktab_size);
-
         rootdir.mode = S_IFDIR | 0555;
         if(sblock.sig == CROMFS_SIGNATURE_01)
             rootdir.links = 2;
@@ -301,24 +518,84 @@ void cromfs::Initialize()
     reread_superblock();
 }
 
+bool cromfs::read_fblkdir(uint_fast64_t eofpos)
+        throw (cromfs_exception, std::bad_alloc)
+{
+    if(sblock.fblkdir_size <= LZMA_PROPS_SIZE+8
+    || sblock.fblkdir_size > sblock.fblkdir_room
+    || sblock.fblktab_offs >= eofpos) return false;
+
+    std::vector<unsigned char> compressed;
+    const unsigned char* Buf = mapped_image(sblock.fblkdir_offs, sblock.fblkdir_size);
+    if(!Buf)
+    {
+        compressed.resize(sblock.fblkdir_size);
+        LongFileRead(fd, sblock.fblkdir_offs, compressed.size(), &compressed[0]);
+        Buf = &compressed[0];
+    }
+
+    /* Don't trust the size in the LZMA header more than the image.
+     * The directory does not tell the codecs of the fblocks,
+     * so any fblock may be as short as a stored one. */
+    const size_t min_length = GetFblockMinLength(CROMFS_FBLOCK_STORED);
+    const uint_fast64_t max_fblocks = (eofpos - sblock.fblktab_offs) / (4+min_length);
+    if(get_64(Buf + LZMA_PROPS_SIZE) > max_fblocks*4) return false;
+
+    std::vector<unsigned char> fblkdir;
+    try { fblkdir = LZMADeCompress(Buf, sblock.fblkdir_size); }
+    catch(cromfs_exception) { return false; }
+    if(fblkdir.size() % 4) return false;
+
+    std::vector<cromfs_fblock_internal> result(fblkdir.size() / 4);
+    uint_fast64_t startpos = sblock.fblktab_offs;
+    for(size_t a=0; a<result.size(); ++a)
+    {
+        result[a].filepos = startpos+4;
+        result[a].length  = get_32(&fblkdir[a*4]);
+        if(result[a].length < min_length) return false;
+
+        if(storage_opts & CROMFS_OPT_SPARSE_FBLOCKS)
+            startpos += 4 + CROMFS_FSIZE;
+        else
+            startpos += 4 + result[a].length;
+        if(startpos > eofpos) return false;
+    }
+
+    fblktab.swap(result);
+
+    // Let the kernel know that the memory access pattern
+    // for the fblocks does not have any readahead advantage.
+    advise_image(sblock.fblktab_offs, startpos - sblock.fblktab_offs, FadviseRandom, MadviseRandom);
+    return true;
+}
+
 void cromfs::reread_fblktab()
         throw (cromfs_exception, std::bad_alloc)
 {
     fblktab.clear();
 
     uint_fast64_t eofpos   = lseek64(fd, 0, SEEK_END);
+    if(read_fblkdir(eofpos)) return;
+
+    /* Without the fblock directory, the fblocks must be found
+     * by reading the header of each of them in turn. */
     uint_fast64_t startpos = sblock.fblktab_offs;
-    while(startpos + (4+LZMA_PROPS_SIZE+8) < eofpos)
+    while(startpos + (4+1) <= eofpos)
     {
-        LongFileRead fbreader(fd, startpos, 4+LZMA_PROPS_SIZE+8);
-        const unsigned char* Buf = fbreader.GetAddr();
+        /* The length, and the first byte of the fblock, which tells the codec. */
+        unsigned char Header[4+1];
+        const unsigned char* Buf = mapped_image(startpos, sizeof(Header));
+        if(!Buf)
+        {
+            LongFileRead(fd, startpos, sizeof(Header), Header);
+            Buf = Header;
+        }
 
         cromfs_fblock_internal fblock;
         fblock.filepos = startpos+4;
         fblock.length  = get_32(Buf);
-        //uint_fast64_t orig_length = get_64(Buf+9); // <- not interesting
 
-        if(fblock.length <= LZMA_PROPS_SIZE+8)
+        if(fblock.length < GetFblockMinLength(GetFblockCodec(Buf+4, 1)))
         {
             throw EINVAL;
         }
@@ -339,82 +616,116 @@ void cromfs::reread_fblktab()
 
         // Let the kernel know that the memory access pattern
         // for a fblock does not have any readahead advantage.
-        FadviseRandom(fd, fblock.filepos-4, startpos);
+        advise_image(fblock.filepos-4, startpos - (fblock.filepos-4), FadviseRandom, MadviseRandom);
     }
 }
 
 void cromfs::forget_blktab()
 {
-    blktab = std::vector<cromfs_block_internal>();
-    // clear() won't free memory, reserve() can only increase size
+    blktab_cache.clear();
 }
 
-static cromfs* cromfs_alarm_obj = NULL;
-static void cromfs_alarm(int sig=0) __attribute__((constructor));
-static void cromfs_alarm(int/* sig*/)
-{
-    if(!cromfs_alarm_obj) return;
-    cromfs_alarm_obj->forget_blktab();
-    std::signal(SIGALRM, cromfs_alarm);
-    std::signal(SIGCONT, cromfs_alarm);
-}
-
-static void cromfs_setup_alarm(cromfs& obj)
+void cromfs::reread_blktab()
+        throw (cromfs_exception, std::bad_alloc)
 {
-    /*
-    static struct itimerval timer;
+    const uint_fast64_t blktab_end = sblock.blktab_offs + sblock.blktab_size;
 
-    // Check the current status of the timer
-    getitimer(ITIMER_REAL, &timer);
-    if(timer.it_value.tv_sec > BLKTAB_CACHE_TIMEOUT/2)
+    blktab_chunk_offs.clear();
+    if(storage_opts & CROMFS_OPT_CHUNKED_BLKTAB)
     {
-        return;
+        unsigned char Header[8];
+        if(sblock.blktab_size < sizeof(Header)) throw EINVAL;
+        LongFileRead(fd, sblock.blktab_offs, sizeof(Header), Header);
+        blktab_blocks       = get_32(Header+0);
+        blktab_chunk_blocks = get_32(Header+4);
+        if(!blktab_chunk_blocks) throw EINVAL;
+
+        const uint_fast64_t num_chunks =
+            (blktab_blocks + (uint_fast64_t)blktab_chunk_blocks-1) / blktab_chunk_blocks;
+        if(sizeof(Header) + (num_chunks+1)*8 > sblock.blktab_size) throw EINVAL;
+
+        std::vector<unsigned char> Offsets((num_chunks+1)*8);
+        LongFileRead(fd, sblock.blktab_offs + sizeof(Header), Offsets.size(), &Offsets[0]);
+        for(size_t a=0; a<=num_chunks; ++a)
+        {
+            const uint_fast64_t pos = sblock.blktab_offs + get_64(&Offsets[a*8]);
+            if(pos > blktab_end
+            || (a > 0 && pos <= blktab_chunk_offs.back())) throw EINVAL;
+            blktab_chunk_offs.push_back(pos);
+        }
+    }
+    else
+    {
+        /* The block table is all one chunk. Its size can be
+         * told from the header of the LZMA stream. */
+        unsigned char Header[LZMA_PROPS_SIZE+8];
+        if(sblock.blktab_size < sizeof(Header)) throw EINVAL;
+        LongFileRead(fd, sblock.blktab_offs, sizeof(Header), Header);
+        blktab_blocks       = get_64(Header+LZMA_PROPS_SIZE) / DATALOCATOR_SIZE_BYTES();
+        blktab_chunk_blocks = blktab_blocks ? blktab_blocks : 1;
+        blktab_chunk_offs.push_back(sblock.blktab_offs);
+        blktab_chunk_offs.push_back(blktab_end);
     }
-    */
 
-    // Will setup a signal that will free the memory consumed by blktab
-    // after a period of inuse
-    cromfs_alarm_obj = &obj;
-    if(BLKTAB_CACHE_TIMEOUT) alarm(BLKTAB_CACHE_TIMEOUT);
-    /*
-    timer.it_interval.tv_sec  = 0;
-    timer.it_interval.tv_usec = 0;
-    timer.it_value.tv_sec  = BLKTAB_CACHE_TIMEOUT;
-    timer.it_value.tv_usec = 0;
-    setitimer(ITIMER_REAL, &timer, NULL);
-    */
+    /* The chunks are read one at a time, when they are needed. */
+    advise_image(sblock.blktab_offs, sblock.blktab_size, FadviseRandom, MadviseRandom);
 }
 
-void cromfs::reread_blktab()
+cromfs_cached_blktab_chunk cromfs::load_blktab_chunk(uint_fast32_t chunknum) const
         throw (cromfs_exception, std::bad_alloc)
 {
+    if(chunknum + 1 >= blktab_chunk_offs.size()) throw EIO;
+    const uint_fast64_t pos    = blktab_chunk_offs[chunknum];
+    const uint_fast64_t length = blktab_chunk_offs[chunknum+1] - pos;
+
+    cromfs_stat_add(stats.blktab_chunk_loads);
     std::vector<unsigned char> blktab_data =
-        DoLZMALoading(fd, sblock.blktab_offs, sblock.blktab_size);
+        DoLZMALoading(fd, mapped_image(pos, length), pos, length);
 
-    /* As we normally read blktab only once, it's safe
-     * to forget it from page cache now.
-     */
-    FadviseDontNeed(fd, sblock.blktab_offs, sblock.blktab_size);
+    cromfs_blktab_chunk* chunk = new cromfs_blktab_chunk;
+    cromfs_cached_blktab_chunk result = chunk;
+    chunk->first  = chunknum * blktab_chunk_blocks;
+    chunk->blocks = DecodeBlockTable(blktab_data, CROMFS_FSIZE, storage_opts);
 
-    /* Decode the blktab.
-     * Destruct + construct in place, faster than assignment,
-     *              better optimized by the compiler as well.
-     * Probably not exception-safe though.
-     */
-    blktab.~vector<cromfs_block_internal>();
-    new( (void*)&blktab) std::vector<cromfs_block_internal>
-        ( DecodeBlockTable(blktab_data, CROMFS_FSIZE, storage_opts) );
+    /* Blocks beyond the end of the block table are not accessible. */
+    const uint_fast32_t expected = std::min(blktab_chunk_blocks, blktab_blocks - chunk->first);
+    if(chunk->blocks.size() > expected) chunk->blocks.resize(expected);
 
 #if READBLOCK_DEBUG >= 2
-    for(unsigned a=0; a<blktab.size(); ++a)
+    for(unsigned a=0; a<chunk->blocks.size(); ++a)
     {
-        fprintf(stderr, "BLOCK %u: %s\n", a, DumpBlock(blktab[a]).c_str());
+        fprintf(stderr, "BLOCK %u: %s\n",
+            (unsigned)(chunk->first + a), DumpBlock(chunk->blocks[a]).c_str());
     }
 #endif
+    return result;
+}
+
+cromfs_cached_blktab_chunk cromfs::get_blktab_chunk(uint_fast32_t chunknum)
+        throw (cromfs_exception, std::bad_alloc)
+{
+    cromfs_cached_blktab_chunk result;
+    if(blktab_cache.Get(chunknum, result)) return result;
 
-    MadviseRandom(&blktab[0], blktab.size()*sizeof(blktab[0]));
+    /* Two threads missing the same chunk should not both decode it. */
+    ScopedLock lck(blktab_lock);
+    if(blktab_cache.Get(chunknum, result)) return result;
 
-    cromfs_setup_alarm(*this);
+    result = load_blktab_chunk(chunknum);
+    blktab_cache.Put(chunknum, result);
+    return result;
+}
+
+void cromfs::read_blktab(std::vector<cromfs_block_internal>& result)
+        throw (cromfs_exception, std::bad_alloc)
+{
+    result.clear();
+    result.reserve(blktab_blocks);
+    for(uint_fast32_t chunknum = 0; chunknum+1 < blktab_chunk_offs.size(); ++chunknum)
+    {
+        cromfs_cached_blktab_chunk chunk = load_blktab_chunk(chunknum);
+        result.insert(result.end(), chunk->blocks.begin(), chunk->blocks.end());
+    }
 }
 
 cromfs_inode_internal cromfs::read_special_inode
@@ -443,7 +754,7 @@ cromfs_inode_internal cromfs::read_special_inode
 #endif
                 throw EIO;
             }
-            std::vector<unsigned char> Buf = DoLZMALoading(fd, offset+0, size);
+            std::vector<unsigned char> Buf = DoLZMALoading(fd, mapped_image(offset, size), offset+0, size);
 
 #if INODE_DEBUG
             fprintf(stderr, "Read inode %s. Ignore blocks = %s\n",
@@ -487,6 +798,130 @@ cromfs_inode_internal cromfs::read_special_inode
     return inode;
 }
 
+bool cromfs_inode_table::get(cromfs_inodenum_t inonum,
+                             cromfs_inode_internal& inode,
+                             uint_fast32_t default_blocksize) const
+{
+    if(inonum < 2) return false;
+    const uint_fast64_t bit  = inonum - 2;
+    const uint_fast64_t word = bit / 64;
+    if(word >= starts.size()) return false;
+
+    const uint_least64_t mask = UINT64_C(1) << (bit % 64);
+    if(!(starts[word] & mask)) return false;
+
+    const size_t index = rank[word] + __builtin_popcountll(starts[word] & (mask-1));
+
+    inode.mode     = mode[index];
+    inode.time     = time[index];
+    inode.uid      = uid[index];
+    inode.gid      = gid[index];
+    inode.bytesize = bytesize[index];
+    inode.blocksize = blocksize.empty() ? default_blocksize : blocksize[index];
+    if(S_ISCHR(inode.mode) || S_ISBLK(inode.mode))
+        { inode.links = 1; inode.rdev = rdev_links[index]; }
+    else
+        { inode.links = rdev_links[index]; inode.rdev = 0; }
+    return true;
+}
+
+size_t cromfs_inode_table::num_bytes() const
+{
+    return mode.capacity()       * sizeof(mode[0])
+         + time.capacity()       * sizeof(time[0])
+         + rdev_links.capacity() * sizeof(rdev_links[0])
+         + uid.capacity()        * sizeof(uid[0])
+         + gid.capacity()        * sizeof(gid[0])
+         + bytesize.capacity()   * sizeof(bytesize[0])
+         + blocksize.capacity()  * sizeof(blocksize[0])
+         + starts.capacity()     * sizeof(starts[0])
+         + rank.capacity()       * sizeof(rank[0]);
+}
+
+void cromfs_inode_table::swap(cromfs_inode_table& b)
+{
+    mode.swap(b.mode);
+    time.swap(b.time);
+    rdev_links.swap(b.rdev_links);
+    uid.swap(b.uid);
+    gid.swap(b.gid);
+    bytesize.swap(b.bytesize);
+    blocksize.swap(b.blocksize);
+    starts.swap(b.starts);
+    rank.swap(b.rank);
+}
+
+void cromfs::ensure_inode_table()
+        throw (cromfs_exception, std::bad_alloc)
+{
+    if(likely(inode_table_ready)) return;
+
+    ScopedLock lck(inode_table_lock);
+    if(inode_table_ready) return;
+
+    /* Walk through inotab from start to end. The inodes are stored
+     * back to back, each padded to a multiple of 4 bytes, so the
+     * next one begins right after the block table of the previous.
+     * inotab is read in large portions to keep this fast.
+     */
+    const uint_fast64_t inotab_size = inotab.bytesize;
+    const unsigned headersize = INODE_HEADER_SIZE();
+    const bool variable_blocksizes = storage_opts & CROMFS_OPT_VARIABLE_BLOCKSIZES;
+
+    cromfs_inode_table table;
+    table.starts.resize( (inotab_size/4 + 63) / 64 );
+
+    std::vector<unsigned char> window(1048576);
+    uint_fast64_t window_begin = 0, window_end = 0;
+
+    for(uint_fast64_t pos = 0; pos + headersize <= inotab_size; )
+    {
+        if(pos + headersize > window_end)
+        {
+            uint_fast64_t size = std::min((uint_fast64_t)window.size(), inotab_size - pos);
+            int_fast64_t got = read_file_data(inotab, pos, &window[0], size, "inode table");
+            if(got < (int_fast64_t)headersize) break;
+            window_begin = pos;
+            window_end   = pos + got;
+        }
+
+        cromfs_inode_internal inode;
+        get_inode_header(&window[pos - window_begin], headersize, inode, storage_opts, CROMFS_BSIZE);
+
+        if(inode.mode == 0) { pos += 4; continue; } // Padding
+        if(inode.blocksize == 0) break;             // Corrupt
+        uint_fast64_t nblocks = CalcSizeInBlocks(inode.bytesize, inode.blocksize);
+        if(nblocks > 100000000) break;              // Corrupt, see read_inode_and_blocks()
+
+        table.starts[pos / 4 / 64] |= UINT64_C(1) << (pos / 4 % 64);
+        table.mode.push_back(inode.mode);
+        table.time.push_back(inode.time);
+        table.rdev_links.push_back(
+            (S_ISCHR(inode.mode) || S_ISBLK(inode.mode)) ? inode.rdev : inode.links);
+        table.uid.push_back(inode.uid);
+        table.gid.push_back(inode.gid);
+        table.bytesize.push_back(inode.bytesize);
+        if(variable_blocksizes) table.blocksize.push_back(inode.blocksize);
+
+        pos += (INODE_SIZE_BYTES(nblocks) + 3) & ~UINT64_C(3);
+    }
+
+    table.rank.resize(table.starts.size());
+    uint_least32_t count = 0;
+    for(size_t a=0; a<table.starts.size(); ++a)
+    {
+        table.rank[a] = count;
+        count += __builtin_popcountll(table.starts[a]);
+    }
+
+    /* Trim the excess capacity left by push_back(). */
+    cromfs_inode_table(table).swap(table);
+
+    inode_table.swap(table);
+    __sync_synchronize();
+    inode_table_ready = true;
+}
+
 const cromfs_inode_internal cromfs::read_inode(cromfs_inodenum_t inodenum)
     throw (cromfs_exception, std::bad_alloc)
 {
@@ -495,13 +930,28 @@ const cromfs_inode_internal cromfs::read_inode(cromfs_inodenum_t inodenum)
 #if INODE_DEBUG
         fprintf(stderr, "returning rootdir: %s\n", DumpInode(rootdir).c_str());
 #endif
-        DumpRAMusage();
         return rootdir;
     }
     if(unlikely(inodenum < 1)) throw EBADF;
 
+    if(USE_INODE_TABLE)
+    {
+        ensure_inode_table();
+
+        cromfs_inode_internal inode;
+        if(inode_table.get(inodenum, inode, CROMFS_BSIZE))
+            return inode;
+        /* Not in the table; let the code below deal with it. */
+    }
+
+    /* An inode number past the end of inotab
+     * means that the directory is corrupt. */
+    const uint_fast64_t offset = GetInodeOffset(inodenum);
+    if(offset > inotab.bytesize || (uint_fast64_t)INODE_HEADER_SIZE() > inotab.bytesize - offset)
+        throw EIO;
+
     unsigned char Buf[MAX_INODE_HEADER_SIZE];
-    read_file_data(inotab, GetInodeOffset(inodenum), Buf, INODE_HEADER_SIZE(), "inode");
+    read_file_data(inotab, offset, Buf, INODE_HEADER_SIZE(), "inode");
 
     cromfs_inode_internal inode;
     get_inode_header(Buf, INODE_HEADER_SIZE(), inode, storage_opts, CROMFS_BSIZE);
@@ -514,6 +964,55 @@ const cromfs_inode_internal cromfs::read_inode(cromfs_inodenum_t inodenum)
     return inode;
 }
 
+void cromfs::read_inodes(const std::vector<cromfs_inodenum_t>& inodenums,
+                         std::vector<cromfs_inode_internal>& result)
+    throw (cromfs_exception, std::bad_alloc)
+{
+    result.resize(inodenums.size());
+
+    /* Headers that are at most this far apart are read together. */
+    const uint_fast64_t max_gap = 4096;
+    const uint_fast64_t max_read = 65536;
+
+    const uint_fast64_t header_size = INODE_HEADER_SIZE();
+
+    std::vector<std::pair<uint_fast64_t, size_t> > order; // offset, index
+    order.reserve(inodenums.size());
+    for(size_t a=0; a<inodenums.size(); ++a)
+    {
+        if(USE_INODE_TABLE || inodenums[a] <= 1)
+        {
+            result[a] = read_inode(inodenums[a]);
+            continue;
+        }
+        /* Same as in read_inode(). */
+        const uint_fast64_t offset = GetInodeOffset(inodenums[a]);
+        if(offset > inotab.bytesize || header_size > inotab.bytesize - offset)
+            throw EIO;
+        order.push_back(std::make_pair(offset, a));
+    }
+    std::sort(order.begin(), order.end());
+    std::vector<unsigned char> Buf;
+    for(size_t a=0; a<order.size(); )
+    {
+        const uint_fast64_t begin = order[a].first;
+        size_t b = a+1;
+        while(b < order.size()
+           && order[b].first - order[b-1].first <= max_gap
+           && order[b].first + header_size - begin <= max_read) ++b;
+        const uint_fast64_t end = order[b-1].first + header_size;
+
+        Buf.resize(end - begin);
+        if(read_file_data(inotab, begin, &Buf[0], Buf.size(), "inodes")
+           != (int_fast64_t)Buf.size())
+            throw EIO;
+
+        for(; a<b; ++a)
+            get_inode_header(&Buf[order[a].first - begin], header_size,
+                             result[order[a].second], storage_opts, CROMFS_BSIZE);
+    }
+}
+
 const cromfs_inode_internal cromfs::read_inode_and_blocks(cromfs_inodenum_t inodenum)
     throw (cromfs_exception, std::bad_alloc)
 {
@@ -578,9 +1077,9 @@ void cromfs::read_block(cromfs_blocknum_t ind,
                         uint_fast32_t size)
         throw (cromfs_exception, std::bad_alloc)
 {
-    if(blktab.empty()) reread_blktab();
-    cromfs_setup_alarm(*this);
-    cromfs_block_internal& block = blktab[ind];
+    cromfs_block_internal block;
+    cromfs_cached_blktab_chunk chunk;
+    if(!get_block(ind, block, chunk)) throw EIO;
 
 #if READBLOCK_DEBUG
     fprintf(stderr, "- - read_block(%u,%u,%p,%u): block=%s\n",
@@ -590,38 +1089,577 @@ void cromfs::read_block(cromfs_blocknum_t ind,
         DumpBlock(block).c_str());
 #endif
 
-    cromfs_cached_fblock& fblock = read_fblock(block.fblocknum);
+    read_fblock(block.fblocknum, block.startoffs + offset, target, size);
+}
 
-    const uint_fast32_t startoffs =
-        block.startoffs
-         + offset;
+uint_fast32_t cromfs::read_fblock(cromfs_fblocknum_t fblocknum,
+                                  uint_fast32_t startoffs,
+                                  unsigned char* target,
+                                  uint_fast32_t size)
+        throw (cromfs_exception, std::bad_alloc)
+{
+    /* Holding the fblock keeps it alive even if
+     * another thread evicts it from the cache meanwhile. */
+    const cromfs_cached_fblock fblock = get_fblock(fblocknum);
+
+    if(startoffs >= fblock->size()) return 0;
 
-    if(startoffs < fblock.size())
-    {
 #if READBLOCK_DEBUG
-        fprintf(stderr, "- - - got fblock of %u bytes, reading %u from %u\n",
-            (unsigned)fblock.size(), (unsigned)size, (unsigned)(startoffs));
+    fprintf(stderr, "- - - got fblock of %u bytes, reading %u from %u\n",
+        (unsigned)fblock->size(), (unsigned)size, (unsigned)(startoffs));
 #endif
+    const uint_fast32_t result = std::min((uint_fast32_t)(fblock->size() - startoffs), size);
+    decode_fblock(fblocknum, fblock, startoffs + result);
+    std::memcpy(target, fblock->data() + startoffs, result);
+    return result;
+}
+
+namespace
+{
+    /* Counts the demand loads in progress, for prefetch_fblock(). */
+    struct DemandLoad
+    {
+        volatile int& counter;
+        explicit DemandLoad(volatile int& c) : counter(c) { __sync_add_and_fetch(&counter, 1); }
+        ~DemandLoad() { __sync_sub_and_fetch(&counter, 1); }
+    private:
+        DemandLoad(const DemandLoad&);
+        void operator=(const DemandLoad&);
+    };
+}
+
+/* A pool of threads that decompress fblocks into the cache
+ * in the background, in the order they were requested.
+ */
+class cromfs_prefetcher
+{
+public:
+    cromfs_prefetcher(cromfs& f, unsigned num_threads)
+        : fs(f), lock(), cond(), queue(), terminate(false), threads()
+    {
+        pthread_mutex_init(&lock, NULL);
+        pthread_cond_init(&cond, NULL);
+
+        /* Leave the signals to the threads that were there before. */
+        sigset_t all, saved;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &saved);
+        for(unsigned a=0; a<num_threads; ++a)
+        {
+            pthread_t t;
+            if(pthread_create(&t, NULL, Worker, this) != 0) break;
+            threads.push_back(t);
+        }
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    }
+
+    ~cromfs_prefetcher()
+    {
+        pthread_mutex_lock(&lock);
+        terminate = true;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+
+        for(size_t a=0; a<threads.size(); ++a)
+            pthread_join(threads[a], NULL);
 
-        uint_fast32_t bytes = std::min(fblock.size() - startoffs, size);
-        std::memcpy(target, &fblock[startoffs], bytes);
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&lock);
+    }
+
+    void Enqueue(cromfs_fblocknum_t fblocknum)
+    {
+        pthread_mutex_lock(&lock);
+        if(std::find(queue.begin(), queue.end(), fblocknum) == queue.end())
+        {
+            queue.push_back(fblocknum);
+            /* If the readers are way ahead of us, the oldest
+             * requests are already useless. */
+            while(queue.size() > 4 * PREFETCH_FBLOCKS + 16)
+                queue.pop_front();
+            pthread_cond_signal(&cond);
+        }
+        pthread_mutex_unlock(&lock);
+    }
+
+private:
+    static void* Worker(void* arg)
+    {
+        cromfs_prefetcher& self = *(cromfs_prefetcher*)arg;
+        for(;;)
+        {
+            pthread_mutex_lock(&self.lock);
+            while(self.queue.empty() && !self.terminate)
+                pthread_cond_wait(&self.cond, &self.lock);
+            if(self.terminate)
+            {
+                pthread_mutex_unlock(&self.lock);
+                break;
+            }
+            const cromfs_fblocknum_t fblocknum = self.queue.front();
+            self.queue.pop_front();
+            pthread_mutex_unlock(&self.lock);
+
+            self.fs.prefetch_fblock(fblocknum);
+        }
+        return NULL;
+    }
+
+private:
+    cromfs& fs;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    std::deque<cromfs_fblocknum_t> queue;
+    bool terminate;
+    std::vector<pthread_t> threads;
+
+private:
+    cromfs_prefetcher(const cromfs_prefetcher&);
+    void operator=(const cromfs_prefetcher&);
+};
+
+/* A thread that stores the fblocks evicted from the RAM cache into
+ * the disk cache, so that the read that caused the eviction need not
+ * wait for the write. If the disk falls behind, the fblocks that do
+ * not fit in the queue are not stored at all.
+ */
+class cromfs_disk_cache_writer
+{
+public:
+    enum { MAX_QUEUED = 8 };
+
+    explicit cromfs_disk_cache_writer(cromfs& f)
+        : fs(f), lock(), cond(), queue(), terminate(false), thread(), running(false)
+    {
+        pthread_mutex_init(&lock, NULL);
+        pthread_cond_init(&cond, NULL);
+
+        /* Leave the signals to the threads that were there before. */
+        sigset_t all, saved;
+        sigfillset(&all);
+        pthread_sigmask(SIG_SETMASK, &all, &saved);
+        running = pthread_create(&thread, NULL, Worker, this) == 0;
+        pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    }
+
+    /* Stores what is still in the queue before returning. */
+    ~cromfs_disk_cache_writer()
+    {
+        pthread_mutex_lock(&lock);
+        terminate = true;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&lock);
+
+        if(running) pthread_join(thread, NULL);
+
+        pthread_cond_destroy(&cond);
+        pthread_mutex_destroy(&lock);
+    }
+
+    /* Returns false if the fblock was not queued. */
+    bool Enqueue(cromfs_fblocknum_t fblocknum, const cromfs_cached_fblock& fblock)
+    {
+        if(!running) return false;
+        pthread_mutex_lock(&lock);
+        const bool ok = queue.size() < MAX_QUEUED;
+        if(ok)
+        {
+            queue.push_back(std::make_pair(fblocknum, fblock));
+            pthread_cond_signal(&cond);
+        }
+        pthread_mutex_unlock(&lock);
+        return ok;
+    }
+
+private:
+    static void* Worker(void* arg)
+    {
+        cromfs_disk_cache_writer& self = *(cromfs_disk_cache_writer*)arg;
+        for(;;)
+        {
+            pthread_mutex_lock(&self.lock);
+            while(self.queue.empty() && !self.terminate)
+                pthread_cond_wait(&self.cond, &self.lock);
+            if(self.queue.empty())
+            {
+                pthread_mutex_unlock(&self.lock);
+                break;
+            }
+            const std::pair<cromfs_fblocknum_t, cromfs_cached_fblock> job = self.queue.front();
+            self.queue.pop_front();
+            pthread_mutex_unlock(&self.lock);
+
+            self.fs.store_fblock_on_disk(job.first, job.second);
+        }
+        return NULL;
+    }
+
+private:
+    cromfs& fs;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    std::deque< std::pair<cromfs_fblocknum_t, cromfs_cached_fblock> > queue;
+    bool terminate;
+    pthread_t thread;
+    bool running;
+
+private:
+    cromfs_disk_cache_writer(const cromfs_disk_cache_writer&);
+    void operator=(const cromfs_disk_cache_writer&);
+};
+
+void cromfs::prefetch_file_data(const cromfs_inode_internal& inode,
+                                uint_fast64_t offset)
+    throw (cromfs_exception, std::bad_alloc)
+{
+    if(!PREFETCH_FBLOCKS || !PREFETCH_THREADS) return;
+
+    /* Find the next distinct fblocks in the file. Don't look
+     * too far though, in case the file is just one fblock
+     * repeated over and over. */
+    std::vector<cromfs_fblocknum_t> wanted;
+    cromfs_cached_blktab_chunk chunk;
+    const uint_fast64_t bsize = inode.blocksize;
+    for(uint_fast64_t index = offset / bsize, limit = index + 4096;
+        index < inode.blocklist.size() && index < limit
+        && wanted.size() < PREFETCH_FBLOCKS;
+        ++index)
+    {
+        cromfs_block_internal block;
+        if(!get_block(inode.blocklist[index], block, chunk)) break;
+        const cromfs_fblocknum_t fblocknum = block.fblocknum;
+        if(std::find(wanted.begin(), wanted.end(), fblocknum) == wanted.end())
+            wanted.push_back(fblocknum);
+    }
+
+    cromfs_prefetcher* pool;
+    {
+        ScopedLock lck(prefetcher_lock);
+        if(!prefetcher) prefetcher = new cromfs_prefetcher(*this, PREFETCH_THREADS);
+        pool = prefetcher;
+    }
+
+    for(size_t a=0; a<wanted.size(); ++a)
+    {
+        const cromfs_fblocknum_t fblocknum = wanted[a];
+        if(fblocknum >= fblktab.size() || fblock_cache->Has(fblock_key(fblocknum))) continue;
+
+        advise_image(fblktab[fblocknum].filepos, fblktab[fblocknum].length,
+                     FadviseWillNeed, MadviseWillNeed);
+        pool->Enqueue(fblocknum);
+        cromfs_stat_add(stats.prefetch_queued);
     }
 }
 
-cromfs_cached_fblock& cromfs::read_fblock(cromfs_fblocknum_t fblocknum)
+cromfs_cached_fblock cromfs::get_fblock(cromfs_fblocknum_t fblocknum)
         throw (cromfs_exception, std::bad_alloc)
 {
-    cromfs_cached_fblock* result = fblock_cache.Find(fblocknum);
-    if(result) return *result;
+    cromfs_cached_fblock result;
+    if(fblock_cache->Get(fblock_key(fblocknum), result))
+    {
+        cromfs_stat_add(stats.fblock_hits);
+        note_fblock_use(result);
+        return result;
+    }
 
-    cromfs_cached_fblock b = read_fblock_uncached(fblocknum);
+    /* Not cached. Only one thread decompresses any given fblock;
+     * the others wait here and then find it in the cache.
+     */
+    ScopedLock lck(fblock_load_locks[fblocknum % FBLOCK_LOAD_LOCK_COUNT]);
+    if(fblock_cache->Get(fblock_key(fblocknum), result))
+    {
+        cromfs_stat_add(stats.fblock_hits);
+        note_fblock_use(result);
+        return result;
+    }
 
-    result = &fblock_cache.Put(fblocknum, b);
+    cromfs_stat_add(stats.fblock_misses);
+    DemandLoad demand(demand_loads);
+    result = load_fblock_from_disk(fblocknum);
+    if(!result) result = load_fblock(fblocknum);
+    put_fblock(fblocknum, result);
+    return result;
+}
 
-    return *result;
+cromfs_cached_fblock cromfs::cache_fblock(cromfs_fblocknum_t fblocknum,
+                                          std::vector<unsigned char>& compressed)
+        throw (cromfs_exception, std::bad_alloc)
+{
+    cromfs_cached_fblock result;
+    ScopedLock lck(fblock_load_locks[fblocknum % FBLOCK_LOAD_LOCK_COUNT]);
+    if(fblock_cache->Get(fblock_key(fblocknum), result))
+    {
+        cromfs_stat_add(stats.fblock_hits);
+        note_fblock_use(result);
+        return result;
+    }
+
+    cromfs_stat_add(stats.fblock_misses);
+    cromfs_stat_add(stats.fblocks_read);
+    cromfs_stat_add(stats.compressed_bytes_read, compressed.size());
+    result = new cromfs_fblock_buffer(compressed);
+    put_fblock(fblocknum, result);
+    return result;
 }
 
-cromfs_cached_fblock cromfs::read_fblock_uncached(cromfs_fblocknum_t fblocknum) const
+void cromfs::put_fblock(cromfs_fblocknum_t fblocknum, const cromfs_cached_fblock& fblock)
+        throw (std::bad_alloc)
+{
+    cromfs_fblock_cache::EvictedList evicted;
+    fblock_cache->Put(fblock_key(fblocknum), fblock, &evicted);
+    retire_fblocks(evicted);
+}
+
+void cromfs::retire_fblocks(
+    const cromfs_fblock_cache::EvictedList& evicted)
+        throw ()
+{
+    cromfs_stat_add(stats.fblock_evictions, evicted.size());
+    for(size_t a=0; a<evicted.size(); ++a)
+    {
+        /* In a shared cache, this may evict the fblocks of other cromfs
+         * objects too. They are simply dropped; the disk cache is only
+         * for our own. */
+        if((evicted[a].first & ~UINT64_C(0xFFFFFFFF)) != fblock_key_base) continue;
+
+        const cromfs_fblocknum_t fblocknum = evicted[a].first & 0xFFFFFFFFUL;
+        const cromfs_cached_fblock& fblock = evicted[a].second;
+        if(fblock->unread_prefetch) cromfs_stat_add(stats.prefetch_wasted);
+
+        /* A partially decoded fblock is not worth the disk space,
+         * nor one that decodes fast anyway;
+         * an fblock that came from the disk cache is there already. */
+        if(!disk_cache.IsOpen()
+        || fblock->decoded() != fblock->size()
+        || fblock->cheap_to_decode()
+        || disk_cache.Find(fblocknum) == fblock->size()) continue;
+
+        /* The writing is left to a background thread. The writer is
+         * started at the first eviction, like the prefetch threads,
+         * so that it is never started before Fuse forks to background. */
+        cromfs_disk_cache_writer* writer = 0;
+        try
+        {
+            ScopedLock lck(disk_writer_lock);
+            if(!disk_writer) disk_writer = new cromfs_disk_cache_writer(*this);
+            writer = disk_writer;
+        }
+        catch(const std::bad_alloc&)
+        {
+        }
+        if(!writer || !writer->Enqueue(fblocknum, fblock))
+            cromfs_stat_add(stats.disk_cache_skipped);
+    }
+}
+
+void cromfs::store_fblock_on_disk(cromfs_fblocknum_t fblocknum,
+                                  const cromfs_cached_fblock& fblock)
+        throw ()
+{
+    disk_cache.Put(fblocknum, fblock->data(), fblock->size());
+    cromfs_stat_add(stats.disk_cache_writes);
+}
+
+namespace
+{
+    struct IsFblockKeyOf
+    {
+        uint_fast64_t base;
+        explicit IsFblockKeyOf(uint_fast64_t b) : base(b) { }
+        bool operator() (uint_fast64_t key) const
+            { return (key & ~UINT64_C(0xFFFFFFFF)) == base; }
+    };
+}
+
+void cromfs::forget_fblocks() throw()
+{
+    if(fblock_cache == &owned_fblock_cache)
+        fblock_cache->clear();
+    else
+        fblock_cache->EraseIf(IsFblockKeyOf(fblock_key_base));
+}
+
+cromfs_cached_fblock cromfs::load_fblock_from_disk(cromfs_fblocknum_t fblocknum)
+        throw (std::bad_alloc)
+{
+    const uint_fast32_t length = disk_cache.Find(fblocknum);
+    if(!length || fblocknum >= fblktab.size()) return cromfs_cached_fblock();
+
+    cromfs_fblock_buffer* fblock = new cromfs_fblock_buffer(length);
+    const cromfs_cached_fblock result = fblock;
+    if(!disk_cache.Read(fblocknum, fblock->fill_data(), length))
+        return cromfs_cached_fblock();
+    cromfs_stat_add(stats.disk_cache_hits);
+    return result;
+}
+
+void cromfs::open_disk_cache(const cromfs_superblock_internal::BufferType& Superblock)
+        throw (std::bad_alloc)
+{
+    disk_cache.Close();
+    if(DISK_CACHE_FILE.empty()) return;
+
+    /* The cache is only valid for this very image. A rebuilt image
+     * differs in the superblock, or at least in size or mtime. */
+    struct stat64 st;
+    if(fstat64(fd, &st) < 0) return;
+
+    std::vector<unsigned char> identity(sizeof(Superblock) + 16);
+    std::memcpy(&identity[0], Superblock, sizeof(Superblock));
+    put_64(&identity[sizeof(Superblock)],   st.st_size);
+    put_64(&identity[sizeof(Superblock)+8], st.st_mtime);
+
+    if(!disk_cache.Open(DISK_CACHE_FILE, DISK_CACHE_MAX_BYTES, CROMFS_FSIZE, identity))
+        std::fprintf(stderr, "cromfs: cannot use %s as a disk cache\n",
+            DISK_CACHE_FILE.c_str());
+}
+
+void cromfs::get_fblocks(const std::vector<cromfs_fblocknum_t>& fblocknums,
+                         const std::vector<uint_fast32_t>& upto,
+                         std::vector<cromfs_cached_fblock>& result)
+        throw (cromfs_exception, std::bad_alloc)
+{
+    const ssize_t n = fblocknums.size();
+    result.resize(n);
+
+    /* Start reading all the missing fblocks at once. When the image is
+     * memory-mapped, there is nothing to read; the page faults do it.
+     * The reader is declared last, so that its destructor waits for
+     * any reads still in progress before their targets are freed.
+     */
+    const size_t not_requested = ~(size_t)0;
+    std::vector< std::vector<unsigned char> > compressed(n);
+    std::vector<size_t> requests(n, not_requested);
+    BatchFileRead reader(fd);
+    if(!image_map && n > 1)
+    {
+        for(ssize_t a=0; a<n; ++a)
+        {
+            const cromfs_fblocknum_t fblocknum = fblocknums[a];
+            if(fblocknum >= fblktab.size() || fblock_cache->Has(fblock_key(fblocknum))
+            || disk_cache.Find(fblocknum)) continue;
+
+            compressed[a].resize(fblktab[fblocknum].length);
+            requests[a] = reader.Add(fblktab[fblocknum].filepos,
+                                     compressed[a].size(), &compressed[a][0]);
+        }
+        reader.Submit();
+    }
+
+    /* Exceptions must not leave the OpenMP region, so they are carried out. */
+    int error = 0;
+  #pragma omp parallel for schedule(dynamic) if(n > 1)
+    for(ssize_t a=0; a<n; ++a)
+    {
+        try
+        {
+            if(requests[a] != not_requested)
+            {
+                DemandLoad demand(demand_loads);
+                const int e = reader.Wait(requests[a]);
+                if(e) throw e;
+                result[a] = cache_fblock(fblocknums[a], compressed[a]);
+            }
+            else
+                result[a] = get_fblock(fblocknums[a]);
+
+            if(!upto.empty())
+                decode_fblock(fblocknums[a], result[a], upto[a]);
+        }
+        catch(cromfs_exception e)      { error = e; }
+        catch(const std::bad_alloc&) { error = ENOMEM; }
+    }
+    if(error) throw error;
+}
+
+void cromfs::decode_fblock(cromfs_fblocknum_t fblocknum,
+                           const cromfs_cached_fblock& fblock,
+                           uint_fast32_t upto)
+        throw (cromfs_exception, std::bad_alloc)
+{
+    if(likely(upto <= fblock->decoded())) return;
+
+    DemandLoad demand(demand_loads);
+    if(!timed_decode(fblock, upto)) return;
+
+    cromfs_fblock_cache::EvictedList evicted;
+    fblock_cache->UpdateCost(fblock_key(fblocknum), &evicted);
+    retire_fblocks(evicted);
+}
+
+bool cromfs::timed_decode(const cromfs_cached_fblock& fblock, size_t upto) const
+        throw (cromfs_exception, std::bad_alloc)
+{
+    const size_t        before = fblock->decoded();
+    const uint_fast64_t begin  = GetTimeMicros();
+    if(!fblock->decode(upto)) return false;
+    stats.decompress_time.Add(GetTimeMicros() - begin);
+    cromfs_stat_add(stats.decompressed_bytes, fblock->decoded() - before);
+    return true;
+}
+
+void cromfs::note_fblock_use(const cromfs_cached_fblock& fblock) const
+{
+    if(fblock->unread_prefetch
+    && __sync_bool_compare_and_swap(&fblock->unread_prefetch, 1, 0))
+        cromfs_stat_add(stats.prefetch_used);
+}
+
+void cromfs::prefetch_fblock(cromfs_fblocknum_t fblocknum) throw()
+{
+    /* Don't compete for the CPU with the decompression of fblocks
+     * that somebody is waiting for right now. The prefetch is dropped
+     * rather than delayed; if the fblock is still needed, it will be
+     * loaded on demand. */
+    if(demand_loads > 0) return;
+
+    if(fblocknum >= fblktab.size() || fblock_cache->Has(fblock_key(fblocknum))) return;
+
+    try
+    {
+        cromfs_cached_fblock fblock;
+        {
+            /* The same load lock as in get_fblock(), so that the fblock
+             * is not loaded twice at once. Only the compressed data is
+             * read under it, as in get_fblock(); a demand load of this
+             * fblock, or of another one behind the same lock, must not
+             * wait for the decompression. */
+            ScopedLock lck(fblock_load_locks[fblocknum % FBLOCK_LOAD_LOCK_COUNT]);
+            if(fblock_cache->Has(fblock_key(fblocknum))) return;
+
+            fblock = load_fblock_from_disk(fblocknum);
+            if(!fblock) fblock = load_fblock(fblocknum);
+            fblock->unread_prefetch = 1;
+            cromfs_stat_add(stats.prefetch_loaded);
+            put_fblock(fblocknum, fblock);
+        }
+
+        /* Decompress it a piece at a time, so that a reader of this
+         * fblock waits for one piece at most. Once some read is waiting
+         * for the decompression of any fblock, the rest is left for
+         * whoever reads this fblock next. */
+        bool decoded = false;
+        while(fblock->decoded() < fblock->size() && demand_loads <= 0)
+            if(timed_decode(fblock, fblock->decoded() + 1))
+                decoded = true;
+
+        if(decoded)
+        {
+            cromfs_fblock_cache::EvictedList evicted;
+            fblock_cache->UpdateCost(fblock_key(fblocknum), &evicted);
+            retire_fblocks(evicted);
+        }
+    }
+    catch(cromfs_exception)
+    {
+        /* The demand load will report it. */
+    }
+    catch(const std::bad_alloc&)
+    {
+    }
+}
+
+cromfs_cached_fblock cromfs::load_fblock(cromfs_fblocknum_t fblocknum) const
         throw (cromfs_exception, std::bad_alloc)
 {
     if(fblocknum >= fblktab.size())
@@ -637,7 +1675,25 @@ cromfs_cached_fblock cromfs::read_fblock_uncached(cromfs_fblocknum_t fblocknum)
         (unsigned)fblocknum, (unsigned)comp_size,
         (unsigned long long)filepos);
 #endif
-    return DoLZMALoading(fd, filepos, comp_size);
+    cromfs_stat_add(stats.fblocks_read);
+    cromfs_stat_add(stats.compressed_bytes_read, comp_size);
+
+    const unsigned char* mapped = mapped_image(filepos, comp_size);
+    if(mapped)
+        return new cromfs_fblock_buffer(mapped, comp_size);
+
+    std::vector<unsigned char> compressed(comp_size);
+    LongFileRead(fd, filepos, comp_size, &compressed[0]);
+
+    return new cromfs_fblock_buffer(compressed);
+}
+
+cromfs_cached_fblock cromfs::read_fblock_uncached(cromfs_fblocknum_t fblocknum) const
+        throw (cromfs_exception, std::bad_alloc)
+{
+    const cromfs_cached_fblock result = load_fblock(fblocknum);
+    timed_decode(result, result->size());
+    return result;
 }
 
 int_fast64_t cromfs::read_file_data(
@@ -668,6 +1724,7 @@ int_fast64_t cromfs::read_file_data_from_one_fblock_only(
     fprintf(stderr, "- Accessing fblock %u\n", (unsigned)allowed_fblocknum);
 #endif
     const uint_fast64_t bsize = inode.blocksize;
+    cromfs_cached_blktab_chunk chunk;
 
     for(uint_fast64_t pos    = std::min(inode.bytesize, offset),
                       endpos = std::min(inode.bytesize, offset + size);
@@ -682,9 +1739,9 @@ int_fast64_t cromfs::read_file_data_from_one_fblock_only(
         const uint_fast64_t consume_bytes = std::min(endpos-pos, remain_block_bytes);
 
         const cromfs_blocknum_t blocknum = inode.blocklist[begin_block_index];
-        if(blocknum >= blktab.size()) break; // throw EIO;
+        cromfs_block_internal block;
+        if(!get_block(blocknum, block, chunk)) break; // throw EIO;
 
-        const cromfs_block_internal& block = blktab[blocknum];
         const cromfs_fblocknum_t fblocknum = block.fblocknum;
 
         if(fblocknum != allowed_fblocknum)
@@ -757,9 +1814,6 @@ int_fast64_t cromfs::read_file_data(
 #if READFILE_DEBUG >= 2
     fprintf(stderr, "- source inode: %s\n", DumpInode(inode).c_str());
 #endif
-    if(blktab.empty()) reread_blktab();
-    cromfs_setup_alarm(*this);
-
     std::vector<cromfs_fblocknum_t> required_fblocks_cached;
     std::vector<cromfs_fblocknum_t> required_fblocks_uncached;
 
@@ -777,6 +1831,7 @@ int_fast64_t cromfs::read_file_data(
          */
         std::vector<unsigned long> required_fblocks_set
             ( (fblktab.size() + bitset_bitness-1) / bitset_bitness );
+        cromfs_cached_blktab_chunk chunk;
 
         for(uint_fast64_t pos    = std::min(inode.bytesize, offset),
                           endpos = std::min(inode.bytesize, offset + size);
@@ -791,8 +1846,8 @@ int_fast64_t cromfs::read_file_data(
             const uint_fast64_t consume_bytes = std::min(endpos-pos, remain_block_bytes);
 
             const cromfs_blocknum_t blocknum = inode.blocklist[begin_block_index];
-            if(blocknum >= blktab.size()) break; // throw EIO;
-            const cromfs_block_internal& block = blktab[blocknum];
+            cromfs_block_internal block;
+            if(!get_block(blocknum, block, chunk)) break; // throw EIO;
             const cromfs_fblocknum_t fblocknum = block.fblocknum;
 
             if(fblocknum < fblktab.size())
@@ -804,7 +1859,7 @@ int_fast64_t cromfs::read_file_data(
                 {
                     required_fblocks_set[fblock_bit_index] |= fblock_bit_value;
 
-                    if(fblock_cache.Has(fblocknum))
+                    if(fblock_cache->Has(fblock_key(fblocknum)))
                     {
                         required_fblocks_cached.push_back(fblocknum);
                     }
@@ -812,8 +1867,8 @@ int_fast64_t cromfs::read_file_data(
                     {
                         required_fblocks_uncached.push_back(fblocknum);
                         // Initiate background reading for them.
-                        FadviseWillNeed(fd, fblktab[fblocknum].filepos,
-                                            fblktab[fblocknum].length);
+                        advise_image(fblktab[fblocknum].filepos, fblktab[fblocknum].length,
+                                     FadviseWillNeed, MadviseWillNeed);
                     }
                 }
             }
@@ -836,9 +1891,20 @@ int_fast64_t cromfs::read_file_data(
     fprintf(stderr, "\n");
 #endif
 
+    /* Read the compressed data of the missing fblocks with one batch of I/O.
+     * "loaded" keeps them pinned even if the cache evicts them meanwhile.
+     */
+    std::vector<cromfs_cached_fblock> loaded;
+    if(required_fblocks_uncached.size() > 1)
+        get_fblocks(required_fblocks_uncached, std::vector<uint_fast32_t>(), loaded);
+
     uint_fast64_t result = 0;
 
-#pragma omp parallel reduction(+:result)
+    /* Only fan out when there is decompression work to share.
+     * Reads from cached fblocks are mere memcpy()s, and the Fuse
+     * loop may already be calling us from several threads.
+     */
+#pragma omp parallel reduction(+:result) if(required_fblocks_uncached.size() > 1)
   {
     /* Note: Using ssize_t instead of size_t here because "omp for"
      *       requires a signed iteration variable instead of unsigned.
@@ -870,24 +1936,230 @@ int_fast64_t cromfs::read_file_data(
     }
   }
 
-    fblock_cache.CheckAges(-1);
+    return result;
+}
+
+namespace
+{
+    /* Appends a segment, merging it into the previous one
+     * when they refer to contiguous data. */
+    void AddSegment(std::vector<cromfs_data_segment>& segments, size_t first,
+                    const cromfs_cached_fblock& fblock,
+                    uint_fast32_t offset, uint_fast32_t size)
+    {
+        if(segments.size() > first)
+        {
+            cromfs_data_segment& prev = segments.back();
+            const cromfs_fblock_buffer* prev_buf = prev.fblock, *buf = fblock;
+            if(prev_buf == buf
+            && (!buf || prev.offset + prev.size == offset))
+            {
+                prev.size += size;
+                return;
+            }
+        }
+        segments.push_back(cromfs_data_segment());
+        cromfs_data_segment& seg = segments.back();
+        seg.fblock = fblock;
+        seg.offset = offset;
+        seg.size   = size;
+    }
+}
+
+uint_fast64_t cromfs::map_file_data(
+    const cromfs_inode_internal& inode,
+    uint_fast64_t offset, uint_fast64_t size,
+    std::vector<cromfs_data_segment>& segments)
+    throw (cromfs_exception, std::bad_alloc)
+{
+    const uint_fast64_t bsize = inode.blocksize;
+    const uint_fast64_t endpos = std::min(inode.bytesize, offset + size);
+    cromfs_cached_blktab_chunk chunk;
+
+    /* First resolve the blocks into fblock ranges,
+     * and make a list of the fblocks that must be decompressed.
+     */
+    std::vector<cromfs_block_internal> ranges;
+    std::vector<uint_fast32_t> range_sizes;
+    std::vector<cromfs_fblocknum_t> uncached;
+    for(uint_fast64_t pos = std::min(inode.bytesize, offset); pos < endpos; )
+    {
+        const uint_fast64_t block_index  = pos / bsize;
+        const uint_fast32_t block_offset = pos % bsize;
+        if(block_index >= inode.blocklist.size()) break;
+
+        const uint_fast64_t consume_bytes = std::min(endpos-pos, bsize - block_offset);
+
+        const cromfs_blocknum_t blocknum = inode.blocklist[block_index];
+        cromfs_block_internal block;
+        if(!get_block(blocknum, block, chunk)) break; // throw EIO;
+
+        cromfs_block_internal range;
+        range.define(block.fblocknum, block.startoffs + block_offset);
+        ranges.push_back(range);
+        range_sizes.push_back(consume_bytes);
+
+        if(block.fblocknum < fblktab.size()
+        && std::find(uncached.begin(), uncached.end(), block.fblocknum) == uncached.end()
+        && !fblock_cache->Has(fblock_key(block.fblocknum)))
+        {
+            uncached.push_back(block.fblocknum);
+            advise_image(fblktab[block.fblocknum].filepos, fblktab[block.fblocknum].length,
+                         FadviseWillNeed, MadviseWillNeed);
+        }
+        pos += consume_bytes;
+    }
 
+    /* Read and decompress the missing fblocks in parallel,
+     * as far as this read needs them.
+     * "loaded" keeps them pinned even if the cache evicts them meanwhile.
+     */
+    std::vector<uint_fast32_t> upto(uncached.size());
+    for(size_t a=0; a<uncached.size(); ++a)
+        for(size_t b=0; b<ranges.size(); ++b)
+            if(ranges[b].fblocknum == uncached[a])
+                upto[a] = std::max(upto[a], (uint_fast32_t)(ranges[b].startoffs + range_sizes[b]));
+    std::vector<cromfs_cached_fblock> loaded;
+    get_fblocks(uncached, upto, loaded);
+
+    const size_t first = segments.size();
+    uint_fast64_t result = 0;
+    cromfs_cached_fblock fblock;
+    for(size_t a=0; a<ranges.size(); ++a)
+    {
+        const cromfs_fblocknum_t fblocknum = ranges[a].fblocknum;
+        const uint_fast32_t startoffs = ranges[a].startoffs;
+        const uint_fast32_t size = range_sizes[a];
+
+        if(a == 0 || fblocknum != ranges[a-1].fblocknum)
+        {
+            const size_t u = std::find(uncached.begin(), uncached.end(), fblocknum) - uncached.begin();
+            if(u < uncached.size())
+                fblock = loaded[u];
+            else
+                fblock = fblocknum < fblktab.size() ? get_fblock(fblocknum) : cromfs_cached_fblock();
+        }
+
+        /* The part that the fblock does not have reads as zeros. */
+        uint_fast32_t have = 0;
+        if(fblock && startoffs < fblock->size())
+        {
+            have = std::min((uint_fast32_t)(fblock->size() - startoffs), size);
+            decode_fblock(fblocknum, fblock, startoffs + have);
+        }
+
+        if(have > 0)      AddSegment(segments, first, fblock, startoffs, have);
+        if(have < size)   AddSegment(segments, first, cromfs_cached_fblock(), 0, size - have);
+        result += size;
+    }
     return result;
 }
 
-static const cromfs_dirinfo get_dirinfo_portion(const cromfs_dirinfo& full,
-                                                uint_fast32_t dir_offset,
-                                                uint_fast32_t dir_count)
+void cromfs_cached_dir::add(const char* name, size_t length, cromfs_inodenum_t inonum)
 {
-    cromfs_dirinfo::const_iterator j = full.begin();
+    if(!inodes.empty())
+    {
+        const char* prev_begin = this->name(inodes.size()-1);
+        const char* prev_end   = &names.back(); // its nul
+        if(std::lexicographical_compare(name, name+length,
+                                        prev_begin, prev_end,
+                                        CompareUnsigned))
+            sorted = false;
+    }
+    name_offsets.push_back(names.size());
+    inodes.push_back(inonum);
+    names.insert(names.end(), name, name+length);
+    names.push_back('\0');
+}
 
-    for(; dir_offset > 0 && j != full.end(); ++j, --dir_offset) ;
+bool cromfs_cached_dir::CompareUnsigned(char a, char b)
+{
+    /* std::string compares the characters as unsigned. */
+    return (unsigned char)a < (unsigned char)b;
+}
+
+cromfs_inodenum_t cromfs_cached_dir::find(const std::string& search_name) const
+{
+    if(!sorted)
+    {
+        for(size_t a=0; a<size(); ++a)
+            if(search_name == name(a)) return inodes[a];
+        return 0;
+    }
+
+    size_t first = 0, len = size();
+    while(len > 0)
+    {
+        const size_t half = len / 2, middle = first + half;
+        const int c = search_name.compare(name(middle));
+        if(c == 0) return inodes[middle];
+        if(c > 0) { first = middle + 1; len = len - half - 1; }
+        else      len = half;
+    }
+    return 0;
+}
+
+void cromfs_cached_dir::get_portion(cromfs_dirinfo& result,
+                                    uint_fast32_t dir_offset,
+                                    uint_fast32_t dir_count) const
+{
+    if(dir_offset >= size()) return;
+    const size_t end = dir_offset + std::min((size_t)dir_count, size() - dir_offset);
+
+    /* The entries are usually in order already, so each
+     * insertion goes right at the end of the map. */
+    for(size_t a=dir_offset; a<end; ++a)
+        result.insert(result.end(), cromfs_dirinfo::value_type(name(a), inodes[a]));
+}
+
+size_t cromfs_cached_dir::num_bytes() const
+{
+    return sizeof(*this)
+         + names.capacity()
+         + name_offsets.capacity() * sizeof(name_offsets[0])
+         + inodes.capacity() * sizeof(inodes[0]);
+}
+
+void cromfs_cached_dir::swap(cromfs_cached_dir& b)
+{
+    names.swap(b.names);
+    name_offsets.swap(b.name_offsets);
+    inodes.swap(b.inodes);
+    std::swap(sorted, b.sorted);
+}
+
+namespace
+{
+    /* Copies a portion of a cached directory while the cache is locked. */
+    struct DirPortionCopier
+    {
+        uint_fast32_t dir_offset, dir_count;
+        cromfs_dirinfo result;
+
+        DirPortionCopier(uint_fast32_t o, uint_fast32_t c)
+            : dir_offset(o), dir_count(c), result() { }
+
+        void operator() (const cromfs_cached_dir& cached)
+        {
+            cached.get_portion(result, dir_offset, dir_count);
+        }
+    };
 
-    cromfs_dirinfo::const_iterator first = j;
+    /* Finds a name in a cached directory while the cache is locked. */
+    struct DirNameFinder
+    {
+        const std::string& name;
+        cromfs_inodenum_t result;
 
-    for(; dir_count > 0 && j != full.end(); ++j, --dir_count) ;
+        explicit DirNameFinder(const std::string& n) : name(n), result(0) { }
 
-    return cromfs_dirinfo(first, j);
+        void operator() (const cromfs_cached_dir& cached)
+        {
+            result = cached.find(name);
+        }
+    private:
+        void operator=(const DirNameFinder&);
+    };
 }
 
 const cromfs_dirinfo cromfs::read_dir(cromfs_inodenum_t inonum,
@@ -895,21 +2167,19 @@ const cromfs_dirinfo cromfs::read_dir(cromfs_inodenum_t inonum,
                                       uint_fast32_t dir_count)
     throw (cromfs_exception, std::bad_alloc)
 {
-    cromfs_dirinfo* cached = readdir_cache.Find(inonum);
-    if(cached)
+    DirPortionCopier copier(dir_offset, dir_count);
+    if(readdir_cache.Access(inonum, copier))
     {
-        if(dir_offset == 0 && dir_count >= cached->size())
-        {
-            return *cached;
-        }
-        return get_dirinfo_portion(*cached, dir_offset, dir_count);
+        cromfs_stat_add(stats.readdir_hits);
+        return copier.result;
     }
+    cromfs_stat_add(stats.readdir_misses);
 
     const cromfs_inode_internal inode = read_inode_and_blocks(inonum);
     if(inonum != 1 && !S_ISDIR(inode.mode))
         { throw ENOTDIR; }
 
-    cromfs_dirinfo result;
+    cromfs_cached_dir dir;
 
     unsigned char DirHeader[4];
     if(read_file_data(inode, 0, DirHeader, 4, "dir size") < 4)
@@ -964,6 +2234,9 @@ const cromfs_dirinfo cromfs::read_dir(cromfs_inodenum_t inonum,
 
             const unsigned name_buf_size = entry_offsets[num_to_read] - entry_offsets[0];
             std::vector<unsigned char> name_buf(name_buf_size);
+            dir.names.reserve(name_buf_size);
+            dir.name_offsets.reserve(num_to_read);
+            dir.inodes.reserve(num_to_read);
 
             read_file_data(inode,
                            entry_offsets[0],
@@ -1009,38 +2282,84 @@ const cromfs_dirinfo cromfs::read_dir(cromfs_inodenum_t inonum,
                     goto error_entry;
                 }
 
-                result[std::string(filename, nul_pointer)] = inonumber;
+                dir.add((const char*)filename, nul_pointer - filename, inonumber);
             }
         }
     }
 
+    cromfs_dirinfo result;
+    dir.get_portion(result, 0, dir.size());
+
     if(dir_offset == 0 && dir_count >= num_files)
     {
-        readdir_cache.CheckAges(-1);
-        readdir_cache.Put(inonum, result);
+        readdir_cache.PutSwap(inonum, dir);
     }
     return result;
 }
 
+cromfs_inodenum_t cromfs::dir_lookup_hashed(const cromfs_inode_internal& inode,
+                                            uint_fast64_t slots_offs,
+                                            uint_fast32_t slots,
+                                            const std::string& search_name)
+    throw (cromfs_exception, std::bad_alloc)
+{
+    const uint_fast32_t hash = directory_name_hash(search_name.data(), search_name.size());
+
+    /* The index is at most half full, so the probe sequence
+     * usually ends within the first few slots. Read them in groups.
+     */
+    const unsigned group = 8;
+    unsigned char SlotBuf[group * 8];
+    std::vector<unsigned char> entry_buf(8 + search_name.size() + 1);
+
+    uint_fast32_t slot = hash & (slots-1);
+    for(uint_fast32_t probed = 0; probed < slots; )
+    {
+        const unsigned n = std::min((uint_fast32_t)group, std::min(slots - slot, slots - probed));
+        if(read_file_data(inode, slots_offs + slot*8, SlotBuf, n*8, "dir index") < n*8)
+            throw EIO;
+
+        for(unsigned a=0; a<n; ++a)
+        {
+            const uint_fast32_t entry_offs = get_32(SlotBuf + a*8 + 4);
+            if(entry_offs == 0) return 0; // Empty slot: not found
+            if(get_32(SlotBuf + a*8) != hash) continue;
+
+            /* Compare the name, including its nul terminator. */
+            if(entry_offs + entry_buf.size() <= inode.bytesize
+            && read_file_data(inode, entry_offs, &entry_buf[0], entry_buf.size(), "dir entry")
+                   == (int_fast64_t)entry_buf.size()
+            && std::memcmp(&entry_buf[8], search_name.c_str(), search_name.size()+1) == 0)
+            {
+                return get_64(&entry_buf[0]);
+            }
+        }
+        probed += n;
+        slot = (slot + n) & (slots-1);
+    }
+    return 0;
+}
+
 cromfs_inodenum_t cromfs::dir_lookup(cromfs_inodenum_t inonum,
                                      const std::string& search_name)
     throw (cromfs_exception, std::bad_alloc)
 {
-    cromfs_dirinfo* cached = readdir_cache.Find(inonum);
-    if(cached)
+    DirNameFinder finder(search_name);
+    if(readdir_cache.Access(inonum, finder))
     {
-        const cromfs_dirinfo& info = *cached;
-        cromfs_dirinfo::const_iterator j = info.find(search_name);
-        if(j != info.end()) return j->second;
-        return 0;
+        cromfs_stat_add(stats.readdir_hits);
+        return finder.result;
     }
+    cromfs_stat_add(stats.readdir_misses);
 
     const cromfs_inode_internal inode = read_inode_and_blocks(inonum);
     if(inonum != 1 && !S_ISDIR(inode.mode))
         { throw ENOTDIR; }
 
-    unsigned char DirHeader[4];
-    if(read_file_data(inode, 0, DirHeader, 4, "dir size") < 4)
+    /* The number of files, and the pointer to the first entry */
+    unsigned char DirHeader[8];
+    const uint_fast64_t header_size = read_file_data(inode, 0, DirHeader, 8, "dir size");
+    if(header_size < 4)
     {
 #if READDIR_DEBUG
         fprintf(stderr, "dir_lookup(%s)\n",
@@ -1052,6 +2371,25 @@ cromfs_inodenum_t cromfs::dir_lookup(cromfs_inodenum_t inonum,
     }
     uint_fast32_t num_files = get_32(DirHeader);
 
+    /* If the first entry does not begin right after the entry pointers,
+     * there is a hash index in between (see cromfs-directoryfun.cc).
+     */
+    const uint_fast64_t index_offs = 4 + 4 * (uint_fast64_t)num_files;
+    if(num_files > 0 && header_size == 8 && get_32(DirHeader+4) > index_offs)
+    {
+        unsigned char IndexHeader[4];
+        if(read_file_data(inode, index_offs, IndexHeader, 4, "dir index") < 4)
+            throw EIO;
+
+        const uint_fast32_t slots = get_32(IndexHeader);
+        if(slots == 0 || (slots & (slots-1))
+        || index_offs + 4 + 8 * (uint_fast64_t)slots > get_32(DirHeader+4))
+        {
+            throw EIO;
+        }
+        return dir_lookup_hashed(inode, index_offs + 4, slots, search_name);
+    }
+
     std::vector<uint_least32_t> entry_offsets(num_files+1);
     std::vector<bool>           offs_read(num_files);
 
@@ -1159,35 +2497,140 @@ void cromfs::DumpRAMusage() const
         "rootdir inode size: %s (%u blocks)\n"
         "inotab inode size: %s (%u blocks)\n"
         "fblktab size: %s (%u fblock locators)\n"
-        "blktab size: %s (%u data locators)\n"
+        "blktab cache size: %s (%u chunks; %u data locators in total)\n"
         "readdir cache size: %s (estimate, %u directories)\n"
-        "fblock cache size: %s (estimate, %u fblocks)\n",
+        "fblock cache size: %s (%u fblocks)\n"
+        "inode table size: %s (%u inodes)\n"
+        "disk cache: %u of %u slots used\n",
         ReportSize( sizeof(rootdir) + rootdir.blocklist.size() * sizeof(cromfs_blocknum_t) ).c_str(),
         (unsigned)rootdir.blocklist.size(),
         ReportSize( sizeof(inotab) + inotab.blocklist.size() * sizeof(cromfs_blocknum_t) ).c_str(),
         (unsigned)inotab.blocklist.size(),
         ReportSize( fblktab.size() * sizeof(fblktab[0]) ).c_str(),
         (unsigned)fblktab.size(),
-        ReportSize( blktab.size() * sizeof(blktab[0]) ).c_str(),
-        (unsigned)blktab.size(),
-        ReportSize( 60000 * readdir_cache.num_entries() ).c_str(),
+        ReportSize( blktab_cache.num_bytes() ).c_str(),
+        (unsigned)blktab_cache.num_entries(),
+        (unsigned)blktab_blocks,
+        ReportSize( readdir_cache.num_bytes() ).c_str(),
         (unsigned)readdir_cache.num_entries(),
-        ReportSize( CROMFS_FSIZE * fblock_cache.num_entries() ).c_str(),
-        (unsigned)fblock_cache.num_entries()
+        ReportSize( fblock_cache->num_bytes() ).c_str(),
+        (unsigned)fblock_cache->num_entries(),
+        ReportSize( inode_table.num_bytes() ).c_str(),
+        (unsigned)inode_table.size(),
+        (unsigned)disk_cache.num_used(),
+        (unsigned)disk_cache.num_slots()
     );
 }
 
-cromfs::cromfs(int fild)
+const std::string cromfs::GetStatistics() const
+{
+    std::string result;
+    char Buf[256];
+    const struct { const char* name; uint_fast64_t value; } counters[] =
+    {
+        { "fblock.cache_hits",            stats.fblock_hits },
+        { "fblock.cache_misses",          stats.fblock_misses },
+        { "fblock.cache_evictions",       stats.fblock_evictions },
+        { "fblock.cache_bytes",           fblock_cache->num_bytes() },
+        { "fblock.cache_entries",         fblock_cache->num_entries() },
+        { "fblock.cache_max_bytes",       fblock_cache->GetMaxBytes() },
+        { "fblock.read",                  stats.fblocks_read },
+        { "fblock.compressed_bytes_read", stats.compressed_bytes_read },
+        { "fblock.decompressed_bytes",    stats.decompressed_bytes },
+        { "disk_cache.hits",              stats.disk_cache_hits },
+        { "disk_cache.writes",            stats.disk_cache_writes },
+        { "disk_cache.skipped",           stats.disk_cache_skipped },
+        { "disk_cache.slots",             disk_cache.num_slots() },
+        { "disk_cache.slots_used",        disk_cache.num_used() },
+        { "blktab.chunk_loads",           stats.blktab_chunk_loads },
+        { "blktab.cache_bytes",           blktab_cache.num_bytes() },
+        { "blktab.cache_entries",         blktab_cache.num_entries() },
+        { "readdir.cache_hits",           stats.readdir_hits },
+        { "readdir.cache_misses",         stats.readdir_misses },
+        { "readdir.cache_bytes",          readdir_cache.num_bytes() },
+        { "readdir.cache_entries",        readdir_cache.num_entries() },
+        { "inode_table.bytes",            inode_table.num_bytes() },
+        { "prefetch.queued",              stats.prefetch_queued },
+        { "prefetch.loaded",              stats.prefetch_loaded },
+        { "prefetch.used",                stats.prefetch_used },
+        { "prefetch.wasted",              stats.prefetch_wasted }
+    };
+    for(size_t a=0; a<sizeof(counters)/sizeof(*counters); ++a)
+    {
+        std::sprintf(Buf, "%s %llu\n", counters[a].name, (unsigned long long)counters[a].value);
+        result += Buf;
+    }
+    stats.decompress_time.Format(result, "fblock.decompress");
+    return result;
+}
+
+cromfs_inodenum_t cromfs::get_unused_inodenum() const
+{
+    return get_first_free_inode_number(inotab.bytesize);
+}
+
+const unsigned char* cromfs::mapped_image(uint_fast64_t pos, uint_fast64_t length) const
+        throw (cromfs_exception)
+{
+    if(!image_map) return NULL;
+    if(pos > image_size || length > image_size - pos) throw EIO;
+    return image_map.get_ptr() + pos;
+}
+
+void cromfs::advise_image(uint_fast64_t pos, uint_fast64_t length,
+                          void (*fadvise)(int, uint_fast64_t, uint_fast64_t),
+                          void (*madvise)(const void*, uint_fast64_t)) const
+{
+    if(!image_map)
+    {
+        fadvise(fd, pos, length);
+        return;
+    }
+    if(pos >= image_size) return;
+    if(length > image_size - pos) length = image_size - pos;
+
+    /* madvise() requires a page-aligned address. */
+    const uint_fast64_t aligned = pos & ~(MMAP_PAGESIZE-UINT64_C(1));
+    madvise(image_map.get_ptr() + aligned, length + (pos - aligned));
+}
+
+cromfs::cromfs(int fild, cromfs_fblock_cache* shared_fblock_cache)
     throw (cromfs_exception, std::bad_alloc)
-     : fd(fild),
-       rootdir(),inotab(),sblock(),fblktab(),blktab(), // -Weffc++
-       readdir_cache(READDIR_CACHE_MAX_SIZE, 0),
-       fblock_cache(FBLOCK_CACHE_MAX_SIZE, 0),
-       storage_opts()
+     : fd(fild), image_map(), image_size(0),
+       rootdir(),inotab(),sblock(),fblktab(), // -Weffc++
+       blktab_blocks(0), blktab_chunk_blocks(1), blktab_chunk_offs(),
+       inode_table(), inode_table_ready(false),
+       readdir_cache(READDIR_CACHE_MAX_BYTES),
+       owned_fblock_cache(shared_fblock_cache ? 0 : FBLOCK_CACHE_MAX_BYTES),
+       fblock_cache(shared_fblock_cache ? shared_fblock_cache : &owned_fblock_cache),
+       fblock_key_base(),
+       blktab_cache(BLKTAB_CACHE_MAX_BYTES),
+       disk_cache(),
+       storage_opts(),
+       prefetcher(NULL), demand_loads(0),
+       disk_writer(NULL)
 {
+    static volatile uint_fast32_t last_id = 0;
+    fblock_key_base = (uint_fast64_t)__sync_add_and_fetch(&last_id, 1) << 32;
+
+    if(USE_MMAP)
+    {
+        const off64_t eofpos = lseek64(fd, 0, SEEK_END);
+        if(eofpos > 0)
+        {
+            /* If the image cannot be mapped (for example, because
+             * the address space is too small), just read it as usual. */
+            image_map.SetMap(fd, 0, eofpos);
+            if(image_map) image_size = eofpos;
+        }
+    }
 }
 
 cromfs::~cromfs() throw()
 {
-    cromfs_alarm_obj = NULL;
+    delete prefetcher;
+    delete disk_writer;
+    /* A shared cache must not keep our fblocks,
+     * as they may point into image_map. */
+    if(fblock_cache != &owned_fblock_cache) forget_fblocks();
 }
@@ -1,19 +1,301 @@
 #include "cromfs-defs.hh"
 
 #include "lib/datacache.hh"
+#include "lib/diskcache.hh"
+#include "lib/autoptr"
+#include "lib/mmapping.hh"
 
 #include <string>
 #include <exception>
 
 typedef int cromfs_exception;
 
-/* How many directories to keep cached at the same time maximum */
-extern unsigned READDIR_CACHE_MAX_SIZE;
+/* How many bytes of decoded directories to keep cached at most */
+extern size_t READDIR_CACHE_MAX_BYTES;
 
-/* How many decompressed fblocks to cache in RAM at the same time maximum */
-extern unsigned FBLOCK_CACHE_MAX_SIZE;
+/* How many bytes of decompressed fblocks to cache in RAM at most */
+extern size_t FBLOCK_CACHE_MAX_BYTES;
 
-typedef std::vector<unsigned char> cromfs_cached_fblock;
+/* How many bytes of decoded block table chunks to cache in RAM at most */
+extern size_t BLKTAB_CACHE_MAX_BYTES;
+
+/* A file on local disk where decompressed fblocks evicted from
+ * the RAM cache are kept, so that they need not be decompressed
+ * again, even after a remount (see DiskCache). Empty = none.
+ * DISK_CACHE_MAX_BYTES is the size of the file. */
+extern std::string DISK_CACHE_FILE;
+extern uint_fast64_t DISK_CACHE_MAX_BYTES;
+
+/* How many fblocks to decompress ahead of a sequential reader
+ * (see cromfs::prefetch_file_data()). 0 = no prefetching. */
+extern unsigned PREFETCH_FBLOCKS;
+
+/* How many background threads do the prefetching */
+extern unsigned PREFETCH_THREADS;
+
+/* Whether to decode all inode headers into a table in RAM
+ * at the first inode access (see cromfs_inode_table) */
+extern bool USE_INODE_TABLE;
+
+/* Whether to memory-map the whole image once at mount time,
+ * and decompress straight from the mapping instead of
+ * reading each fblock with a separate system call */
+extern bool USE_MMAP;
+
+/* A histogram of durations, in buckets of powers of two microseconds.
+ * Updated atomically, without locking.
+ */
+struct cromfs_latency_histogram
+{
+    enum { NumBuckets = 24 }; // The last one is for 2^22 us (4 s) and more
+    volatile uint_fast64_t count;
+    volatile uint_fast64_t total_usec;
+    volatile uint_fast64_t buckets[NumBuckets];
+
+    cromfs_latency_histogram();
+    void Add(uint_fast64_t usec);
+
+    /* Appends the histogram to out as lines of "name value":
+     * prefix.count, prefix.usec and, cumulatively, prefix.usec_lt_N
+     * for each power of two N up to the largest duration seen.
+     */
+    void Format(std::string& out, const char* prefix) const;
+};
+
+/* What the filesystem engine has done since it was created,
+ * for sizing the caches and for spotting regressions.
+ * See cromfs::GetStatistics().
+ */
+struct cromfs_statistics
+{
+    volatile uint_fast64_t fblock_hits;       // found in fblock_cache
+    volatile uint_fast64_t fblock_misses;     // not found, had to be loaded
+    volatile uint_fast64_t fblock_evictions;
+    volatile uint_fast64_t fblocks_read;      // compressed fblocks read from the image
+    volatile uint_fast64_t compressed_bytes_read;
+    volatile uint_fast64_t decompressed_bytes;
+    volatile uint_fast64_t disk_cache_hits;
+    volatile uint_fast64_t disk_cache_writes;
+    volatile uint_fast64_t disk_cache_skipped; // evicted while the writer was busy
+    volatile uint_fast64_t blktab_chunk_loads;
+    volatile uint_fast64_t readdir_hits;
+    volatile uint_fast64_t readdir_misses;
+    volatile uint_fast64_t prefetch_queued;
+    volatile uint_fast64_t prefetch_loaded;   // fblocks that prefetching put in the cache
+    volatile uint_fast64_t prefetch_used;     // ...that were read before being evicted
+    volatile uint_fast64_t prefetch_wasted;   // ...that were evicted unread
+    cromfs_latency_histogram decompress_time;
+
+    cromfs_statistics();
+};
+
+static inline void cromfs_stat_add(volatile uint_fast64_t& counter, uint_fast64_t n = 1)
+{
+    __sync_fetch_and_add(&counter, n);
+}
+
+/* A decompressed fblock. The fblock cache and every reader that is
+ * copying data from it hold an autoptr to it, so that the cache may
+ * evict it while it is still being read without freeing it.
+ *
+ * The fblock may be decompressed only partially at first. The first
+ * decoded() bytes are valid; decode() continues from where the previous
+ * call stopped. The decoded part is never modified afterwards, so
+ * readers may use it without locking.
+ *
+ * An fblock that is not LZMA-compressed (see lib/cromfs-fblockcodec.hh)
+ * is decoded all at once by the first decode(), since that is cheap.
+ */
+struct cromfs_fblock_decoder;
+class cromfs_fblock_buffer: public ptrable
+{
+public:
+    /* Takes the compressed fblock, and decodes none of it yet.
+     * May throw: EBADF = the fblock is corrupt
+     */
+    explicit cromfs_fblock_buffer(std::vector<unsigned char>& compressed)
+        throw (cromfs_exception, std::bad_alloc);
+    /* Same, but without copying the compressed data.
+     * It must stay valid until the fblock is completely decoded.
+     */
+    cromfs_fblock_buffer(const unsigned char* compressed, size_t length)
+        throw (cromfs_exception, std::bad_alloc);
+    /* Allocates an fblock of the given size, that counts as completely
+     * decoded. The creator must fill it through fill_data() before
+     * anyone else gets to see it.
+     */
+    explicit cromfs_fblock_buffer(size_t length)
+        throw (std::bad_alloc);
+    ~cromfs_fblock_buffer();
+
+    /* Makes sure that at least the first "upto" bytes are decoded.
+     * Returns true if anything had to be decoded.
+     * May throw: EBADF = the fblock is corrupt
+     */
+    bool decode(size_t upto) const
+        throw (cromfs_exception, std::bad_alloc);
+
+    const unsigned char* data() const { return buffer; }
+    unsigned char* fill_data()        { return buffer; }
+    size_t size() const    { return total; }
+    size_t decoded() const { return done; }
+
+    /* How much RAM the fblock takes currently */
+    size_t num_bytes() const;
+
+    /* Whether the fblock was compressed with one of the codecs that
+     * decode so fast that it is not worth keeping in the disk cache. */
+    bool cheap_to_decode() const { return cheap; }
+
+    /* Set when prefetching loaded the fblock, cleared by
+     * the first read of it (see cromfs_statistics). */
+    mutable volatile int unread_prefetch;
+
+private:
+    unsigned char*         buffer;
+    size_t                 total;
+    mutable volatile size_t done;
+    bool                   cheap;
+
+    /* While not yet completely decoded: */
+    mutable MutexType              lock;
+    mutable cromfs_fblock_decoder* decoder;
+    /* The RAM that the decoder takes, for num_bytes(), which
+     * cannot look at the decoder without the lock. */
+    mutable volatile size_t        decoder_bytes;
+
+private:
+    void Init(const unsigned char* compressed, size_t length)
+        throw (cromfs_exception, std::bad_alloc);
+    cromfs_fblock_buffer(const cromfs_fblock_buffer&);
+    void operator=(const cromfs_fblock_buffer&);
+};
+typedef autoptr<const cromfs_fblock_buffer> cromfs_cached_fblock;
+
+template<>
+struct DataCacheCost<cromfs_cached_fblock>
+{
+    static size_t Get(const cromfs_cached_fblock& fblock)
+        { return fblock->num_bytes(); }
+};
+
+/* The RAM cache of decompressed fblocks. Each cromfs object has one
+ * of its own, unless it is given one to share with other cromfs objects.
+ * The key has the fblock number in the low 32 bits, and a number that
+ * identifies the cromfs object in the high 32 bits.
+ */
+typedef DataCache<uint_fast64_t, cromfs_cached_fblock> cromfs_fblock_cache;
+
+/* A decoded chunk of the block table. If the block table is not
+ * chunked (see CROMFS_OPT_CHUNKED_BLKTAB), it is all one chunk.
+ * Like fblocks, the chunks are held by autoptr, so that a reader
+ * may go on using a chunk that the cache has evicted.
+ */
+struct cromfs_blktab_chunk: public ptrable
+{
+    cromfs_blocknum_t first; // The number of the first block in the chunk
+    std::vector<cromfs_block_internal> blocks;
+
+    cromfs_blktab_chunk() : first(0), blocks() { }
+};
+typedef autoptr<const cromfs_blktab_chunk> cromfs_cached_blktab_chunk;
+
+template<>
+struct DataCacheCost<cromfs_cached_blktab_chunk>
+{
+    static size_t Get(const cromfs_cached_blktab_chunk& chunk)
+        { return sizeof(*chunk) + chunk->blocks.size() * sizeof(chunk->blocks[0]); }
+};
+
+/* A range of file data, resolved to a range of a decompressed fblock.
+ * If fblock is null, the range reads as zeros (this happens only when
+ * the filesystem is corrupt and the fblock is shorter than expected).
+ */
+struct cromfs_data_segment
+{
+    cromfs_cached_fblock fblock;
+    uint_fast32_t        offset;
+    uint_fast32_t        size;
+
+    cromfs_data_segment() : fblock(), offset(0), size(0) { }
+};
+
+/* A decoded directory in the readdir cache. The entries are kept
+ * in the order of the directory: all names in a single buffer
+ * (nul-terminated), and for each entry the position of its name
+ * and its inode number. Entries can then be accessed by position
+ * in constant time, and looked up by name with a binary search.
+ */
+struct cromfs_cached_dir
+{
+    std::vector<char>              names;
+    std::vector<uint_least32_t>    name_offsets;
+    std::vector<cromfs_inodenum_t> inodes;
+    bool sorted; // Whether the names are in ascending order
+
+    cromfs_cached_dir() : names(), name_offsets(), inodes(), sorted(true) { }
+
+    void add(const char* name, size_t length, cromfs_inodenum_t inonum);
+
+    size_t size() const { return inodes.size(); }
+    const char* name(size_t n) const { return &names[name_offsets[n]]; }
+
+    /* Returns the inode number of the named entry, 0 if there is none. */
+    cromfs_inodenum_t find(const std::string& name) const;
+
+    /* Adds the given range of entries into the map. */
+    void get_portion(cromfs_dirinfo& result,
+                     uint_fast32_t dir_offset, uint_fast32_t dir_count) const;
+
+    size_t num_bytes() const;
+    void swap(cromfs_cached_dir& b);
+
+private:
+    static bool CompareUnsigned(char a, char b);
+};
+
+template<>
+struct DataCacheCost<cromfs_cached_dir>
+{
+    static size_t Get(const cromfs_cached_dir& dir) { return dir.num_bytes(); }
+};
+
+/* The headers of all inodes in inotab, decoded into flat arrays
+ * (one array per field) so that read_inode() can answer without
+ * decompressing anything.
+ *
+ * Inode numbers are derived from the inode's offset in inotab, so they
+ * are sparse. The "starts" bitmap has a bit for every 4-byte position
+ * in inotab, set where an inode begins; "rank" holds the number of set
+ * bits before each 64-bit word. An inode's index in the arrays is the
+ * number of inodes that begin before it.
+ */
+struct cromfs_inode_table
+{
+    std::vector<uint_least32_t> mode, time, rdev_links;
+    std::vector<uint_least16_t> uid, gid;
+    std::vector<uint_least64_t> bytesize;
+    std::vector<uint_least32_t> blocksize; // Empty unless variable blocksizes are used
+
+    std::vector<uint_least64_t> starts;
+    std::vector<uint_least32_t> rank;
+
+    cromfs_inode_table()
+        : mode(),time(),rdev_links(),uid(),gid(),bytesize(),blocksize(),
+          starts(),rank() { }
+
+    /* Fills in the header fields of the inode. Returns false
+     * if no inode begins at the position denoted by inonum. */
+    bool get(cromfs_inodenum_t inonum, cromfs_inode_internal& inode,
+             uint_fast32_t default_blocksize) const;
+
+    size_t size() const { return mode.size(); }
+    size_t num_bytes() const;
+    void swap(cromfs_inode_table& b);
+};
+
+class cromfs_prefetcher;
+class cromfs_disk_cache_writer;
 
 class cromfs
 {
@@ -33,11 +315,14 @@ public:
      */
 
     /* Opens the filesystem pointed by the given file descriptor.
+     * If shared_fblock_cache is given, the decompressed fblocks are
+     * cached in it instead of a cache of FBLOCK_CACHE_MAX_BYTES owned
+     * by this object. It must outlive this object.
      * May throw:
      *   EINVAL = Not a cromfs volume or broken cromfs volume
      *   other  = errno reported by system
      */
-    cromfs(int fild)
+    cromfs(int fild, cromfs_fblock_cache* shared_fblock_cache = 0)
         throw (cromfs_exception, std::bad_alloc);
 
     /* Deallocates the structures associated with this filesystem. */
@@ -78,6 +363,15 @@ public:
     const cromfs_inode_internal read_inode(cromfs_inodenum_t inonum)
         throw (cromfs_exception, std::bad_alloc);
 
+    /* Like read_inode(), for several inodes at once, such as all
+     * entries of a directory. The headers are read in the order of
+     * their location in the inode table, with one read_file_data()
+     * for each group of headers that are near each other.
+     */
+    void read_inodes(const std::vector<cromfs_inodenum_t>& inonums,
+                     std::vector<cromfs_inode_internal>& result)
+        throw (cromfs_exception, std::bad_alloc);
+
     /* Reads the inode based on inode number. */
     /* It reads the inode header and the block table.
      * Use this function when you are going to pass the data
@@ -112,6 +406,14 @@ public:
     const std::string DumpBlock(const cromfs_block_internal& block) const;
     void DumpRAMusage() const;
 
+    /* Returns the statistics and the cache sizes as lines
+     * of "name value", for programs to parse. */
+    const std::string GetStatistics() const;
+
+    /* An inode number that no file of the filesystem has,
+     * for presenting files that are not in the image. */
+    cromfs_inodenum_t get_unused_inodenum() const;
+
     /*
      * A variant of read_file_data that takes the inode instead of the
      * inode number.
@@ -124,6 +426,27 @@ public:
                                 const char* purpose)
         throw (cromfs_exception, std::bad_alloc);
 
+    /* A variant of read_file_data that does not copy the data,
+     * but appends the ranges of the fblocks that hold it to segments,
+     * in file order. The fblocks stay pinned in RAM for as long as the
+     * segments exist. Returns the number of bytes covered.
+     * Note: The inode must contain the block table.
+     */
+    uint_fast64_t map_file_data(const cromfs_inode_internal& inode,
+                                uint_fast64_t offset, uint_fast64_t size,
+                                std::vector<cromfs_data_segment>& segments)
+        throw (cromfs_exception, std::bad_alloc);
+
+    /* Tells that the file is being read sequentially and the next read
+     * will begin at the given offset. Schedules the next PREFETCH_FBLOCKS
+     * fblocks that the file needs from there on to be decompressed into
+     * the fblock cache by background threads.
+     * Note: The inode must contain the block table.
+     */
+    void prefetch_file_data(const cromfs_inode_internal& inode,
+                            uint_fast64_t offset)
+        throw (cromfs_exception, std::bad_alloc);
+
     /* A variant of read_file_data that restricts the read
      * to a single fblock. */
     int_fast64_t read_file_data_from_one_fblock_only
@@ -136,10 +459,66 @@ public:
 protected:
     void reread_superblock()
         throw (cromfs_exception, std::bad_alloc);
+    /* Reads the locations of the block table chunks.
+     * Decodes none of the block table yet. */
     void reread_blktab()
         throw (cromfs_exception, std::bad_alloc);
     void reread_fblktab()
         throw (cromfs_exception, std::bad_alloc);
+    /* Fills fblktab from the fblock directory (see doc/FORMAT).
+     * Returns false if the image has none, or it is not valid. */
+    bool read_fblkdir(uint_fast64_t eofpos)
+        throw (cromfs_exception, std::bad_alloc);
+    void ensure_inode_table()
+        throw (cromfs_exception, std::bad_alloc);
+
+    /* dir_lookup() in a directory that has a hash index */
+    cromfs_inodenum_t dir_lookup_hashed(const cromfs_inode_internal& inode,
+                                        uint_fast64_t slots_offs,
+                                        uint_fast32_t slots,
+                                        const std::string& filename)
+        throw (cromfs_exception, std::bad_alloc);
+
+    /* Returns the address of the given range of the image if the image
+     * is memory-mapped (see USE_MMAP), NULL otherwise.
+     * May throw: EIO = the range is beyond the end of the image
+     */
+    const unsigned char* mapped_image(uint_fast64_t pos, uint_fast64_t length) const
+        throw (cromfs_exception);
+    /* Gives the kernel a hint of the access pattern of the given range
+     * of the image: with madvise() if it is memory-mapped, else with fadvise(). */
+    void advise_image(uint_fast64_t pos, uint_fast64_t length,
+                      void (*fadvise)(int, uint_fast64_t, uint_fast64_t),
+                      void (*madvise)(const void*, uint_fast64_t)) const;
+
+    /* Finds the data locator of the block. Returns false if there
+     * is no such block. "chunk" is a cursor held by the caller:
+     * if it holds the chunk of the block already, the cache is not
+     * consulted; otherwise, the chunk is loaded into it.
+     */
+    bool get_block(cromfs_blocknum_t blocknum,
+                   cromfs_block_internal& result,
+                   cromfs_cached_blktab_chunk& chunk)
+        throw (cromfs_exception, std::bad_alloc)
+    {
+        if(!chunk || blocknum - chunk->first >= chunk->blocks.size())
+        {
+            if(blocknum >= blktab_blocks) return false;
+            chunk = get_blktab_chunk(blocknum / blktab_chunk_blocks);
+            if(blocknum - chunk->first >= chunk->blocks.size()) return false;
+        }
+        result = chunk->blocks[blocknum - chunk->first];
+        return true;
+    }
+    /* Returns the chunk from the cache, loading and decoding it first if needed. */
+    cromfs_cached_blktab_chunk get_blktab_chunk(uint_fast32_t chunknum)
+        throw (cromfs_exception, std::bad_alloc);
+    /* Decodes the whole block table, without using the cache. */
+    void read_blktab(std::vector<cromfs_block_internal>& result)
+        throw (cromfs_exception, std::bad_alloc);
+    /* Reads and decodes the chunk of the block table, without using the cache. */
+    cromfs_cached_blktab_chunk load_blktab_chunk(uint_fast32_t chunknum) const
+        throw (cromfs_exception, std::bad_alloc);
 
     void read_block(cromfs_blocknum_t ind, uint_fast32_t offset,
                     unsigned char* target,
@@ -151,25 +530,153 @@ protected:
          bool ignore_blocks)
         throw (cromfs_exception, std::bad_alloc);
 
-    cromfs_cached_fblock& read_fblock(cromfs_fblocknum_t ind)
+    /* Copies a range of the decompressed fblock into target,
+     * decompressing and caching the fblock first if needed.
+     * Returns the number of bytes copied.
+     */
+    uint_fast32_t read_fblock(cromfs_fblocknum_t ind,
+                              uint_fast32_t offset,
+                              unsigned char* target,
+                              uint_fast32_t size)
+        throw (cromfs_exception, std::bad_alloc);
+    /* Returns the fblock from the cache, loading and caching it first
+     * if needed. It may be only partially decompressed; use
+     * decode_fblock() before accessing its data.
+     * The fblock stays valid for as long as the caller holds it.
+     */
+    cromfs_cached_fblock get_fblock(cromfs_fblocknum_t ind)
         throw (cromfs_exception, std::bad_alloc);
+    /* Like get_fblock() for several fblocks at once, but the compressed
+     * data of those that are not cached is read with one batch of I/O
+     * (see BatchFileRead). Each fblock is decompressed up to upto[n]
+     * as soon as its data has been read. If upto is empty, nothing
+     * is decompressed.
+     */
+    void get_fblocks(const std::vector<cromfs_fblocknum_t>& inds,
+                     const std::vector<uint_fast32_t>& upto,
+                     std::vector<cromfs_cached_fblock>& result)
+        throw (cromfs_exception, std::bad_alloc);
+    /* Returns the fblock completely decompressed, without using the cache. */
     cromfs_cached_fblock read_fblock_uncached(cromfs_fblocknum_t ind) const
         throw (cromfs_exception, std::bad_alloc);
+    /* Reads the compressed fblock, but decompresses none of it yet. */
+    cromfs_cached_fblock load_fblock(cromfs_fblocknum_t ind) const
+        throw (cromfs_exception, std::bad_alloc);
+    /* Puts an fblock whose compressed data has already been read
+     * in the cache, unless another thread did it first. */
+    cromfs_cached_fblock cache_fblock(cromfs_fblocknum_t ind,
+                                      std::vector<unsigned char>& compressed)
+        throw (cromfs_exception, std::bad_alloc);
+    /* fblock->decode(upto), measured in stats. */
+    bool timed_decode(const cromfs_cached_fblock& fblock, size_t upto) const
+        throw (cromfs_exception, std::bad_alloc);
+    /* Counts a read of the fblock, for the prefetch statistics. */
+    void note_fblock_use(const cromfs_cached_fblock& fblock) const;
+
+    /* Decompresses the cached fblock at least up to the given offset,
+     * and updates its size in the cache. */
+    void decode_fblock(cromfs_fblocknum_t ind,
+                       const cromfs_cached_fblock& fblock,
+                       uint_fast32_t upto)
+        throw (cromfs_exception, std::bad_alloc);
+
+    /* Puts the fblock in the RAM cache. The completely decompressed
+     * fblocks that this evicts are written to the disk cache. */
+    void put_fblock(cromfs_fblocknum_t ind, const cromfs_cached_fblock& fblock)
+        throw (std::bad_alloc);
+    /* Counts the fblocks that the RAM cache has evicted,
+     * and writes them to the disk cache. */
+    void retire_fblocks(const cromfs_fblock_cache::EvictedList& evicted)
+        throw ();
+    /* Removes the fblocks of this object from the RAM cache. */
+    void forget_fblocks() throw();
+    uint_fast64_t fblock_key(cromfs_fblocknum_t fblocknum) const
+        { return fblock_key_base | fblocknum; }
+    /* Returns the fblock from the disk cache, or a null pointer
+     * if it is not there. */
+    cromfs_cached_fblock load_fblock_from_disk(cromfs_fblocknum_t ind)
+        throw (std::bad_alloc);
+    /* Opens DISK_CACHE_FILE for this image, if it is set. */
+    void open_disk_cache(const cromfs_superblock_internal::BufferType& Superblock)
+        throw (std::bad_alloc);
+
+    /* Decompresses the fblock into the cache unless it's there already.
+     * Called by the prefetch threads. Gives way to demand loads. */
+    void prefetch_fblock(cromfs_fblocknum_t ind) throw();
+    friend class cromfs_prefetcher;
+
+    /* Puts the evicted fblock in the disk cache.
+     * Called by the disk cache writer thread. */
+    void store_fblock_on_disk(cromfs_fblocknum_t ind, const cromfs_cached_fblock& fblock)
+        throw ();
+    friend class cromfs_disk_cache_writer;
 
 protected:
     int fd; // file handle
+    /* The whole image, if USE_MMAP. Declared before the caches,
+     * because the cached fblocks may point into it. */
+    MemMapping image_map;
+    uint_fast64_t image_size;
 
     cromfs_inode_internal rootdir, inotab;
     cromfs_superblock_internal sblock;
 
     std::vector<cromfs_fblock_internal> fblktab;
-    std::vector<cromfs_block_internal> blktab;
 
-    DataCache<cromfs_inodenum_t, cromfs_dirinfo> readdir_cache;
-    DataCache<cromfs_fblocknum_t, cromfs_cached_fblock> fblock_cache;
+    /* The block table: blktab_blocks blocks, in chunks of
+     * blktab_chunk_blocks blocks. blktab_chunk_offs has the position
+     * of each chunk in the image, and the end of the last one. */
+    uint_fast32_t blktab_blocks;
+    uint_fast32_t blktab_chunk_blocks;
+    std::vector<uint_fast64_t> blktab_chunk_offs;
+
+    cromfs_inode_table inode_table;
+    volatile bool inode_table_ready;
+
+    DataCache<cromfs_inodenum_t, cromfs_cached_dir> readdir_cache;
+    /* Points to owned_fblock_cache, or to a cache shared with other
+     * cromfs objects. Keys are made with fblock_key(). */
+    cromfs_fblock_cache  owned_fblock_cache;
+    cromfs_fblock_cache* fblock_cache;
+    uint_fast64_t fblock_key_base;
+    DataCache<uint_fast32_t, cromfs_cached_blktab_chunk> blktab_cache;
+    DiskCache disk_cache;
+
+    mutable cromfs_statistics stats;
 
     uint_fast32_t storage_opts;
 
+    /* The cromfs object may be accessed by several threads at once
+     * (the multithreaded Fuse loop, and OpenMP in read_file_data()).
+     * blktab_lock serializes the decoding of blktab chunks,
+     * and inode_table_lock the one-time building of inode_table.
+     * fblock_load_locks serialize the loading of any particular
+     * fblock, so that two threads missing the same fblock do not both
+     * load it. The decompression, which takes the longest, is done
+     * after releasing them, under the lock of the fblock's own buffer.
+     * Readers of already cached fblocks take neither.
+     */
+    enum { FBLOCK_LOAD_LOCK_COUNT = 16 };
+    MutexType blktab_lock;
+    MutexType inode_table_lock;
+    MutexType fblock_load_locks[FBLOCK_LOAD_LOCK_COUNT];
+
+    /* The prefetch threads are started at the first prefetch request,
+     * so that they are never started before Fuse forks to background.
+     * demand_loads counts the fblocks that are being decompressed
+     * because some read is waiting for them; prefetching is skipped
+     * while there are any.
+     */
+    cromfs_prefetcher* prefetcher;
+    MutexType prefetcher_lock;
+    volatile int demand_loads;
+
+    /* Writes the evicted fblocks into disk_cache, in the background.
+     * Started at the first eviction that is worth storing, and
+     * deleted in ~cromfs, before disk_cache is closed. */
+    cromfs_disk_cache_writer* disk_writer;
+    MutexType disk_writer_lock;
+
 private:
     cromfs(cromfs&);
     void operator=(const cromfs&);
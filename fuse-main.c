@@ -16,7 +16,11 @@ used to initialize the cromfs_oper struct.
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 
 #define ALLOW_OUTPUT_IN_FORK_MODE 0
 
@@ -33,6 +37,7 @@ static const struct fuse_lowlevel_ops cromfs_oper =
 
     .open    = cromfs_open,
     .read    = cromfs_read,
+    .release = cromfs_release,
 
     .opendir = cromfs_opendir,
     .readdir = cromfs_readdir
@@ -41,6 +46,119 @@ static const struct fuse_lowlevel_ops cromfs_oper =
 static int foreground = 0;
 static int multithreaded = 0;
 
+/* Options specific to cromfs-driver, given with -o. */
+struct cromfs_mount_options
+{
+    /* Number of worker threads serving requests.
+     * 0 = let libfuse decide (fuse_session_loop_mt). */
+    unsigned threads;
+    /* Cache budgets in megabytes. 0 = use the defaults. */
+    unsigned fblock_cache;
+    unsigned readdir_cache;
+    /* Keep all inode headers decoded in RAM. */
+    int inodetab;
+    /* Memory-map the image. */
+    int mmap;
+    /* Prefetching for sequential reads. ~0U = use the defaults. */
+    unsigned prefetch;
+    unsigned prefetch_threads;
+    /* Cache of decompressed fblocks on disk. NULL = none. */
+    char*    disk_cache;
+    unsigned disk_cache_size;
+};
+static struct cromfs_mount_options mount_options = { 0, 0, 0, 0, 0, ~0U, ~0U, NULL, 0 };
+
+#define CROMFS_OPT(templ, field) \
+    { templ, offsetof(struct cromfs_mount_options, field), 0 }
+#define CROMFS_FLAG(templ, field) \
+    { templ, offsetof(struct cromfs_mount_options, field), 1 }
+
+static const struct fuse_opt cromfs_opts[] =
+{
+    CROMFS_OPT("threads=%u", threads),
+    CROMFS_OPT("fblock_cache=%u", fblock_cache),
+    CROMFS_OPT("readdir_cache=%u", readdir_cache),
+    CROMFS_FLAG("inodetab", inodetab),
+    CROMFS_FLAG("mmap", mmap),
+    CROMFS_OPT("prefetch=%u", prefetch),
+    CROMFS_OPT("prefetch_threads=%u", prefetch_threads),
+    CROMFS_OPT("disk_cache=%s", disk_cache),
+    CROMFS_OPT("disk_cache_size=%u", disk_cache_size),
+    FUSE_OPT_END
+};
+
+/* A fixed pool of worker threads, each of which reads requests
+ * from the kernel and processes them. This is what libfuse's
+ * fuse_session_loop_mt() does, except that the number of threads
+ * is chosen by the user.
+ */
+static void* cromfs_worker_loop(void* param)
+{
+    struct fuse_session* se = (struct fuse_session*)param;
+    struct fuse_chan*    ch = fuse_session_next_chan(se, NULL);
+    size_t bufsize = fuse_chan_bufsize(ch);
+    char* buf = (char*)malloc(bufsize);
+    if(!buf)
+    {
+        fprintf(stderr, "cromfs: failed to allocate read buffer\n");
+        fuse_session_exit(se);
+        return NULL;
+    }
+
+    while(!fuse_session_exited(se))
+    {
+        struct fuse_chan* tmpch = ch;
+        int res = fuse_chan_recv(&tmpch, buf, bufsize);
+        if(res == -EINTR) continue;
+        if(res <= 0)
+        {
+            /* 0 = unmounted, negative = error */
+            fuse_session_exit(se);
+            break;
+        }
+
+        /* Don't get cancelled in the middle of a request. */
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        fuse_session_process(se, buf, res, tmpch);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+    free(buf);
+    return NULL;
+}
+
+static int cromfs_session_loop_workers(struct fuse_session* se, unsigned num_threads)
+{
+    pthread_t* workers = (pthread_t*)calloc(num_threads, sizeof(*workers));
+    unsigned num_started = 0, a;
+    sigset_t newset, oldset;
+
+    if(!workers) return -1;
+
+    /* Signals are handled by the main thread only. */
+    sigfillset(&newset);
+    pthread_sigmask(SIG_BLOCK, &newset, &oldset);
+    for(a = 1; a < num_threads; ++a)
+    {
+        if(pthread_create(&workers[num_started], NULL, cromfs_worker_loop, se) != 0)
+        {
+            fprintf(stderr, "cromfs: could only start %u threads\n", a);
+            break;
+        }
+        ++num_started;
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+
+    /* The main thread is one of the workers. */
+    cromfs_worker_loop(se);
+
+    for(a = 0; a < num_started; ++a) pthread_cancel(workers[a]);
+    for(a = 0; a < num_started; ++a) pthread_join(workers[a], NULL);
+    free(workers);
+
+    fuse_session_reset(se);
+    return 0;
+}
+
 int main(int argc, char *argv[])
 {
     int err = -1;
@@ -50,17 +168,33 @@ int main(int argc, char *argv[])
 
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
-    if(fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1)
+    if(fuse_opt_parse(&args, &mount_options, cromfs_opts, NULL) == -1
+    || fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1)
     {
         if(fd >= 0) close(fd);
         goto out;
     }
 
 {//scopebegin1
+    cromfs_set_cache_sizes(mount_options.fblock_cache, mount_options.readdir_cache);
+    cromfs_set_inode_table(mount_options.inodetab);
+    cromfs_set_mmap(mount_options.mmap);
+    cromfs_set_prefetch(mount_options.prefetch, mount_options.prefetch_threads);
+    cromfs_set_disk_cache(mount_options.disk_cache, mount_options.disk_cache_size);
     void* userdata = cromfs_create(fd);
     if(!userdata)
     {
-        fprintf(stderr, "cromfs_create failed. Usage: cromfs-driver <image> [<options>] <directory>\n");
+        fprintf(stderr, "cromfs_create failed. Usage: cromfs-driver <image> [<options>] <directory>\n"
+                        "cromfs-specific options:\n"
+                        "    -o threads=N  serve requests with N threads (default: automatic, -s: 1)\n"
+                        "    -o fblock_cache=MB   RAM for decompressed fblocks (default: 32)\n"
+                        "    -o readdir_cache=MB  RAM for decoded directories (default: 4)\n"
+                        "    -o inodetab   keep all inode headers in RAM (faster stat)\n"
+                        "    -o mmap       memory-map the image instead of reading it\n"
+                        "    -o prefetch=N        fblocks to decompress ahead of sequential reads (default: 2, 0: off)\n"
+                        "    -o prefetch_threads=N  threads doing that (default: 1)\n"
+                        "    -o disk_cache=FILE   keep decompressed fblocks also in FILE, across mounts\n"
+                        "    -o disk_cache_size=MB  size of that file (default: 1024)\n");
         return -1;
     }
 
@@ -101,7 +235,12 @@ int main(int argc, char *argv[])
                 stdout = fdopen(1, "w");
 #endif
 
-                err = fuse_session_loop(se);
+                if(!multithreaded)
+                    err = fuse_session_loop(se);
+                else if(mount_options.threads > 0)
+                    err = cromfs_session_loop_workers(se, mount_options.threads);
+                else
+                    err = fuse_session_loop_mt(se);
             }
             fuse_remove_signal_handlers(se);
         }
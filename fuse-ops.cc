@@ -13,14 +13,19 @@ the fuse_reply_err() function.
 
 #include "cromfs.hh"
 #include "fuse-ops.hh"
+#include "lib/util.hh"
 
 #include <cerrno>
+#include <algorithm>
 #include <fcntl.h>
 #include <cstring>
 #include <unistd.h>
 #include <sys/statvfs.h>
 #include <cstring> /* for std::memset */
 #include <cstdio> /* fprintf */
+#include <stdint.h> /* uintptr_t */
+#include <sys/uio.h> /* struct iovec */
+#include <climits> /* IOV_MAX */
 
 
 #define CROMFS_CTXP(obj,userdata) \
@@ -30,7 +35,7 @@ the fuse_reply_err() function.
     CROMFS_CTXP(obj, fuse_req_userdata(req)); \
     try {
 
-#define REPLY_ERR(err) fuse_reply_err(req, err)
+#define REPLY_ERR(err) (op_timer.Fail(err), fuse_reply_err(req, err))
 /*#define REPLY_ERR(err) throw err*/
 
 #define CROMFS_CTX_END() \
@@ -53,8 +58,143 @@ static const double TIMEOUT_CONSTANT = 0x7FFFFFFF;
 
 static bool trace_ops = false;
 
+/* Statistics of the Fuse operations. Together with the statistics
+ * of the filesystem engine (cromfs::GetStatistics()), they can be
+ * read from a file in the root directory that readdir does not list.
+ */
+static const char stats_file_name[] = ".cromfs-stats";
+
+enum cromfs_op
+{
+    OP_STATFS, OP_LOOKUP, OP_GETATTR, OP_ACCESS, OP_READLINK, OP_OPEN,
+    OP_RELEASE, OP_READ, OP_OPENDIR, OP_READDIR,
+    OP_COUNT
+};
+static const char* const op_names[OP_COUNT] =
+{
+    "statfs", "lookup", "getattr", "access", "readlink", "open",
+    "release", "read", "opendir", "readdir"
+};
+struct cromfs_op_stats
+{
+    cromfs_latency_histogram time;
+    volatile uint_fast64_t   errors;
+
+    cromfs_op_stats() : time(), errors(0) { }
+};
+static cromfs_op_stats op_stats[OP_COUNT];
+static volatile uint_fast64_t bytes_served = 0;
+
+/* Measures an operation from its beginning to the end of the scope. */
+class cromfs_op_timer
+{
+public:
+    explicit cromfs_op_timer(cromfs_op o) : op(o), begin(GetTimeMicros()) { }
+    ~cromfs_op_timer() { op_stats[op].time.Add(GetTimeMicros() - begin); }
+    void Fail(int err) { if(err) cromfs_stat_add(op_stats[op].errors); }
+private:
+    cromfs_op     op;
+    uint_fast64_t begin;
+};
+
+static const std::string GetStatistics(const cromfs& fs)
+{
+    std::string result = fs.GetStatistics();
+    char Buf[256];
+    for(unsigned a=0; a<OP_COUNT; ++a)
+    {
+        if(!op_stats[a].time.count) continue;
+        std::sprintf(Buf, "fuse.%s", op_names[a]);
+        op_stats[a].time.Format(result, Buf);
+        std::sprintf(Buf, "fuse.%s.errors %llu\n",
+            op_names[a], (unsigned long long)op_stats[a].errors);
+        result += Buf;
+    }
+    std::sprintf(Buf, "fuse.read.bytes %llu\n", (unsigned long long)bytes_served);
+    result += Buf;
+    return result;
+}
+
+/* The state kept for an open file, pointed to by fuse_file_info::fh.
+ * The inode and its block table are resolved once in cromfs_open(),
+ * so that cromfs_read() does not need to reread them from inotab
+ * on every read() call.
+ */
+struct cromfs_open_file
+{
+    cromfs_inode_internal inode;
+
+    /* For the statistics file, its contents at the time it was opened. */
+    bool        is_stats;
+    std::string stats;
+
+    /* For recognizing sequential reading */
+    MutexType     lock;
+    uint_fast64_t next_offset;      // Where the previous read ended
+    unsigned      sequential_reads; // How many reads in a row continued from there
+
+    explicit cromfs_open_file(const cromfs_inode_internal& i)
+        : inode(i), is_stats(false), stats(), lock(), next_offset(0), sequential_reads(0) { }
+
+    /* Records a read, and tells whether the file is being streamed.
+     * The kernel may issue readahead requests slightly out of order
+     * from several threads, so a little slack is allowed.
+     */
+    bool IsSequential(uint_fast64_t offset, uint_fast64_t size)
+    {
+        static const uint_fast64_t slack = 262144;
+
+        ScopedLock lck(lock);
+        if(offset + slack >= next_offset && offset <= next_offset + slack)
+            ++sequential_reads;
+        else
+            sequential_reads = 0;
+        next_offset = std::max(next_offset, offset + size);
+        return sequential_reads >= 2;
+    }
+};
+
+#if FUSE_VERSION >= 27
+/* Replies use this for the parts of corrupt files that have no data. */
+static const unsigned char zero_page[65536] = { 0 };
+#endif
+
+static cromfs_open_file* get_open_file(const struct fuse_file_info* fi)
+{
+    return fi ? (cromfs_open_file*)(uintptr_t)fi->fh : 0;
+}
+
 extern "C" {
 
+    void cromfs_set_cache_sizes(unsigned fblock_cache_mb, unsigned readdir_cache_mb)
+    {
+        if(fblock_cache_mb)  FBLOCK_CACHE_MAX_BYTES  = fblock_cache_mb  * (size_t)1048576;
+        if(readdir_cache_mb) READDIR_CACHE_MAX_BYTES = readdir_cache_mb * (size_t)1048576;
+    }
+    void cromfs_set_inode_table(int enabled)
+    {
+        USE_INODE_TABLE = enabled;
+    }
+    void cromfs_set_mmap(int enabled)
+    {
+        USE_MMAP = enabled;
+    }
+    void cromfs_set_prefetch(unsigned fblocks, unsigned threads)
+    {
+        if(fblocks != ~0U) PREFETCH_FBLOCKS = fblocks;
+        if(threads != ~0U) PREFETCH_THREADS = threads;
+    }
+    void cromfs_set_disk_cache(const char* filename, unsigned size_mb)
+    {
+        DISK_CACHE_FILE = filename ? filename : "";
+        /* The filesystem is initialized after Fuse has
+         * changed to the root directory. */
+        char cwd[4096];
+        if(!DISK_CACHE_FILE.empty() && DISK_CACHE_FILE[0] != '/'
+        && getcwd(cwd, sizeof(cwd)))
+            DISK_CACHE_FILE = std::string(cwd) + "/" + DISK_CACHE_FILE;
+        if(size_mb) DISK_CACHE_MAX_BYTES = size_mb * (uint_fast64_t)1048576;
+    }
     void* cromfs_create(int fd)
     {
         cromfs* fs = NULL;
@@ -89,6 +229,7 @@ extern "C" {
     void cromfs_statfs(fuse_req_t req/*, fuse_ino_t unused_ino*/)
     {
         if(trace_ops) fprintf(stderr, "statfs\n");
+        cromfs_op_timer op_timer(OP_STATFS);
         CROMFS_CTX(fs)
 
         const cromfs_superblock_internal& sblock = fs.get_superblock();
@@ -136,9 +277,27 @@ extern "C" {
         attr.st_rdev    = i.rdev;
     }
 
+    /* The statistics file claims to be empty, because its size is not
+     * known before it is opened. It is opened with direct_io, so that
+     * the kernel reads it regardless.
+     */
+    static cromfs_inode_internal stats_file_inode(cromfs& fs)
+    {
+        cromfs_inode_internal i;
+        i.mode  = S_IFREG | 0444;
+        i.links = 1;
+        i.time  = fs.read_inode(1).time;
+        return i;
+    }
+    static bool is_stats_file(cromfs& fs, fuse_ino_t ino)
+    {
+        return ino == fs.get_unused_inodenum();
+    }
+
     void cromfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
     {
         if(trace_ops) fprintf(stderr, "lookup(%d,%s)\n", (int)parent, name);
+        cromfs_op_timer op_timer(OP_LOOKUP);
 
         CROMFS_CTX(fs)
 
@@ -149,7 +308,15 @@ extern "C" {
         pa.attr_timeout  = TIMEOUT_CONSTANT;
         pa.entry_timeout = TIMEOUT_CONSTANT;
 
-        if(inonum != 0)
+        if(inonum == 0 && parent == 1 && std::strcmp(name, stats_file_name) == 0)
+        {
+            pa.ino        = fs.get_unused_inodenum();
+            pa.generation = pa.ino;
+            pa.attr_timeout  = 0;
+            pa.entry_timeout = 0;
+            stat_inode(pa.attr, pa.ino, stats_file_inode(fs));
+        }
+        else if(inonum != 0)
         {
             cromfs_inode_internal ino = fs.read_inode(inonum);
             if(trace_ops) fprintf(stderr, "lookup: using inode: %s\n", DumpInode(ino).c_str());
@@ -164,11 +331,19 @@ extern "C" {
     void cromfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *)
     {
         if(trace_ops) fprintf(stderr, "getattr(%d)\n", (int)ino);
+        cromfs_op_timer op_timer(OP_GETATTR);
 
         CROMFS_CTX(fs)
 
-        const cromfs_inode_internal i = fs.read_inode(ino);
         struct stat attr;
+        if(is_stats_file(fs, ino))
+        {
+            stat_inode(attr, ino, stats_file_inode(fs));
+            fuse_reply_attr(req, &attr, 0);
+            return;
+        }
+
+        const cromfs_inode_internal i = fs.read_inode(ino);
 
         stat_inode(attr, ino, i);
         fuse_reply_attr(req, &attr, TIMEOUT_CONSTANT);
@@ -179,6 +354,7 @@ extern "C" {
     void cromfs_access(fuse_req_t req, fuse_ino_t ino, int mask)
     {
         if(trace_ops) fprintf(stderr, "access(%d,%d)\n", (int)ino, mask);
+        cromfs_op_timer op_timer(OP_ACCESS);
 
         /*CROMFS_CTX(fs)*/
 
@@ -189,6 +365,7 @@ extern "C" {
 
     void cromfs_readlink(fuse_req_t req, fuse_ino_t ino)
     {
+        cromfs_op_timer op_timer(OP_READLINK);
         CROMFS_CTX(fs)
 
         char Buf[65536];
@@ -207,9 +384,21 @@ extern "C" {
     void cromfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
     {
         if(trace_ops) fprintf(stderr, "open(%d)\n", (int)ino);
+        cromfs_op_timer op_timer(OP_OPEN);
 
         CROMFS_CTX(fs)
 
+        if(is_stats_file(fs, ino))
+        {
+            cromfs_open_file* file = new cromfs_open_file(stats_file_inode(fs));
+            file->is_stats = true;
+            file->stats    = GetStatistics(fs);
+            fi->fh         = (uintptr_t)file;
+            fi->direct_io  = 1;
+            if(fuse_reply_open(req, fi) != 0) delete file;
+            return;
+        }
+
         fi->keep_cache = 1;
         const cromfs_inode_internal i = fs.read_inode(ino);
         if(S_ISDIR(i.mode))
@@ -217,21 +406,114 @@ extern "C" {
         else if ((fi->flags & 3) != O_RDONLY)
             REPLY_ERR(EACCES);
         else
-            fuse_reply_open(req, fi);
+        {
+            cromfs_open_file* file = new cromfs_open_file(fs.read_inode_and_blocks(ino));
+            fi->fh = (uintptr_t)file;
+            if(fuse_reply_open(req, fi) != 0)
+            {
+                /* The open was interrupted; release() will not be called. */
+                delete file;
+            }
+        }
 
         CROMFS_CTX_END()
     }
 
+    void cromfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+    {
+        if(trace_ops) fprintf(stderr, "release(%d)\n", (int)ino);
+        cromfs_op_timer op_timer(OP_RELEASE);
+
+        delete get_open_file(fi);
+        fi->fh = 0;
+        fuse_reply_err(req, 0);
+    }
+
     void cromfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
-                     struct fuse_file_info */*fi*/)
+                     struct fuse_file_info *fi)
     {
         if(trace_ops) fprintf(stderr, "read(%d, %ld, %u)\n", (int)ino, (long)size, (unsigned)off);
+        cromfs_op_timer op_timer(OP_READ);
 
         CROMFS_CTX(fs)
 
+        cromfs_open_file* file = get_open_file(fi);
+
+        if(file && file->is_stats)
+        {
+            const std::string& text = file->stats;
+            const size_t begin = std::min((size_t)off, text.size());
+            fuse_reply_buf(req, text.data() + begin, std::min(size, text.size() - begin));
+            return;
+        }
+
+        /* Get the background threads working on what comes next
+         * while we serve this request. */
+        if(file && file->IsSequential(off, size))
+            fs.prefetch_file_data(file->inode, off + size);
+
+#if FUSE_VERSION >= 27
+        if(file)
+        {
+            /* Reply directly from the cached fblocks, without copying the
+             * data into a buffer of our own first. The segments keep the
+             * fblocks pinned until the reply has been sent.
+             */
+            std::vector<cromfs_data_segment> segments;
+            cromfs_stat_add(bytes_served, fs.map_file_data(file->inode, off, size, segments));
+
+            std::vector<struct iovec> iov;
+            iov.reserve(segments.size());
+            for(size_t a=0; a<segments.size(); ++a)
+            {
+                const cromfs_data_segment& seg = segments[a];
+                struct iovec v;
+                if(seg.fblock)
+                {
+                    v.iov_base = (void*)(seg.fblock->data() + seg.offset);
+                    v.iov_len  = seg.size;
+                    /* Consecutive blocks of a file are often
+                     * consecutive in the fblock, too. */
+                    if(!iov.empty()
+                    && (char*)iov.back().iov_base + iov.back().iov_len == v.iov_base)
+                        iov.back().iov_len += v.iov_len;
+                    else
+                        iov.push_back(v);
+                    continue;
+                }
+                for(size_t left = seg.size; left > 0; left -= v.iov_len)
+                {
+                    v.iov_base = (void*)zero_page;
+                    v.iov_len  = std::min(left, sizeof(zero_page));
+                    iov.push_back(v);
+                }
+            }
+
+            /* Fuse adds one iovec of its own for the header. Beyond
+             * IOV_MAX, writev() would fail and the request would never
+             * get a reply, so copy the data into one buffer instead.
+             */
+            if(iov.size() < IOV_MAX)
+            {
+                fuse_reply_iov(req, iov.empty() ? NULL : &iov[0], iov.size());
+                return;
+            }
+            std::vector<char> Buf;
+            Buf.reserve(size);
+            for(size_t a=0; a<iov.size(); ++a)
+                Buf.insert(Buf.end(), (const char*)iov[a].iov_base,
+                                      (const char*)iov[a].iov_base + iov[a].iov_len);
+            fuse_reply_buf(req, Buf.empty() ? NULL : &Buf[0], Buf.size());
+            return;
+        }
+#endif
+
         std::vector<unsigned char> Buf(size);
 
-        int_fast64_t result = fs.read_file_data(ino, off, &Buf[0], size, "fileread");
+        int_fast64_t result = file
+            ? fs.read_file_data(file->inode, off, &Buf[0], size, "fileread")
+            : fs.read_file_data(ino, off, &Buf[0], size, "fileread");
+        cromfs_stat_add(bytes_served, result);
         fuse_reply_buf(req, (const char*)&Buf[0], result);
 
         CROMFS_CTX_END()
@@ -240,6 +522,7 @@ extern "C" {
     void cromfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
     {
         if(trace_ops) fprintf(stderr, "opendir(%d)\n", (int)ino);
+        cromfs_op_timer op_timer(OP_OPENDIR);
 
         CROMFS_CTX(fs)
         fi->keep_cache = 1;
@@ -252,10 +535,14 @@ extern "C" {
         CROMFS_CTX_END()
     }
 
+    /* The headers of the inodes are read in one batch
+     * for each group of directory entries.
+     */
     void cromfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
                         struct fuse_file_info */*fi*/)
     {
         if(trace_ops) fprintf(stderr, "readdir(%d)\n", (int)ino);
+        cromfs_op_timer op_timer(OP_READDIR);
 
         CROMFS_CTX(fs)
         if(size <= 0)
@@ -281,6 +568,8 @@ extern "C" {
          */
         fs.read_dir(ino, 0, (uint_fast32_t)~0U);
 
+        std::vector<cromfs_inodenum_t> inonums;
+        std::vector<cromfs_inode_internal> inodes;
         while(size > 0)
         {
             unsigned dir_count = (size + size_per_elem - 1) / size_per_elem;
@@ -289,10 +578,26 @@ extern "C" {
             fprintf(stderr, "querying read_dir(%d,%u,%u)\n", (int)ino,off,dir_count);
 #endif
             cromfs_dirinfo dirinfo = fs.read_dir(ino, off, dir_count);
+
+        #if !LIGHTWEIGHT_READDIR
+            {
+                /* Apparently GNU find doesn't function without this. */
+                /* This is used to populate the d_type field in readdir results. */
+                inonums.clear();
+                for(cromfs_dirinfo::const_iterator
+                    i = dirinfo.begin();
+                    i != dirinfo.end();
+                    ++i)
+                    inonums.push_back(i->second);
+                fs.read_inodes(inonums, inodes);
+            }
+        #endif
+
+            size_t index = 0;
             for(cromfs_dirinfo::const_iterator
                 i = dirinfo.begin();
                 i != dirinfo.end();
-                ++i)
+                ++i, ++index)
             {
 #if READDIR_DEBUG
                 fprintf(stderr, "- encoding dir entry @%ld '%s' (%ld)\n",
@@ -305,10 +610,7 @@ extern "C" {
                 attr.st_ino  = i->second;
                 attr.st_mode = S_IFREG;
             #else
-                /* Apparently GNU find doesn't function without this. */
-                /* This is used to populate the d_type field in readdir results. */
-                const cromfs_inode_internal in = fs.read_inode(i->second);
-                stat_inode(attr, i->second, in);
+                stat_inode(attr, i->second, inodes[index]);
             #endif
 
                 ++off;
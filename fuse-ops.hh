@@ -5,6 +5,32 @@
 extern "C" {
 #endif
 
+/* Sets the RAM budgets of the caches, in megabytes, for
+ * filesystems created after this call. 0 = keep the default.
+ */
+void cromfs_set_cache_sizes(unsigned fblock_cache_mb, unsigned readdir_cache_mb);
+
+/* Enables decoding all inode headers into a table in RAM,
+ * for filesystems created after this call.
+ */
+void cromfs_set_inode_table(int enabled);
+
+/* Sets whether the image is memory-mapped instead of read
+ * with pread(), for filesystems created after this call.
+ */
+void cromfs_set_mmap(int enabled);
+
+/* Sets how many fblocks to decompress ahead of sequential readers,
+ * and with how many background threads. ~0U = keep the default.
+ */
+void cromfs_set_prefetch(unsigned fblocks, unsigned threads);
+
+/* Sets the file where decompressed fblocks are cached on disk,
+ * and its size in megabytes, for filesystems created after this
+ * call. NULL = no disk cache, 0 = the default size.
+ */
+void cromfs_set_disk_cache(const char* filename, unsigned size_mb);
+
 void* cromfs_create(int fd);
 void cromfs_initialize(void* userdata);
 
@@ -17,6 +43,7 @@ void cromfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *);
 void cromfs_access(fuse_req_t req, fuse_ino_t ino, int mask);
 void cromfs_readlink(fuse_req_t req, fuse_ino_t ino);
 void cromfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void cromfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
 void cromfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
                  struct fuse_file_info *fi);
 void cromfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
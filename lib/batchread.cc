@@ -0,0 +1,238 @@
+#define _LARGEFILE64_SOURCE
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+#include "batchread.hh"
+
+#ifdef HAS_IO_URING
+# include <linux/io_uring.h>
+# include <sys/syscall.h>
+# include <sys/mman.h>
+#endif
+
+/* The size limit of a ring. Ranges beyond this are read with pread(). */
+static const size_t MaxRingEntries = 4096;
+
+#ifdef HAS_IO_URING
+struct BatchFileRead::Ring
+{
+    int fd;
+    void*  sq_ptr; size_t sq_size;
+    void*  cq_ptr; size_t cq_size;
+    struct io_uring_sqe* sqes; size_t sqes_size;
+
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe* cqes;
+
+    Ring() : fd(-1), sq_ptr(MAP_FAILED), sq_size(0), cq_ptr(MAP_FAILED), cq_size(0),
+             sqes((struct io_uring_sqe*)MAP_FAILED), sqes_size(0),
+             sq_tail(0), sq_mask(0), sq_array(0),
+             cq_head(0), cq_tail(0), cq_mask(0), cqes(0) { }
+
+    ~Ring()
+    {
+        if(sqes != MAP_FAILED) munmap(sqes, sqes_size);
+        if(cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+        if(sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+        if(fd >= 0) close(fd);
+    }
+
+    bool Setup(unsigned entries)
+    {
+        struct io_uring_params p;
+        std::memset(&p, 0, sizeof(p));
+        fd = syscall(__NR_io_uring_setup, entries, &p);
+        if(fd < 0) return false;
+
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+        const bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+        if(single_mmap && cq_size > sq_size) sq_size = cq_size;
+
+        sq_ptr = mmap(NULL, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                      fd, IORING_OFF_SQ_RING);
+        if(sq_ptr == MAP_FAILED) return false;
+        if(single_mmap)
+            cq_ptr = sq_ptr;
+        else
+        {
+            cq_ptr = mmap(NULL, cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                          fd, IORING_OFF_CQ_RING);
+            if(cq_ptr == MAP_FAILED) return false;
+        }
+        sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        sqes = (struct io_uring_sqe*)
+            mmap(NULL, sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+                 fd, IORING_OFF_SQES);
+        if(sqes == MAP_FAILED) return false;
+
+        unsigned char* sq = (unsigned char*)sq_ptr;
+        unsigned char* cq = (unsigned char*)cq_ptr;
+        sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+        sq_mask  = (unsigned*)(sq + p.sq_off.ring_mask);
+        sq_array = (unsigned*)(sq + p.sq_off.array);
+        cq_head  = (unsigned*)(cq + p.cq_off.head);
+        cq_tail  = (unsigned*)(cq + p.cq_off.tail);
+        cq_mask  = (unsigned*)(cq + p.cq_off.ring_mask);
+        cqes     = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+        return true;
+    }
+
+    int Enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+    {
+        return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+    }
+};
+#else
+struct BatchFileRead::Ring { };
+#endif
+
+BatchFileRead::BatchFileRead(int f)
+    : fd(f), requests(), ring(0), ring_lock(), in_flight(0)
+{
+}
+
+BatchFileRead::~BatchFileRead()
+{
+    /* The kernel may still be writing into the targets. */
+    if(ring)
+    {
+        ScopedLock lck(ring_lock);
+        while(in_flight > 0) WaitForCompletion();
+    }
+    delete ring;
+}
+
+size_t BatchFileRead::Add(uint_fast64_t pos, size_t length, unsigned char* target)
+{
+    Request req;
+    req.pos          = pos;
+    req.iov.iov_base = target;
+    req.iov.iov_len  = length;
+    req.submitted    = false;
+    req.done         = false;
+    req.error        = 0;
+    requests.push_back(req);
+    return requests.size() - 1;
+}
+
+void BatchFileRead::Submit()
+{
+#ifdef HAS_IO_URING
+    /* A single read gains nothing from the setup of a ring. */
+    if(requests.size() < 2 || ring) return;
+
+    const size_t n = std::min(requests.size(), MaxRingEntries);
+    Ring* r = new Ring;
+    if(!r->Setup(n)) { delete r; return; }
+
+    const unsigned tail = *r->sq_tail;
+    for(size_t a=0; a<n; ++a)
+    {
+        const unsigned index = (tail + a) & *r->sq_mask;
+        struct io_uring_sqe& sqe = r->sqes[index];
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode    = IORING_OP_READV;
+        sqe.fd        = fd;
+        sqe.off       = requests[a].pos;
+        sqe.addr      = (unsigned long)&requests[a].iov;
+        sqe.len       = 1;
+        sqe.user_data = a;
+        r->sq_array[index] = index;
+    }
+    __sync_synchronize();
+    *r->sq_tail = tail + n;
+
+    int submitted;
+    do submitted = r->Enter(n, 0, 0);
+    while(submitted < 0 && errno == EINTR);
+    if(submitted <= 0) { delete r; return; }
+
+    /* Anything the kernel did not take is read with pread() instead. */
+    for(size_t a=0; a<(size_t)submitted; ++a)
+        requests[a].submitted = true;
+    in_flight = submitted;
+    ring      = r;
+#endif
+}
+
+int BatchFileRead::Wait(size_t index)
+{
+    Request& req = requests[index];
+    if(!req.submitted)
+    {
+        ReadRest(req, 0);
+        return req.error;
+    }
+    if(!req.done)
+    {
+        /* The lock is released after each completion, so that
+         * the other waiters can see if theirs has arrived. */
+        for(;;)
+        {
+            ScopedLock lck(ring_lock);
+            Reap();
+            if(req.done) break;
+            WaitForCompletion();
+        }
+    }
+    __sync_synchronize();
+    return req.error;
+}
+
+void BatchFileRead::ReadRest(Request& req, size_t already_read)
+{
+    unsigned char* target = (unsigned char*)req.iov.iov_base;
+    while(already_read < req.iov.iov_len)
+    {
+        ssize_t r = pread64(fd, target + already_read,
+                            req.iov.iov_len - already_read,
+                            req.pos + already_read);
+        if(r < 0 && errno == EINTR) continue;
+        if(r < 0) { req.error = errno; break; }
+        if(r == 0) { req.error = EIO; break; }
+        already_read += r;
+    }
+    req.done = true;
+}
+
+/* Must be called with ring_lock held. */
+void BatchFileRead::Reap()
+{
+#ifdef HAS_IO_URING
+    unsigned head = *ring->cq_head;
+    const unsigned tail = *ring->cq_tail;
+    __sync_synchronize();
+    for(; head != tail; ++head)
+    {
+        const struct io_uring_cqe& cqe = ring->cqes[head & *ring->cq_mask];
+        Request& req = requests[cqe.user_data];
+        if(cqe.res < 0)
+        {
+            req.error = -cqe.res;
+            req.done  = true;
+        }
+        else
+            ReadRest(req, cqe.res); // A short read is possible
+        --in_flight;
+    }
+    __sync_synchronize();
+    *ring->cq_head = head;
+#endif
+}
+
+/* Must be called with ring_lock held. */
+void BatchFileRead::WaitForCompletion()
+{
+#ifdef HAS_IO_URING
+    if(ring->Enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+    {
+        /* Should not happen. Give the kernel a moment, and retry. */
+        usleep(1000);
+    }
+    Reap();
+#endif
+}
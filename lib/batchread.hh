@@ -0,0 +1,68 @@
+#ifndef bqtBatchReadHH
+#define bqtBatchReadHH
+
+#include "endian.hh"
+#include "threadfun.hh"
+
+#include <vector>
+#include <sys/uio.h>
+
+/* Reads several ranges of a file at once.
+ *
+ * Add() the ranges, then Submit() them all. Wait(n) returns when
+ * the n'th range has been read, so that the caller can begin to
+ * process it while the others are still being read.
+ *
+ * With io_uring (HAS_IO_URING), Submit() hands all the reads to the
+ * kernel with a single system call. Without it, or if the kernel does
+ * not allow it, each range is read with pread() by the thread that
+ * waits for it; several threads waiting for different ranges then
+ * read in parallel.
+ *
+ * Wait() may be called from several threads at the same time,
+ * but each range must be waited for by one thread only.
+ */
+class BatchFileRead
+{
+public:
+    explicit BatchFileRead(int fd);
+    ~BatchFileRead();
+
+    /* Returns the index of the range.
+     * All ranges must be added before Submit(). */
+    size_t Add(uint_fast64_t pos, size_t length, unsigned char* target);
+
+    void Submit();
+
+    /* Returns 0 if the range was read completely, an errno value otherwise. */
+    int Wait(size_t index);
+
+    size_t size() const { return requests.size(); }
+
+private:
+    struct Request
+    {
+        uint_fast64_t pos;
+        struct iovec  iov;
+        bool          submitted;
+        volatile bool done;
+        int           error;
+    };
+    struct Ring;
+
+    int fd;
+    std::vector<Request> requests;
+    Ring*     ring;
+    MutexType ring_lock;
+    size_t    in_flight;
+
+    void ReadRest(Request& req, size_t already_read);
+    void Reap();
+    void WaitForCompletion();
+
+private:
+    BatchFileRead(const BatchFileRead&);
+    void operator=(const BatchFileRead&);
+};
+
+#endif
@@ -186,6 +186,96 @@ const cromfs_blockifier::ReusingPlan cromfs_blockifier::CreateReusingPlan(
     return ReusingPlan(false);
 }
 
+/* Content-defined chunking (--chunking cdc).
+ *
+ * cromfs cannot cut a file into blocks of different lengths: the block
+ * holding a file offset is always offset/bsize. But a block may begin
+ * anywhere in an fblock. So instead of moving the block boundaries, the
+ * blockifier marks content-defined anchors in the fblocks: positions
+ * where a gear hash of the preceding bytes has its top bits zero.
+ * A block being stored is scanned the same way, and an anchor found
+ * in it tells where the block would begin in an fblock that has the
+ * same bytes, however they are aligned there. This finds the data of
+ * a previous version of a file after insertions and deletions, which
+ * the autoindex (only every AutoIndexPeriod bytes) does not, and which
+ * the brute force search finds only in the last few fblocks.
+ */
+static const uint_fast32_t CDCWindow    = 64; // The gear hash sees this many bytes
+static const uint_fast32_t CDCKeyLength = 32; // Bytes after an anchor that are indexed
+
+static const struct gear_table
+{
+    uint_least64_t value[256];
+
+    gear_table()
+    {
+        uint_least64_t x = UINT64_C(0x9e3779b97f4a7c15);
+        for(unsigned a=0; a<256; ++a)
+        {
+            x ^= x << 13; x ^= x >> 7; x ^= x << 17; // xorshift64
+            value[a] = x;
+        }
+    }
+} gear;
+
+class GearHash
+{
+public:
+    GearHash() : hash(0), mask(0)
+    {
+        unsigned bits = 0;
+        while((UINT64_C(2) << bits) <= CDCAvgSize) ++bits;
+        /* The high bits depend on the most bytes. */
+        mask = ~(~UINT64_C(0) >> bits);
+    }
+    void Roll(unsigned char c) { hash = (hash << 1) + gear.value[c]; }
+    bool AtAnchor() const { return !(hash & mask); }
+private:
+    uint_least64_t hash, mask;
+};
+
+const cromfs_blockifier::ReusingPlan cromfs_blockifier::CreateAnchoredPlan(
+    const unsigned char* data, uint_fast32_t size,
+    const newhash_t crc)
+{
+    if(size < CDCWindow + CDCKeyLength) return ReusingPlan(false);
+
+    /* The anchors found in the fblocks obeyed CDCMinSize, which depends
+     * on where the scanning began. Here, any anchor may be the one. */
+    GearHash g;
+    uint_fast32_t pos = 0, tries = 0;
+    for(; pos < CDCWindow; ++pos) g.Roll(data[pos]);
+    for(; pos + CDCKeyLength <= size; g.Roll(data[pos++]))
+    {
+        if(!g.AtAnchor()) continue;
+        if(++tries > 8) break;
+
+        const newhash_t key = newhash_calc(data + pos, CDCKeyLength);
+        autoindex_t::find_index_t which;
+        cromfs_block_internal anchor;
+        for(; anchorindex.Find(key, anchor, which); ++which)
+        {
+            if(anchor.startoffs < pos) continue;
+            const uint_fast32_t startoffs = anchor.startoffs - pos;
+
+            const mkcromfs_fblock& fblock = fblocks[anchor.fblocknum];
+            DataReadBuffer Buffer; uint_fast32_t BufSize;
+          {
+            ScopedLock lck(fblock.GetMutex());
+            fblock.InitDataReadBuffer(Buffer, BufSize, startoffs, size);
+          }
+            if(BufSize >= startoffs + size
+            && std::memcmp(Buffer.Buffer, data, size) == 0)
+            {
+                cromfs_block_internal block;
+                block.define(anchor.fblocknum, startoffs);
+                return ReusingPlan(crc, block);
+            }
+        }
+    }
+    return ReusingPlan(false);
+}
+
 struct SmallestInfo
 {
     int                found; // 0=no, 1=yes, 2=full_overlap
@@ -499,7 +589,8 @@ void cromfs_blockifier::PredictiveAutoIndex(
     {
         DataReadBuffer Buffer; uint_fast32_t BufSize;
         fblock.InitDataReadBuffer(Buffer, BufSize, startoffs, blocksize);
-        TryAutoIndex(fblocknum, Buffer.Buffer, blocksize, startoffs);
+        TryAutoIndex(fblocknum, Buffer.Buffer, blocksize, startoffs,
+                     newhash_calc(Buffer.Buffer, blocksize));
     }
     else if(fblocknum+1 < fblocks.size())
     {
@@ -595,6 +686,9 @@ cromfs_blocknum_t cromfs_blockifier::Execute(
     fblock.put_appended_raw(appended, &plan.data[0], plan.data.size());
     fblock_totalsize += new_raw_size - old_raw_size;
 
+    if(Chunking_Method == Chunking_CDC && new_raw_size > old_raw_size)
+        AnchorIndex(fblocknum, new_raw_size);
+
 /**/
 #if 1
     if(true) //DoUpdateBlockIndex
@@ -648,6 +742,33 @@ cromfs_blocknum_t cromfs_blockifier::Execute(
     return CreateNewBlock(block);
 }
 
+/* An fblock that has less than MinimumFreeSpace bytes of room left
+ * is no longer offered for appending (see UpdateFreeSpaceIndex above),
+ * except by the brute force search of the last few fblocks. Once it
+ * is past those too, it will not change anymore, and its compression
+ * need not wait for the final phase.
+ */
+void cromfs_blockifier::SealFblocks(cromfs_fblocknum_t appended_to)
+{
+    if(!CompressSealedFblocks) return;
+
+    const cromfs_fblocknum_t first_searched =
+        fblocks.size() > MaxFblockCountForBruteForce
+            ? fblocks.size() - MaxFblockCountForBruteForce
+            : 0;
+    const mkcromfs_fblockset& fblocks_const = fblocks;
+
+    // Only these two may have become sealable since the last call.
+    const cromfs_fblocknum_t check[2] = { appended_to, first_searched-1 };
+    for(unsigned a=0; a<2; ++a)
+        if(check[a] < first_searched
+        && fblocks.IsFull(check[a])
+        && !fblocks_const[check[a]].is_sealed())
+        {
+            fblocks[check[a]].Seal();
+        }
+}
+
 
 ///////////////////////////////////////////////
 
@@ -664,10 +785,9 @@ void cromfs_blockifier::TryAutoIndex(
     const cromfs_fblocknum_t fblocknum,
     const unsigned char* ptr,
     uint_fast32_t bsize,
-    uint_fast32_t startoffs)
+    uint_fast32_t startoffs,
+    const newhash_t crc)
 {
-    const newhash_t crc = newhash_calc(ptr, bsize);
-
     /* Check whether the block has already been indexed
      */
 #if 1
@@ -692,11 +812,27 @@ void cromfs_blockifier::AutoIndexBetween(const cromfs_fblocknum_t fblocknum,
     uint_fast32_t bsize,
     uint_fast32_t stepping)
 {
+    /* Hash several positions at a time with newhash_calc_multi(). */
+    enum { batch = 8 };
     while(min_offset + bsize <= max_size)
     {
-        TryAutoIndex(fblocknum, ptr, bsize, min_offset);
-        ptr          += stepping;
-        min_offset   += stepping;
+        const unsigned char* bufs[batch];
+        unsigned long        sizes[batch];
+        newhash_t            hashes[batch];
+        unsigned n_hashes = 0;
+        for(; n_hashes < batch && min_offset + n_hashes*stepping + bsize <= max_size; ++n_hashes)
+        {
+            bufs[n_hashes]  = ptr + n_hashes*stepping;
+            sizes[n_hashes] = bsize;
+        }
+        newhash_calc_multi(hashes, bufs, sizes, n_hashes);
+
+        for(unsigned b=0; b<n_hashes; ++b)
+        {
+            TryAutoIndex(fblocknum, ptr, bsize, min_offset, hashes[b]);
+            ptr          += stepping;
+            min_offset   += stepping;
+        }
     }
 }
 
@@ -835,6 +971,40 @@ void cromfs_blockifier::AutoIndex(const cromfs_fblocknum_t fblocknum,
     }
 }
 
+void cromfs_blockifier::AnchorIndex(const cromfs_fblocknum_t fblocknum,
+    uint_fast32_t new_raw_size)
+{
+    anchor_scan& progress = anchor_progress[fblocknum];
+
+    /* An anchor is indexed by the bytes after it, and recognized
+     * by the bytes before it. Scan what now has both. */
+    const uint_fast32_t first = std::max(progress.scanned, CDCWindow);
+    if(first + CDCKeyLength > new_raw_size) return;
+    const uint_fast32_t last  = new_raw_size - CDCKeyLength;
+    const uint_fast32_t begin = first - CDCWindow;
+
+    const mkcromfs_fblock& fblock = fblocks[fblocknum];
+    DataReadBuffer Buffer; uint_fast32_t BufSize;
+    fblock.InitDataReadBuffer(Buffer, BufSize, begin, new_raw_size - begin);
+    const unsigned char* data = Buffer.Buffer;
+
+    GearHash g;
+    uint_fast32_t pos = begin;
+    for(; pos < first; ++pos) g.Roll(data[pos - begin]);
+    for(; pos <= last; g.Roll(data[pos++ - begin]))
+    {
+        const uint_fast32_t gap = pos - progress.last_anchor;
+        if(gap < CDCMinSize) continue;
+        if(!g.AtAnchor() && gap < CDCMaxSize) continue;
+
+        cromfs_block_internal anchor;
+        anchor.define(fblocknum, pos);
+        anchorindex.Add(newhash_calc(data + pos - begin, CDCKeyLength), anchor);
+        progress.last_anchor = pos;
+    }
+    progress.scanned = pos;
+}
+
 ///////////////////////////////////////////////
 
 class bitset1p32
@@ -941,6 +1111,19 @@ public:
 
         return schedule[pos];
     }
+
+    /* Closes the least recently used sources, if too many
+     * have been opened while can_close was false. */
+    void Trim()
+    {
+        ScopedLock lck(lock);
+        while(n_open > max_open)
+        {
+            schedule[open_list.back()].GetDataSource()->close();
+            open_list.pop_back();
+            --n_open;
+        }
+    }
 };
 
 class BlockWhereList
@@ -1018,6 +1201,23 @@ static void VerifyInodeIntact(
 }
 #endif
 
+/* The hash by which identical blocks are found. With --fingerprintbits 64,
+ * it is the lower half of a 64-bit fingerprint, and the upper half
+ * is put in high. Otherwise high is 0.
+ */
+static newhash_t CalcBlockHash(const unsigned char* data, uint_fast32_t size,
+                               uint_least32_t& high)
+{
+    if(FingerprintBits < 64)
+    {
+        high = 0;
+        return newhash_calc(data, size);
+    }
+    const newhash64_t fingerprint = newhash64_calc(data, size);
+    high = fingerprint >> 32;
+    return fingerprint;
+}
+
 typedef std::pair<uint_least32_t/* current whereinfo index */,
                   uint_least32_t/* previous whereinfo index, match */
                  > identical_item;
@@ -1134,6 +1334,38 @@ private:
     void operator=(const identical_list&);
 };
 
+/* The blockifying pass reads and hashes the blocks of the next window
+ * in parallel, while the blocks of the current window are placed into
+ * fblocks one at a time, in their original order. The reading thus
+ * overlaps with the placement, and the placement, which alone decides
+ * the image, is the same as if nothing was read ahead.
+ */
+static const uint_fast64_t ReadAheadBytes  = 16 << 20; // Per window
+static const size_t        ReadAheadBlocks = 4096;     // Per window
+enum { n_readlocks = 64 }; // Serializes the reads from each datasource
+
+struct readahead_block
+{
+    size_t         schedno;
+    uint_fast64_t  offset;
+    uint_fast32_t  eat;
+    size_t         bufpos;   // Position in readahead_window::data
+    unsigned char* target;   // Where the block number will be written to
+    uint_fast64_t  other;    // The identical block, if has_other
+    bool           has_other;
+    bool           other_verified; // The contents matched, too
+    newhash_t      hash;
+};
+
+struct readahead_window
+{
+    std::vector<readahead_block> blocks;
+    std::vector<size_t>          runs; // Where each file's blocks begin, and the end
+    std::vector<unsigned char>   data;
+
+    readahead_window() : blocks(), runs(), data() { }
+};
+
 void cromfs_blockifier::FlushBlockifyRequests(const char* purpose)
 {
     MAYBE_PARALLEL_NS::stable_sort(schedule.begin(), schedule.end(),
@@ -1205,7 +1437,10 @@ void cromfs_blockifier::FlushBlockifyRequests(const char* purpose)
             }
 
             source->open();
-            for(uint_fast64_t offset=0; offset<nbytes; offset += blocksize)
+            /* Read and hash several blocks at a time, so that
+             * newhash_calc_multi() can hash them side by side. */
+            enum { batch = 8 };
+            for(uint_fast64_t offset=0; offset<nbytes; offset += blocksize*batch)
             {
                 if(total_done - last_report_pos >= 1048576*4) // at 4 MB intervals
                 {
@@ -1219,34 +1454,57 @@ void cromfs_blockifier::FlushBlockifyRequests(const char* purpose)
                     }
                 }
 
-                uint_fast64_t eat = blocksize;
+                uint_fast64_t eat = blocksize*batch;
                 if(offset+eat > nbytes) eat = nbytes-offset;
 
                 source->read(buf, eat, offset);
-                const newhash_t hash = newhash_calc(buf.Buffer, eat);
 
-                hashlock[hash / (UINT64_C(0x100000000) / n_hashlocks)].Lock();
-                if(hash_seen->test(hash))
+                const unsigned char* bufs[batch];
+                unsigned long        sizes[batch];
+                newhash_t            hashes[batch];
+                unsigned n_hashes = 0;
+                for(uint_fast64_t pos = 0; pos < eat; pos += blocksize, ++n_hashes)
                 {
-                    if(!hash_duplicate->test(hash))
-                    {
-                        hash_duplicate->set(hash);
-                        #pragma omp atomic
-                        ++n_collisions;
-                    }
+                    bufs[n_hashes]  = buf.Buffer + pos;
+                    sizes[n_hashes] = std::min(blocksize, eat-pos);
                 }
+                if(FingerprintBits < 64)
+                    newhash_calc_multi(hashes, bufs, sizes, n_hashes);
                 else
                 {
-                    hash_seen->set(hash);
-                    #pragma omp atomic
-                    ++n_unique;
+                    /* The lower halves, which the next phase uses as hashes. */
+                    newhash64_t fingerprints[batch];
+                    newhash64_calc_multi(fingerprints, bufs, sizes, n_hashes);
+                    std::copy(fingerprints, fingerprints+n_hashes, hashes);
+                }
+
+                for(unsigned b=0; b<n_hashes; ++b)
+                {
+                    const newhash_t hash = hashes[b];
+
+                    hashlock[hash / (UINT64_C(0x100000000) / n_hashlocks)].Lock();
+                    if(hash_seen->test(hash))
+                    {
+                        if(!hash_duplicate->test(hash))
+                        {
+                            hash_duplicate->set(hash);
+                            #pragma omp atomic
+                            ++n_collisions;
+                        }
+                    }
+                    else
+                    {
+                        hash_seen->set(hash);
+                        #pragma omp atomic
+                        ++n_unique;
+                    }
+                    hashlock[hash / (UINT64_C(0x100000000) / n_hashlocks)].Unlock();
                 }
-                hashlock[hash / (UINT64_C(0x100000000) / n_hashlocks)].Unlock();
 
               #pragma omp atomic
                 total_done += eat;
               #pragma omp atomic
-                ++blocks_done;
+                blocks_done += n_hashes;
             }
             source->close();
         }
@@ -1296,12 +1554,24 @@ void cromfs_blockifier::FlushBlockifyRequests(const char* purpose)
 
         std::vector<newhash_t> full_hash_list; // For Collect and Collect_Speedup
 
+        /* For --fingerprintbits 64: the upper halves of the fingerprints,
+         * by block. A hash match is only verified by reading the data
+         * if these match too. */
+        std::vector<uint_least32_t> hash_high_list;
+        uint_fast64_t n_false_matches = 0;
+        uint_fast64_t n_refuted_matches = 0;
+
         if(BlockHashing_Method == BlockHashing_Collect
         || BlockHashing_Method == BlockHashing_Collect_Speedup)
         {
             full_hash_list.reserve(blocks_total);
         }
 
+        if(FingerprintBits >= 64 && !reuselist_already_loaded)
+        {
+            hash_high_list.reserve(blocks_total);
+        }
+
         if(BlockHashing_Method == BlockHashing_Collect_Speedup
         || BlockHashing_Method == BlockHashing_All_Speedup)
         {
@@ -1359,6 +1629,7 @@ void cromfs_blockifier::FlushBlockifyRequests(const char* purpose)
                 */
                 source->read(buf, eat, offset);
                 newhash_t hash = 0;
+                uint_least32_t hash_high = 0;
                 /*
                 std::printf("... hash %08X\n", (unsigned) hash);
                 */
@@ -1372,20 +1643,20 @@ void cromfs_blockifier::FlushBlockifyRequests(const char* purpose)
                     case BlockHashing_BlanksOnly:
                         if(is_zero_block(buf.Buffer, eat))
                         {
-                            hash = newhash_calc(buf.Buffer, eat);
+                            hash = CalcBlockHash(buf.Buffer, eat, hash_high);
                             do_checkhash = use_index;
                         }
                         break;
                     case BlockHashing_All:
-                        hash = newhash_calc(buf.Buffer, eat);
+                        hash = CalcBlockHash(buf.Buffer, eat, hash_high);
                         do_checkhash = use_index;
                         break;
                     case BlockHashing_All_Prepass:
-                        hash = newhash_calc(buf.Buffer, eat);
+                        hash = CalcBlockHash(buf.Buffer, eat, hash_high);
                         do_checkhash = hash_duplicate->test(hash) ? use_index : no;
                         break;
                     case BlockHashing_All_Speedup:
-                        hash = newhash_calc(buf.Buffer, eat);
+                        hash = CalcBlockHash(buf.Buffer, eat, hash_high);
                         if(hash_seen->test(hash))
                         {
                             do_checkhash = use_index;
@@ -1422,14 +1693,14 @@ void cromfs_blockifier::FlushBlockifyRequests(const char* purpose)
                         break;
                     case BlockHashing_Collect:
                     {
-                        hash = newhash_calc(buf.Buffer, eat);
+                        hash = CalcBlockHash(buf.Buffer, eat, hash_high);
                         full_hash_list.push_back(hash);
                         do_checkhash = use_list;
                         break;
                     }
                     case BlockHashing_Collect_Speedup:
                     {
-                        hash = newhash_calc(buf.Buffer, eat);
+                        hash = CalcBlockHash(buf.Buffer, eat, hash_high);
                         full_hash_list.push_back(hash);
                         if(hash_seen->test(hash))
                         {
@@ -1447,6 +1718,9 @@ void cromfs_blockifier::FlushBlockifyRequests(const char* purpose)
                     }
                 }
 
+                if(FingerprintBits >= 64)
+                    hash_high_list.push_back(hash_high);
+
                 switch(do_checkhash) // Check the hash contents?
                 {
                     case no: break;
@@ -1524,10 +1798,21 @@ void cromfs_blockifier::FlushBlockifyRequests(const char* purpose)
 
                             if(blocksize > blocksize2) continue;
                             if(filepos + eat > nbytes2) continue;
+                            if(FingerprintBits >= 64 && hash_high_list[other] != hash_high)
+                            {
+                                #pragma omp atomic
+                                ++n_refuted_matches;
+                                continue;
+                            }
 
                             source2->read(buf2, eat, filepos);
 
-                            if(!std::memcmp(buf.Buffer, buf2.Buffer, eat))
+                            if(std::memcmp(buf.Buffer, buf2.Buffer, eat) != 0)
+                            {
+                                #pragma omp atomic
+                                ++n_false_matches;
+                            }
+                            else
                             {
                                 // It is an exact match.
                                 if(identical_lock.TryLock())
@@ -1623,10 +1908,21 @@ void cromfs_blockifier::FlushBlockifyRequests(const char* purpose)
 
                                 if(blocksize > blocksize2) continue;
                                 if(filepos + eat > nbytes2) continue;
+                                if(FingerprintBits >= 64 && hash_high_list[other] != hash_high)
+                                {
+                                    #pragma omp atomic
+                                    ++n_refuted_matches;
+                                    continue;
+                                }
 
                                 source2->read(buf2, eat, filepos);
 
-                                if(!std::memcmp(buf.Buffer, buf2.Buffer, eat))
+                                if(std::memcmp(buf.Buffer, buf2.Buffer, eat) != 0)
+                                {
+                                    #pragma omp atomic
+                                    ++n_false_matches;
+                                }
+                                else
                                 {
                                     // It is an exact match.
                                     if(identical_lock.TryLock())
@@ -1690,6 +1986,15 @@ void cromfs_blockifier::FlushBlockifyRequests(const char* purpose)
             (unsigned long) (blocks_done - identical_list.size()),
             100.0 - (blocks_done - identical_list.size()) * 100.0 / blocks_done
                    );
+        if(n_false_matches || n_refuted_matches)
+        {
+            std::printf("%lu hash matches were false, and took a read to refute.",
+                (unsigned long) n_false_matches);
+            if(FingerprintBits >= 64)
+                std::printf(" %lu more were refuted by the 64-bit fingerprints.",
+                    (unsigned long) n_refuted_matches);
+            std::printf("\n");
+        }
         std::fflush(stdout);
 
         blocks.Reserve(blocks.size() + blocks_done - identical_list.size());
@@ -1709,83 +2014,176 @@ void cromfs_blockifier::FlushBlockifyRequests(const char* purpose)
 
         size_t identical_list_pos=0;
 
-        DataReadBuffer buf;
-        for(size_t a=0; a < schedule.size(); ++a)
+        // Sources are only closed between windows, when nothing is reading.
+        schedule_cache.can_close = false;
+        MutexType readlock[n_readlocks];
+
+        readahead_window windows[2];
+        size_t        fill_schedno  = 0;
+        uint_fast64_t fill_offset   = 0;
+        uint_fast64_t fill_blocknum = 0;
+        bool          fast_codec    = false;
+
+      #pragma omp parallel
+      #pragma omp single
+        for(unsigned w = 0; ; ++w)
         {
-            schedule_item& s = schedule_cache.Get(a);
-            datasource_t* source  = s.GetDataSource();
-            unsigned char* target = s.GetBlockTarget();
-            uint_fast64_t nbytes  = source->size();
-            uint_fast64_t blocksize = s.GetBlockSize();
-        #ifndef NDEBUG
-            unsigned char* target_end =
-                target + BLOCKNUM_SIZE_BYTES() * ((nbytes + blocksize-1) / blocksize);
-        #endif
-            if(DisplayBlockSelections)
+            readahead_window* const cur  = &windows[w % 2];
+            readahead_window* const next = &windows[(w+1) % 2];
+
+            /* Choose the blocks for the next window. */
+            next->blocks.clear();
+            next->runs.clear();
+            uint_fast64_t next_bytes = 0;
+            while(fill_schedno < schedule.size()
+               && next_bytes < ReadAheadBytes
+               && next->blocks.size() < ReadAheadBlocks)
             {
-                std::printf("%s <size %"LL_FMT"u, block size %"LL_FMT"u>\n",
-                    source->getname().c_str(),
-                    (unsigned long long)nbytes,
-                    (unsigned long long)blocksize);
+                const schedule_item& s = schedule[fill_schedno];
+                uint_fast64_t nbytes    = s.GetDataSource()->size();
+                uint_fast64_t blocksize = s.GetBlockSize();
+                if(fill_offset >= nbytes)
+                {
+                    ++fill_schedno;
+                    fill_offset = 0;
+                    continue;
+                }
+                if(fill_offset == 0 || next->blocks.empty())
+                    next->runs.push_back(next->blocks.size());
+
+                while(identical_list_pos < identical_list.size()
+                   && identical_list[identical_list_pos].first < fill_blocknum)
+                {
+                    ++identical_list_pos;
+                }
+
+                readahead_block b;
+                b.schedno   = fill_schedno;
+                b.offset    = fill_offset;
+                b.eat       = std::min(blocksize, nbytes - fill_offset);
+                b.bufpos    = next_bytes;
+                b.target    = s.GetBlockTarget()
+                            + (fill_offset / blocksize) * BLOCKNUM_SIZE_BYTES();
+                b.has_other = identical_list_pos < identical_list.size()
+                           && identical_list[identical_list_pos].first == fill_blocknum;
+                b.other     = b.has_other ? identical_list[identical_list_pos].second : 0;
+                b.other_verified = false;
+                b.hash      = 0;
+                next->blocks.push_back(b);
+
+                next_bytes  += b.eat;
+                fill_offset += blocksize;
+                ++fill_blocknum;
             }
-        #ifndef NDEBUG
-            VerifyInodeIntact(target, nbytes, blocksize, source->getname());
-        #endif
+            next->runs.push_back(next->blocks.size());
+            next->data.resize(next_bytes);
+            identical_list.DoneWithUntil(identical_list_pos);
 
-            //printf("rangebegin %p\nrange  end %p...\n", target, target_end);
-            for(uint_fast64_t offset=0; offset<nbytes; offset += blocksize)
-            {
-            #ifndef NDEBUG
-                assertbegin();
-                const void* tgt_next = (const void*)(target + BLOCKNUM_SIZE_BYTES());
-                const void* tgt_end  = (const void*)target_end;
-                assert2var(tgt_next, tgt_end);
-                assert(tgt_next <= tgt_end);
-                assertflush();
-            #endif
+            if(w > 0 && cur->blocks.empty()) break;
 
-                if(DisplayBlockSelections
-                || total_done - last_report_pos >= 1048576*4) // at 4 MB intervals
+            /* Read the next window, one file at a time per task,
+             * hash its blocks, and confirm the identical blocks. */
+            for(size_t r=0; r+1 < next->runs.size(); ++r)
+            {
+                #pragma omp task firstprivate(r)
                 {
-                    //if(displaylock.TryLock())
-                    //{
-                        std::string autoindex_stats =
-                            " idx("+autoindex.GetStatistics()+")";
-
-                        std::string progress_stats =
-                            " rawin(" + ReportSize(total_done)
-                            +")rawout(" + ReportSize(fblock_totalsize)
-                            +")diff(" + ReportSize(total_done-fblock_totalsize)
-                            +")";
-                        std::string stats = autoindex_stats + progress_stats;
+                    DataReadBuffer buf;
+                    const size_t first = next->runs[r], end = next->runs[r+1];
+                    const readahead_block& f = next->blocks[first];
+                    const readahead_block& l = next->blocks[end-1];
+                    const uint_fast64_t length = l.bufpos + l.eat - f.bufpos;
+
+                    { ScopedLock lck(readlock[f.schedno % n_readlocks]);
+                      schedule_cache.Get(f.schedno).GetDataSource()->read(buf, length, f.offset);
+                      std::memcpy(&next->data[f.bufpos], buf.Buffer, length); }
+
+                    enum { batch = 8 };
+                    for(size_t b = first; b < end; b += batch)
+                    {
+                        const unsigned char* bufs[batch];
+                        unsigned long        sizes[batch];
+                        newhash_t            hashes[batch];
+                        unsigned n_hashes = 0;
+                        for(; n_hashes < batch && b+n_hashes < end; ++n_hashes)
+                        {
+                            bufs[n_hashes]  = &next->data[next->blocks[b+n_hashes].bufpos];
+                            sizes[n_hashes] = next->blocks[b+n_hashes].eat;
+                        }
+                        newhash_calc_multi(hashes, bufs, sizes, n_hashes);
+                        for(unsigned n=0; n<n_hashes; ++n)
+                            next->blocks[b+n].hash = hashes[n];
+                    }
 
-                        DisplayProgress(label, total_done, total_size, blocks_done, blocks_total,
-                                        stats.c_str());
-                        //displaylock.Unlock();
-                        last_report_pos = total_done;
-                    //}
+                    for(size_t b = first; b < end; ++b)
+                    {
+                        readahead_block& blk = next->blocks[b];
+                        if(!blk.has_other) continue;
+
+                        uint_fast64_t filepos;
+                        schedule_item* s2 = where_list.Find(schedule_cache, blk.other, filepos);
+                        ScopedLock lck(readlock[(s2 - &schedule[0]) % n_readlocks]);
+                        s2->GetDataSource()->read(buf, blk.eat, filepos);
+                        blk.other_verified =
+                            std::memcmp(buf.Buffer, &next->data[blk.bufpos], blk.eat) == 0;
+                    }
                 }
-                uint_fast64_t eat = blocksize;
-                if(offset+eat > nbytes) eat = nbytes-offset;
+            }
 
-                while(identical_list_pos < identical_list.size()
-                   && identical_list[identical_list_pos].first < blocks_done)
+            /* Meanwhile, place the current window in order. */
+            #pragma omp task
+            for(size_t n=0; n < cur->blocks.size(); ++n)
+            {
+                const readahead_block& b = cur->blocks[n];
+                const schedule_item& s   = schedule[b.schedno];
+                datasource_t* source     = s.GetDataSource();
+                uint_fast64_t blocksize  = s.GetBlockSize();
+                uint_fast64_t eat        = b.eat;
+                unsigned char* target    = b.target;
+                const unsigned char* data = &cur->data[b.bufpos];
+
+                if(b.offset == 0)
                 {
-                    ++identical_list_pos;
+                    fast_codec = UseFastCodecFor(source->getname());
+                    if(DisplayBlockSelections)
+                    {
+                        std::printf("%s <size %"LL_FMT"u, block size %"LL_FMT"u>\n",
+                            source->getname().c_str(),
+                            (unsigned long long)source->size(),
+                            (unsigned long long)blocksize);
+                    }
+                #ifndef NDEBUG
+                    VerifyInodeIntact(target, source->size(), blocksize, source->getname());
+                #endif
                 }
 
-                schedule_cache.can_close = false;
+                if(DisplayBlockSelections
+                || total_done - last_report_pos >= 1048576*4) // at 4 MB intervals
+                {
+                    std::string autoindex_stats =
+                        " idx("+autoindex.GetStatistics()+")";
+                    if(Chunking_Method == Chunking_CDC)
+                        autoindex_stats += " anchors("+anchorindex.GetStatistics()+")";
+
+                    std::string progress_stats =
+                        " rawin(" + ReportSize(total_done)
+                        +")rawout(" + ReportSize(fblock_totalsize)
+                        +")diff(" + ReportSize(total_done-fblock_totalsize)
+                        +")";
+                    std::string stats = autoindex_stats + progress_stats;
+
+                    DisplayProgress(label, total_done, total_size, blocks_done, blocks_total,
+                                    stats.c_str());
+                    last_report_pos = total_done;
+                }
 
-                if(identical_list_pos < identical_list.size()
-                && identical_list[identical_list_pos].first == blocks_done)
+                if(b.has_other)
                 {
-                    size_t other = identical_list[identical_list_pos].second;
                     // Make us simply a reference to that block's
                     // blocknumber, whatever it might have been.
 
                     // Find the schedule item
                     uint_fast64_t filepos;
-                    schedule_item* s2 = where_list.Find(schedule_cache, other, filepos);
+                    schedule_item* s2 = where_list.Find(schedule_cache, b.other, filepos, false);
 
                     datasource_t* source2  = s2->GetDataSource();
                     unsigned char* target2 = s2->GetBlockTarget();
@@ -1794,37 +2192,27 @@ void cromfs_blockifier::FlushBlockifyRequests(const char* purpose)
                     VerifyInodeIntact(target2, source2->size(), blocksize2, source2->getname());
         #endif
 
-                    // Find the blocknumber
-                    uint_fast64_t blockindex2 = filepos / blocksize2;
-                    uint_fast64_t blocknum = get_n(target2 + blockindex2 * BLOCKNUM_SIZE_BYTES(), BLOCKNUM_SIZE_BYTES());
-                    // Write the blocknumber here
-                    //printf("writing to %p (%u)...\n", target, BLOCKNUM_SIZE_BYTES());
-                    put_n(target, blocknum, BLOCKNUM_SIZE_BYTES());
-                #if 0
-                    assertbegin();
-                    assert8var(blocknum, blocks_done,other, blocks.size(), filepos, blocksize2, blocksize, blockindex2);
-                    assert(other    < blocks_done);
-                    assert(blocknum < blocks.size());
-                    assertflush();
-                #endif
-
-                    DataReadBuffer buf2;
-                    source->read(buf, eat, offset);
-                    source2->read(buf2, eat, filepos);
-                    if(std::memcmp(buf.Buffer, buf2.Buffer, eat) != 0)
+                    if(!b.other_verified)
                     {
                         std::fprintf(stderr,
                             "Invalid reuse indication %lu = %lu. Not identical %u bytes:\n"
                             "1: Position%14"LL_FMT"u in %s\n"
                             "2: Position%14"LL_FMT"u in %s\n",
                             (unsigned long) blocks_done,
-                            (unsigned long) other,
+                            (unsigned long) b.other,
                             (unsigned) eat,
-                            (unsigned long long) offset, source->getname().c_str(),
+                            (unsigned long long) b.offset, source->getname().c_str(),
                             (unsigned long long) filepos, source2->getname().c_str()
                         );
                         goto dontreuse;
                     }
+
+                    // Find the blocknumber
+                    uint_fast64_t blockindex2 = filepos / blocksize2;
+                    uint_fast64_t blocknum = get_n(target2 + blockindex2 * BLOCKNUM_SIZE_BYTES(), BLOCKNUM_SIZE_BYTES());
+                    // Write the blocknumber here
+                    put_n(target, blocknum, BLOCKNUM_SIZE_BYTES());
+
                     if(DisplayBlockSelections)
                     {
                         const cromfs_block_internal& block = blocks[blocknum];
@@ -1841,7 +2229,6 @@ void cromfs_blockifier::FlushBlockifyRequests(const char* purpose)
                 }
                 else
                 {
-                    source->read(buf, eat, offset);
                 dontreuse:
                     // Decide the placement within fblocks.
                     // PLAN: 1. Find from autoindex...
@@ -1849,34 +2236,35 @@ void cromfs_blockifier::FlushBlockifyRequests(const char* purpose)
                     //       3. Append
                     // In any case, a new block number is created.
 
-                    const newhash_t hash = newhash_calc(buf.Buffer, eat);
-                    if(ReusingPlan reuse = CreateReusingPlan(buf.Buffer, eat, hash))
+                    const newhash_t hash = b.hash;
+                    ReusingPlan reuse = CreateReusingPlan(data, eat, hash);
+                    if(!reuse && Chunking_Method == Chunking_CDC)
+                        reuse = CreateAnchoredPlan(data, eat, hash);
+                    if(reuse)
                     {
                         cromfs_blocknum_t blocknum = Execute(reuse, eat);
-                        //printf("writing to %p (%u)...\n", target, BLOCKNUM_SIZE_BYTES());
                         put_n(target, blocknum, BLOCKNUM_SIZE_BYTES());
+                        if(fast_codec) fblocks[blocks[blocknum].fblocknum].PreferFastCodec();
                     }
                     else
                     {
                         overlaptest_history_t hist;
-                        BoyerMooreNeedleWithAppend needle(buf.Buffer, eat);
+                        BoyerMooreNeedleWithAppend needle(data, eat);
                         WritePlan write = CreateWritePlan(needle, hash, hist);
 
                         cromfs_blocknum_t blocknum = Execute(write);
 
-                        //printf("writing to %p (%u)...\n", target, BLOCKNUM_SIZE_BYTES());
                         put_n(target, blocknum, BLOCKNUM_SIZE_BYTES());
+                        if(fast_codec) fblocks[write.fblocknum].PreferFastCodec();
+                        SealFblocks(write.fblocknum);
                     }
                 }
-                target += BLOCKNUM_SIZE_BYTES(); // where block number will be written to.
                 total_done += eat;
                 ++blocks_done;
-
-                schedule_cache.can_close = true;
-                schedule_cache.Get(a); // ensure it's not unloaded
             }
 
-            identical_list.DoneWithUntil(identical_list_pos);
+            #pragma omp taskwait
+            schedule_cache.Trim();
         }
     }
     schedule.clear();
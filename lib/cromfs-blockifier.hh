@@ -23,7 +23,8 @@ public:
         : schedule(),
           blocks(blocks_vec),
           fblocks(), fblock_totalsize(0),
-          last_autoindex_length(), autoindex()
+          last_autoindex_length(), autoindex(),
+          anchor_progress(), anchorindex()
     {
         /* Set up the global pointer to our block_index
          * so that cromfs_fblockfun.cc can access it in
@@ -73,6 +74,13 @@ private:
         const unsigned char* data, uint_fast32_t size,
         const newhash_t crc);
 
+    /* Same, but finds the data by the content-defined anchors in it,
+     * wherever it begins in the fblock. For --chunking cdc.
+     */
+    const ReusingPlan CreateAnchoredPlan(
+        const unsigned char* data, uint_fast32_t size,
+        const newhash_t crc);
+
     /* Execute a reusing plan */
     cromfs_blocknum_t Execute(const ReusingPlan& plan, uint_fast32_t blocksize);
 
@@ -100,6 +108,9 @@ private:
     /* Execute an appension plan */
     cromfs_blocknum_t Execute(const WritePlan& plan);
 
+    /* Seal the fblocks that can no longer be appended to */
+    void SealFblocks(cromfs_fblocknum_t appended_to);
+
     /*********************************************************************/
     /* Generic methods for complementing fblocks, blocks and block_index */
     /*********************************************************************/
@@ -113,7 +124,8 @@ private:
     void TryAutoIndex(const cromfs_fblocknum_t fblocknum,
         const unsigned char* ptr,
         uint_fast32_t bsize,
-        uint_fast32_t startoffs);
+        uint_fast32_t startoffs,
+        const newhash_t crc);
 
     void AutoIndexBetween(const cromfs_fblocknum_t fblocknum,
         const unsigned char* ptr,
@@ -129,6 +141,10 @@ private:
 
     void SpecialAutoIndex(cromfs_fblocknum_t fblocknum);
 
+    /* Finds the content-defined anchors in new data in this fblock */
+    void AnchorIndex(const cromfs_fblocknum_t fblocknum,
+        uint_fast32_t new_raw_size);
+
     cromfs_blocknum_t CreateNewBlock(const cromfs_block_internal& block)
     {
         cromfs_blocknum_t blocknum = blocks.size();
@@ -226,6 +242,20 @@ public:
     typedef block_index_stack_simple<newhash_t, cromfs_block_internal> autoindex_t;
     autoindex_t autoindex;
 
+    /* For --chunking cdc: how far each fblock has been scanned
+     * for anchors, and where the last one was found. */
+    struct anchor_scan
+    {
+        uint_fast32_t scanned, last_anchor;
+        anchor_scan() : scanned(0), last_anchor(0) { }
+    };
+    std::map<cromfs_fblocknum_t, anchor_scan,
+             std::less<cromfs_fblocknum_t>,
+             FSBAllocator<int> > anchor_progress;
+
+    // The anchors, by the hash of the bytes that follow them
+    autoindex_t anchorindex;
+
 private:
     cromfs_blockifier(const cromfs_blockifier& );
     void operator=(const cromfs_blockifier& );
@@ -7,9 +7,10 @@
 /* Directory format:
 ****
 
-FILE CONTENT WHEN: DIRECTORY (size: 4 + (4+entrysize) * n)
+FILE CONTENT WHEN: DIRECTORY (size: 4 + (4+entrysize) * n [+ 4 + 8 * slots])
 	0000	u32	number of files in directory
 	0004	u32[]	index into each file entry (from directory entry beginning)
+	0004	INDEX	optional hash index, see below
 	0004	ENTRY[]	each file entry (variable length)
 	(Note: The files in a directory are sorted in an asciibetical order.
 	 This enables an implementation of lookup() using a binary search,
@@ -19,15 +20,28 @@ FILE CONTENT WHEN: DIRECTORY (size: 4 + (4+entrysize) * n)
 	(Note 2: Currently the algorithm in read_dir() assumes that the directory
 	 entry pointers are in numeric order. If that does not hold, it will fail.
 	)
+	(Note 3: The index exists if the first entry does not begin right after
+	 the entry pointers.
+	)
 
 STRUCT: ENTRY (size: 9 + n)
 	0000	u64	inode number
 	0008	char[]	file name, nul-terminated
 
+STRUCT: INDEX (size: 4 + 8 * slots)
+	0000	u32	number of slots, a power of two
+	0004	SLOT[]	open-addressed hash table with linear probing
+	(Note: The first slot to look in is hash & (slots-1).)
+
+STRUCT: SLOT (size: 8)
+	0000	u32	32-bit FNV-1a hash of the file name
+	0004	u32	index into the file entry, or 0 if the slot is empty
+
 ****/
 
 size_t
-    calc_encoded_directory_size(const cromfs_dirinfo& dir)
+    calc_encoded_directory_size(const cromfs_dirinfo& dir,
+                                unsigned index_min_entries)
 {
     /* This function could simply be replaced with:
      *   return encode_directory(dir).size()
@@ -41,13 +55,20 @@ size_t
         // 8 for inode number,
         // n+1 for the filename.
     }
+    if(index_min_entries && dir.size() >= index_min_entries)
+        result += 4 + 8 * directory_index_size(dir.size());
     return result;
 }
 
 const std::vector<unsigned char>
-    encode_directory(const cromfs_dirinfo& dir)
+    encode_directory(const cromfs_dirinfo& dir,
+                     unsigned index_min_entries)
 {
-    std::vector<unsigned char> result(4 + 4*dir.size()); // buffer for pointers
+    const bool has_index = index_min_entries && dir.size() >= index_min_entries;
+    const uint_fast32_t index_slots = has_index ? directory_index_size(dir.size()) : 0;
+    const unsigned index_size = has_index ? 4 + 8 * index_slots : 0;
+
+    std::vector<unsigned char> result(4 + 4*dir.size() + index_size); // buffer for pointers and index
     std::vector<unsigned char> entries;                  // buffer for names
     entries.reserve(dir.size() * (8 + 10)); // 10 = guestimate of average fn length
 
@@ -56,6 +77,9 @@ const std::vector<unsigned char>
     unsigned entrytableoffs = result.size();
     unsigned entryoffs = 0;
 
+    const unsigned indexoffs = 4 + 4*dir.size();
+    if(has_index) put_32(&result[indexoffs], index_slots);
+
     unsigned diroffset=0;
     for(cromfs_dirinfo::const_iterator i = dir.begin(); i != dir.end(); ++i)
     {
@@ -64,6 +88,16 @@ const std::vector<unsigned char>
 
         put_32(&result[4 + diroffset*4], entrytableoffs + entryoffs);
 
+        if(has_index)
+        {
+            const uint_fast32_t hash = directory_name_hash(name.data(), name.size());
+            uint_fast32_t slot = hash & (index_slots-1);
+            while(get_32(&result[indexoffs + 4 + slot*8 + 4]) != 0)
+                slot = (slot + 1) & (index_slots-1);
+            put_32(&result[indexoffs + 4 + slot*8 + 0], hash);
+            put_32(&result[indexoffs + 4 + slot*8 + 4], entrytableoffs + entryoffs);
+        }
+
         entries.resize(entryoffs + 8 + name.size() + 1);
 
         put_64(&entries[entryoffs], ino);
@@ -1,8 +1,33 @@
 #include "../cromfs-defs.hh"
 #include <vector>
 
+/* Directories with at least this many entries are given a hash index
+ * by encode_directory(). 0 = no directory gets one.
+ */
 size_t
-    calc_encoded_directory_size(const cromfs_dirinfo& dir);
+    calc_encoded_directory_size(const cromfs_dirinfo& dir,
+                                unsigned index_min_entries = 0);
 
 const std::vector<unsigned char>
-    encode_directory(const cromfs_dirinfo& dir);
+    encode_directory(const cromfs_dirinfo& dir,
+                     unsigned index_min_entries = 0);
+
+/* The hash of a file name in the directory hash index (32-bit FNV-1a) */
+static inline uint_fast32_t
+    directory_name_hash(const char* name, size_t length)
+{
+    uint_fast32_t hash = UINT32_C(2166136261);
+    for(size_t a=0; a<length; ++a)
+        hash = ((hash ^ (unsigned char)name[a]) * UINT32_C(16777619)) & UINT32_C(0xFFFFFFFF);
+    return hash;
+}
+
+/* The number of slots in the hash index of a directory
+ * with this many entries: a power of two, at most half full. */
+static inline uint_fast32_t
+    directory_index_size(size_t num_entries)
+{
+    uint_fast32_t result = 1;
+    while(result < num_entries * 2) result <<= 1;
+    return result;
+}
@@ -0,0 +1,116 @@
+#include "cromfs-fblockcodec.hh"
+
+extern "C" {
+#include "lzma/C/LzmaDec.h" /* For LZMA_PROPS_SIZE */
+}
+
+#include <cstring>
+
+#if HAS_ASM_LZO2
+# include <lzo/lzo1x.h>
+#else
+  /* Bring lzo1x_1_15_compress() and lzo1x_decompress_safe()
+   * to the scope of inline compilation.
+   * The decompressor copies overlapping matches four bytes at a time;
+   * when GCC vectorizes those loops, it breaks them (seen with -O3).
+   */
+# if defined(__GNUC__) && !defined(__clang__)
+#  pragma GCC optimize("no-tree-vectorize")
+# endif
+# define LZO_EXTERN(x) static x
+# define LZO_PUBLIC(x) static x
+# include "lzo/lzo1x_1o.c"
+# include "lzo/lzo1x_d2.c"
+#endif
+
+static const std::size_t LZOHeaderSize = 1 + 4;
+
+CromfsFblockCodec GetFblockCodec(const unsigned char* data, std::size_t length)
+{
+    if(length > 0)
+        switch(data[0])
+        {
+            case CROMFS_FBLOCK_LZO:    return CROMFS_FBLOCK_LZO;
+            case CROMFS_FBLOCK_STORED: return CROMFS_FBLOCK_STORED;
+        }
+    return CROMFS_FBLOCK_LZMA;
+}
+
+std::size_t GetFblockMinLength(CromfsFblockCodec codec)
+{
+    switch(codec)
+    {
+        case CROMFS_FBLOCK_LZO:    return LZOHeaderSize;
+        case CROMFS_FBLOCK_STORED: return 1;
+        case CROMFS_FBLOCK_LZMA:   break;
+    }
+    return LZMA_PROPS_SIZE+8+1;
+}
+
+uint_fast64_t GetFblockRawSize(const unsigned char* data, std::size_t length)
+{
+    switch(GetFblockCodec(data, length))
+    {
+        case CROMFS_FBLOCK_LZO:
+            if(length < LZOHeaderSize) break;
+            return get_32(data+1);
+        case CROMFS_FBLOCK_STORED:
+            return length - 1;
+        case CROMFS_FBLOCK_LZMA:
+            if(length <= LZMA_PROPS_SIZE+8) break;
+            return get_64(data+LZMA_PROPS_SIZE);
+    }
+    return ~(uint_fast64_t)0;
+}
+
+const std::vector<unsigned char> LZOCompressFblock
+    (const unsigned char* data, std::size_t length)
+{
+    /* The worst case of LZO1X, from the LZO documentation. */
+    std::vector<unsigned char> result(LZOHeaderSize + length + length/16 + 64 + 3);
+    std::vector<unsigned char> wrkmem(LZO1X_1_15_MEM_COMPRESS);
+
+    lzo_uint outlen = result.size() - LZOHeaderSize;
+    lzo1x_1_15_compress(data, length,
+                        &result[LZOHeaderSize], &outlen,
+                        &wrkmem[0]);
+
+    result[0] = CROMFS_FBLOCK_LZO;
+    put_32(&result[1], length);
+    result.resize(LZOHeaderSize + outlen);
+    return result;
+}
+
+const std::vector<unsigned char> StoreFblock
+    (const unsigned char* data, std::size_t length)
+{
+    std::vector<unsigned char> result(1 + length);
+    result[0] = CROMFS_FBLOCK_STORED;
+    if(length) std::memcpy(&result[1], data, length);
+    return result;
+}
+
+bool DecodeTaggedFblock(const unsigned char* data, std::size_t length,
+                        unsigned char* result)
+{
+    const uint_fast64_t size = GetFblockRawSize(data, length);
+    switch(GetFblockCodec(data, length))
+    {
+        case CROMFS_FBLOCK_LZO:
+        {
+            if(size == ~(uint_fast64_t)0) return false;
+            lzo_uint outlen = size;
+            int res = lzo1x_decompress_safe(
+                data + LZOHeaderSize, length - LZOHeaderSize,
+                result, &outlen,
+                0/*wrkmem*/);
+            return res == LZO_E_OK && outlen == size;
+        }
+        case CROMFS_FBLOCK_STORED:
+            if(size) std::memcpy(result, data+1, size);
+            return true;
+        case CROMFS_FBLOCK_LZMA:
+            break;
+    }
+    return false;
+}
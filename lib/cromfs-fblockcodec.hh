@@ -0,0 +1,82 @@
+#ifndef bqtCromfsFblockCodecHH
+#define bqtCromfsFblockCodecHH
+
+#include "endian.hh"
+
+#include <vector>
+#include <cstddef>
+
+/* An fblock is LZMA-compressed, unless its first byte is one of the
+ * tags below. An LZMA stream begins with its properties byte, which
+ * is never larger than 224, so the tags cannot be mistaken for one.
+ * See doc/FORMAT.
+ *
+ * The other codecs decode an order of magnitude faster than LZMA,
+ * at the expense of the compression ratio. mkcromfs chooses them
+ * for fblocks that are read often, or that LZMA does not shrink
+ * much more than they do.
+ */
+enum CromfsFblockCodec
+{
+    CROMFS_FBLOCK_LZMA   = 0x00, // Not a tag; an LZMA stream as such
+    CROMFS_FBLOCK_LZO    = 0xF0, // u32 length of uncompressed data, LZO1X data
+    CROMFS_FBLOCK_STORED = 0xF1  // The data as such
+};
+
+CromfsFblockCodec GetFblockCodec(const unsigned char* data, std::size_t length);
+
+/* Returns the length of the shortest fblock of the codec.
+ * A stored fblock may be as short as its tag.
+ */
+std::size_t GetFblockMinLength(CromfsFblockCodec codec);
+
+/* Returns the length of the uncompressed data, whatever the codec,
+ * or ~0 if the fblock is too short to tell.
+ */
+uint_fast64_t GetFblockRawSize(const unsigned char* data, std::size_t length);
+
+/* Compresses the data into a tagged fblock. */
+const std::vector<unsigned char> LZOCompressFblock
+    (const unsigned char* data, std::size_t length);
+const std::vector<unsigned char> StoreFblock
+    (const unsigned char* data, std::size_t length);
+
+/* Decodes a tagged fblock into result, which has room for
+ * GetFblockRawSize() bytes. Returns false if the fblock is corrupt
+ * or not tagged.
+ */
+bool DecodeTaggedFblock(const unsigned char* data, std::size_t length,
+                        unsigned char* result);
+
+#ifdef HHlzmaHH
+/* Decompresses an fblock of any codec. Only for the programs that
+ * are linked with lzma.o; cromfs-driver decodes fblocks in pieces.
+ */
+static inline const std::vector<unsigned char> FblockDeCompress
+    (const unsigned char* data, std::size_t length, bool& ok)
+{
+    if(GetFblockCodec(data, length) == CROMFS_FBLOCK_LZMA)
+        return LZMADeCompress(data, length, ok);
+
+    const uint_fast64_t size = GetFblockRawSize(data, length);
+    std::vector<unsigned char> result(size == ~(uint_fast64_t)0 ? 0 : size);
+    ok = size != ~(uint_fast64_t)0
+      && DecodeTaggedFblock(data, length, result.empty() ? 0 : &result[0]);
+    if(!ok) result.clear();
+    return result;
+}
+
+static inline const std::vector<unsigned char> FblockDeCompress
+    (const unsigned char* data, std::size_t length)
+    { bool ok_unused; return FblockDeCompress(data, length, ok_unused); }
+
+static inline const std::vector<unsigned char> FblockDeCompress
+    (const std::vector<unsigned char>& buf)
+    { return FblockDeCompress(&buf[0], buf.size()); }
+
+static inline const std::vector<unsigned char> FblockDeCompress
+    (const std::vector<unsigned char>& buf, bool& ok)
+    { return FblockDeCompress(&buf[0], buf.size(), ok); }
+#endif
+
+#endif
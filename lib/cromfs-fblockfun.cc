@@ -4,10 +4,14 @@
 #include "longfilewrite.hh"
 #include "longfileread.hh"
 #include "lzma.hh"
+#include "cromfs-fblockcodec.hh"
 
 #include <algorithm>
 #include <errno.h>
 #include <ctime>
+#ifdef _OPENMP
+# include <omp.h>
+#endif
 
 static const double FblockMaxAccessAgeBeforeDealloc = 10.0;
 
@@ -151,7 +155,9 @@ std::string mkcromfs_fblock::getfn() const
 
 mkcromfs_fblock::mkcromfs_fblock(int id)
     : lock(),
-      fblock_disk_id(id), filesize(0), mapped(), fd(-1), is_compressed(false)
+      fblock_disk_id(id), filesize(0), mapped(), fd(-1), is_compressed(false),
+      prefer_fast_codec(false),
+      sealed(false), precompressed(false), precompressed_fast(false)
 {
 }
 
@@ -165,6 +171,7 @@ void mkcromfs_fblock::Delete()
     Unmap();
     Close();
     unlink(getfn().c_str());
+    if(sealed) unlink(getfn_precompressed().c_str());
 }
 
 void mkcromfs_fblock::EnsureMMapped(bool decompressed) const
@@ -255,7 +262,7 @@ void mkcromfs_fblock::
         {
             DataReadBuffer rdbuf;
             rdbuf.AssignRefFrom(mapped.get_ptr(), filesize);
-            std::vector<unsigned char> decompressed = LZMADeCompress(rdbuf.Buffer, filesize);
+            std::vector<unsigned char> decompressed = FblockDeCompress(rdbuf.Buffer, filesize);
 
             uint_fast32_t extent = decompressed.size();
             if(req_offset > extent) req_offset = extent;
@@ -272,7 +279,7 @@ void mkcromfs_fblock::
         {
             EnsureOpen();
             LongFileRead rdr(fd, 0, filesize);
-            std::vector<unsigned char> decompressed = LZMADeCompress(rdr.GetAddr(), filesize);
+            std::vector<unsigned char> decompressed = FblockDeCompress(rdr.GetAddr(), filesize);
 
             uint_fast32_t extent = decompressed.size();
             if(req_offset > extent) req_offset = extent;
@@ -356,7 +363,7 @@ void mkcromfs_fblock::Decompress()
         {
             DataReadBuffer rdbuf;
             rdbuf.AssignRefFrom(mapped.get_ptr(), filesize);
-            std::vector<unsigned char> decompressed = LZMADeCompress(rdbuf.Buffer, filesize);
+            std::vector<unsigned char> decompressed = FblockDeCompress(rdbuf.Buffer, filesize);
             Unmap();
             SetFileContent(&decompressed[0], decompressed.size());
         }
@@ -364,7 +371,7 @@ void mkcromfs_fblock::Decompress()
         {
             EnsureOpen();
             LongFileRead rdr(fd, 0, filesize);
-            std::vector<unsigned char> decompressed = LZMADeCompress(rdr.GetAddr(), filesize);
+            std::vector<unsigned char> decompressed = FblockDeCompress(rdr.GetAddr(), filesize);
             SetFileContent(&decompressed[0], decompressed.size());
         }
         is_compressed = false;
@@ -404,6 +411,94 @@ void mkcromfs_fblock::Compress()
     }
 }
 
+/* The number of sealed fblocks still waiting to be compressed.
+ * Each of them holds a copy of its raw data. */
+static unsigned n_sealed_pending = 0;
+
+void mkcromfs_fblock::Seal()
+{
+    if(sealed) return;
+    sealed = true;
+
+    std::vector<unsigned char>* raw;
+    { ScopedLock lck(lock);
+      DataReadBuffer buf; uint_fast32_t size;
+      InitDataReadBuffer(buf, size);
+      raw = new std::vector<unsigned char>(buf.Buffer, buf.Buffer + size); }
+
+    mkcromfs_fblock* const self = this;
+    const bool fast = prefer_fast_codec;
+
+    /* Beyond a couple of fblocks per thread, the caller
+     * compresses the fblock itself, rather than queue it. */
+    bool defer = false;
+#ifdef _OPENMP
+    #pragma omp flush(n_sealed_pending)
+    defer = n_sealed_pending < 2 * (unsigned)omp_get_num_threads();
+#endif
+  #pragma omp atomic
+    ++n_sealed_pending;
+
+  #pragma omp task firstprivate(raw,self,fast) if(defer)
+  {
+    char why[64]; std::sprintf(why, "fblock %d", self->fblock_disk_id);
+    const std::vector<unsigned char> compressed =
+        CompressFblockData(fast, &(*raw)[0], raw->size(), why);
+    delete raw;
+
+    try
+    {
+        const std::string fn = self->getfn_precompressed();
+        int fd = open(fn.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+        if(fd < 0) throw errno;
+        ( LongFileWrite(fd, 0, compressed.size(), &compressed[0], false) );
+        close(fd);
+
+        ScopedLock lck(self->lock);
+        self->precompressed      = true;
+        self->precompressed_fast = fast;
+    }
+    catch(int)
+    {
+        // Leave it to be compressed in the final phase.
+    }
+  #pragma omp atomic
+    --n_sealed_pending;
+  }
+}
+
+const std::vector<unsigned char> mkcromfs_fblock::get_precompressed()
+{
+    std::vector<unsigned char> result;
+
+    ScopedLock lck(lock);
+    if(!precompressed) return result;
+    precompressed = false;
+
+    const std::string fn = getfn_precompressed();
+    if(precompressed_fast == prefer_fast_codec)
+    {
+        int fd = open(fn.c_str(), O_RDONLY | O_LARGEFILE);
+        if(fd >= 0)
+        {
+            try
+            {
+                const off64_t size = lseek64(fd, 0, SEEK_END);
+                if(size <= 0) throw EIO;
+                result.resize(size);
+                ( LongFileRead(fd, 0, result.size(), &result[0]) );
+            }
+            catch(int)
+            {
+                result.clear();
+            }
+            close(fd);
+        }
+    }
+    unlink(fn.c_str());
+    return result;
+}
+
 void mkcromfs_fblock::Unmap()
 {
     mapped.Unmap();
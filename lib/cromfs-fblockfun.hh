@@ -59,9 +59,28 @@ public:
     uint_fast32_t getfilesize() const { return filesize; }
     bool          is_uncompressed() const { return !is_compressed; }
 
+    /* Asks for the fblock to be compressed finally with a codec
+     * that decodes fast, instead of LZMA (see --fastfiles). */
+    void PreferFastCodec() { prefer_fast_codec = true; }
+    bool prefers_fast_codec() const { return prefer_fast_codec; }
+
+    /* Tells that the fblock will not be appended to anymore. Its final
+     * compression begins right away, in a background task if there are
+     * threads for it. The result is kept in a file of its own, so that
+     * the raw data can still be read for block reuse meanwhile. */
+    void Seal();
+    bool is_sealed() const { return sealed; }
+
+    /* Returns the compressed data made after Seal(), or an empty
+     * vector if there is none, or if it was made for another codec
+     * than what is now preferred. Either way, it is forgotten. */
+    const std::vector<unsigned char> get_precompressed();
+
     std::string getfn() const;
 
 private:
+    std::string getfn_precompressed() const { return getfn() + ".final"; }
+
     void Decompress() const
         { (const_cast<mkcromfs_fblock*> (this))->Decompress(); }
     void Decompress();
@@ -84,6 +103,10 @@ private:
     MemMappingType<true> mapped;
     int                  fd;
     bool                 is_compressed;
+    bool                 prefer_fast_codec;
+    bool                 sealed;
+    bool                 precompressed;      // getfn_precompressed() is ready
+    bool                 precompressed_fast; // ...and made with the fast codec
 };
 
 /* This is the actual front end for fblocks in mkcromfs.
@@ -103,6 +126,9 @@ public:
     int FindFblockThatHasAtleastNbytesSpace(size_t howmuch) const;
     void UpdateFreeSpaceIndex(cromfs_fblocknum_t fnum, size_t howmuch);
 
+    /* True if the fblock has less than MinimumFreeSpace bytes of room. */
+    bool IsFull(cromfs_fblocknum_t fnum) const { return fblocks[fnum].space == 0; }
+
     void FreeSomeResources();
 
 protected:
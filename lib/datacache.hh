@@ -1,128 +1,368 @@
-#include <ctime>
-#include <map>
+#ifndef bqtDataCacheHH
+#define bqtDataCacheHH
+
 #include <vector>
-#include <algorithm>
+#include <utility>
+#include <cstddef>
 
 #include "threadfun.hh"
 
+/* How much an entry in a DataCache costs, in bytes.
+ * Specialize this for value types whose size is not
+ * just sizeof(ValueType).
+ */
+template<typename ValueType>
+struct DataCacheCost
+{
+    static size_t Get(const ValueType&) { return sizeof(ValueType); }
+};
+
+template<typename T>
+struct DataCacheCost< std::vector<T> >
+{
+    static size_t Get(const std::vector<T>& v)
+        { return sizeof(v) + v.size() * sizeof(T); }
+};
+
+/* A least-recently-used cache with a capacity expressed in bytes.
+ *
+ * Entries are kept in an intrusive doubly linked list in the order
+ * of their last use, and are found through an intrusive hash table.
+ * Lookup, insertion and eviction are all O(1).
+ *
+ * The cache is split in shards by the hash of the key. Each shard
+ * has its own lock, list and hash table, so that threads accessing
+ * different keys rarely contend for the same lock. The byte budget
+ * is shared by all shards: when an insertion pushes the total over
+ * the budget, entries are evicted from the least recently used end
+ * of the inserting shard first, then from the other shards.
+ *
+ * KeyType must be an integer type.
+ */
 template<
     typename KeyType,
     typename ValueType>
 class DataCache
 {
 public:
-    DataCache() : writelock(),data(), max_size(5), max_age(0) { }
-    DataCache(size_t ms, unsigned ma)
-        : writelock(),data(), max_size(ms), max_age(ma) { }
-    ~DataCache() { }
+    /* The entries evicted by Put() or UpdateCost(), for callers
+     * that want to do something with them (see Put()). */
+    typedef std::vector< std::pair<KeyType, ValueType> > EvictedList;
 
-private:
-    typedef typename std::map<KeyType, std::pair<time_t, ValueType> >::iterator it;
-    typedef typename std::map<KeyType, std::pair<time_t, ValueType> >::const_iterator cit;
-public:
-    void clear() { ScopedLock lck(writelock); data.clear(); }
-    size_t num_entries() const { return data.size(); }
-
-    void CheckAges(long count_offset)
+    explicit DataCache(size_t max_bytes, unsigned num_shards = 8)
+        : shards(num_shards ? num_shards : 1), max_bytes(max_bytes),
+          total_entries(0), total_bytes(0)
     {
-        ScopedLock lck(writelock);
-
-        std::vector<it> age_order;
-        time_t nowtime = time(0);
-        for(it j,i = data.begin(); i != data.end(); i=j)
+        for(size_t s=0; s<shards.size(); ++s)
         {
-            j = i; ++j;
-            if(max_age && std::difftime(nowtime, i->first) >= max_age)
-                data.erase(i);
-            else if(max_size)
-                age_order.push_back(i);
+            shards[s].total_entries = &total_entries;
+            shards[s].total_bytes   = &total_bytes;
         }
+    }
+    ~DataCache() { clear(); }
 
-        const long effective_max_size = (long)max_size + count_offset;
+    void SetMaxBytes(size_t mb) { max_bytes = mb; }
+    size_t GetMaxBytes() const { return max_bytes; }
 
-        if(effective_max_size && (long)data.size() > effective_max_size)
+    void clear()
+    {
+        for(size_t s=0; s<shards.size(); ++s)
         {
-            std::sort(age_order.begin(), age_order.end(), CompareAges);
-            const long num_kill = age_order.size() - effective_max_size;
-            for(long a=0; a<num_kill; ++a)
-                data.erase(age_order[a]);
+            Shard& shard = shards[s];
+            ScopedLock lck(shard.lock);
+            while(shard.lru) shard.Remove(shard.lru);
         }
     }
 
-    class iterator
+    /* The totals of all shards. They are kept in atomic counters,
+     * so they can be read without locking the shards. */
+    size_t num_entries() const { return __sync_fetch_and_add(&total_entries, 0); }
+    size_t num_bytes()   const { return __sync_fetch_and_add(&total_bytes, 0); }
+
+    /* Looks up the key and, if found, calls func(value) while
+     * its shard is still locked. The value may be evicted by
+     * another thread as soon as this function returns, so the
+     * functor must not retain pointers into it.
+     * Returns false if the key was not in the cache.
+     */
+    template<typename Func>
+    bool Access(const KeyType key, Func& func)
     {
-        typename std::map<KeyType, std::pair<time_t, ValueType> >::iterator rep;
-    public:
-        iterator() : rep() { }
-        iterator(const typename std::map<KeyType, std::pair<time_t, ValueType> >::iterator& i)
-            : rep(i) { }
+        const size_t hash = Hash(key);
+        Shard& shard = GetShard(hash);
+        ScopedLock lck(shard.lock);
 
-        const KeyType& GetKey() const { return rep->first; }
-        const ValueType& GetValue() const { return rep->second.second; }
-        ValueType& GetValue() { return rep->second.second; }
+        Entry* e = shard.Find(key, hash);
+        if(!e) return false;
+        shard.Touch(e);
+        func(e->value);
+        return true;
+    }
 
-        bool operator==(const iterator& b) const { return rep==b.rep; }
-        bool operator!=(const iterator& b) const { return rep!=b.rep; }
-        iterator& operator++ () { ++rep; return *this; }
-    };
+    /* Copies the value out of the cache, if it's there. */
+    bool Get(const KeyType key, ValueType& result)
+    {
+        const size_t hash = Hash(key);
+        Shard& shard = GetShard(hash);
+        ScopedLock lck(shard.lock);
+
+        Entry* e = shard.Find(key, hash);
+        if(!e) return false;
+        shard.Touch(e);
+        result = e->value;
+        return true;
+    }
 
-    class const_iterator
+    bool Has(const KeyType key)
     {
-        typename std::map<KeyType, std::pair<time_t, ValueType> >::const_iterator rep;
-    public:
-        const_iterator() : rep() { }
-        const_iterator(
-            const typename std::map<KeyType, std::pair<time_t, ValueType> >::const_iterator& i)
-            : rep(i) { }
+        const size_t hash = Hash(key);
+        Shard& shard = GetShard(hash);
+        ScopedLock lck(shard.lock);
 
-        const KeyType& GetKey() const { return rep->first; }
-        const ValueType& GetValue() const { return rep->second.second; }
+        return shard.Find(key, hash) != 0;
+    }
 
-        bool operator==(const const_iterator& b) const { return rep==b.rep; }
-        bool operator!=(const const_iterator& b) const { return rep!=b.rep; }
-        const_iterator& operator++ () { ++rep; return *this; }
-    };
+    /* Inserts or replaces the value, making it the most recently used
+     * entry, and evicts old entries if the cache is now over budget.
+     * The newly inserted entry is never evicted here, even if it alone
+     * is larger than the budget.
+     * If evicted is given, the evicted entries are appended to it.
+     */
+    void Put(const KeyType key, const ValueType& value, EvictedList* evicted = 0)
+    {
+        PutEntry(new Entry(key, value, DataCacheCost<ValueType>::Get(value), Hash(key)),
+                 evicted);
+    }
 
-    //iterator begin() { return data.begin(); }
-    //iterator end() { return data.end(); }
-    const_iterator begin() const { return data.begin(); }
-    const_iterator end()   const { return data.end(); }
+    /* Like Put(), but moves the value into the cache instead of
+     * copying it, by swapping it with an empty one. For values that
+     * are expensive to copy; ValueType must have a swap() method.
+     * The value is left empty.
+     */
+    void PutSwap(const KeyType key, ValueType& value, EvictedList* evicted = 0)
+    {
+        Entry* e = new Entry(key, ValueType(), 0, Hash(key));
+        e->value.swap(value);
+        e->cost = DataCacheCost<ValueType>::Get(e->value);
+        PutEntry(e, evicted);
+    }
 
-    ValueType* Find(const KeyType key)
+    /* Recomputes the cost of the entry, for values that grow
+     * after they have been put in the cache, and evicts other
+     * entries if the cache is now over budget.
+     */
+    void UpdateCost(const KeyType key, EvictedList* evicted = 0)
     {
-        it i = data.find(key);
-        if(i != data.end())
+        const size_t hash = Hash(key);
+        Shard& shard = GetShard(hash);
         {
-            i->second.first = std::time(0);
-            return &i->second.second;
+            ScopedLock lck(shard.lock);
+
+            Entry* e = shard.Find(key, hash);
+            if(!e) return;
+            shard.Recost(e, DataCacheCost<ValueType>::Get(e->value));
+
+            while(num_bytes() > max_bytes && shard.lru != e)
+                Evict(shard, evicted);
         }
-        return 0;
+        TrimOthers(shard, evicted);
     }
 
-    bool Has(const KeyType key) const
+    void Erase(const KeyType key)
     {
-        cit i = data.find(key);
-        return i != data.end();
+        const size_t hash = Hash(key);
+        Shard& shard = GetShard(hash);
+        ScopedLock lck(shard.lock);
+
+        Entry* e = shard.Find(key, hash);
+        if(e) shard.Remove(e);
     }
 
-    ValueType& Put(const KeyType key, const ValueType& value)
+    /* Removes the entries whose keys satisfy pred(key). */
+    template<typename Pred>
+    void EraseIf(Pred pred)
     {
-        ScopedLock lck(writelock);
-
-        std::pair<time_t, ValueType>& val = data[key];
-        val.first  = std::time(0);
-        return val.second = value;
+        for(size_t s=0; s<shards.size(); ++s)
+        {
+            Shard& shard = shards[s];
+            ScopedLock lck(shard.lock);
+            for(Entry* e = shard.mru, *next; e; e = next)
+            {
+                next = e->lru_next;
+                if(pred(e->key)) shard.Remove(e);
+            }
+        }
     }
 
 private:
-    static bool CompareAges(const it& a, const it& b)
+    struct Entry
+    {
+        KeyType   key;
+        ValueType value;
+        size_t    cost;
+        size_t    hash;
+        Entry* lru_prev; // towards the most recently used
+        Entry* lru_next; // towards the least recently used
+        Entry* hash_next;
+
+        Entry(KeyType k, const ValueType& v, size_t c, size_t h)
+            : key(k), value(v), cost(c), hash(h), lru_prev(0), lru_next(0), hash_next(0) { }
+    private:
+        Entry(const Entry&);
+        void operator=(const Entry&);
+    };
+
+    struct Shard
+    {
+        mutable MutexType lock;
+        std::vector<Entry*> buckets; // size is always a power of two
+        Entry* mru;
+        Entry* lru;
+        size_t num_entries;
+        volatile size_t* total_entries; // Of the whole cache
+        volatile size_t* total_bytes;
+
+        Shard() : lock(), buckets(16), mru(0), lru(0), num_entries(0),
+                  total_entries(0), total_bytes(0) { }
+        Shard(const Shard&) : lock(), buckets(16), mru(0), lru(0), num_entries(0),
+                  total_entries(0), total_bytes(0) { }
+
+        Entry* Find(const KeyType key, size_t hash) const
+        {
+            for(Entry* e = buckets[hash & (buckets.size()-1)]; e; e = e->hash_next)
+                if(e->key == key) return e;
+            return 0;
+        }
+
+        void Touch(Entry* e)
+        {
+            if(e == mru) return;
+            Unlink(e);
+            PushFront(e);
+        }
+
+        void Insert(Entry* e)
+        {
+            if(num_entries >= buckets.size()) Rehash(buckets.size() * 2);
+
+            Entry*& bucket = buckets[e->hash & (buckets.size()-1)];
+            e->hash_next = bucket;
+            bucket = e;
+            PushFront(e);
+
+            ++num_entries;
+            __sync_fetch_and_add(total_entries, 1);
+            __sync_fetch_and_add(total_bytes, e->cost);
+        }
+
+        void Recost(Entry* e, size_t cost)
+        {
+            __sync_fetch_and_add(total_bytes, cost - e->cost);
+            e->cost = cost;
+        }
+
+        void Remove(Entry* e)
+        {
+            Entry** p = &buckets[e->hash & (buckets.size()-1)];
+            while(*p != e) p = &(*p)->hash_next;
+            *p = e->hash_next;
+            Unlink(e);
+
+            --num_entries;
+            __sync_fetch_and_sub(total_entries, 1);
+            __sync_fetch_and_sub(total_bytes, e->cost);
+            delete e;
+        }
+
+    private:
+        void PushFront(Entry* e)
+        {
+            e->lru_prev = 0;
+            e->lru_next = mru;
+            if(mru) mru->lru_prev = e; else lru = e;
+            mru = e;
+        }
+        void Unlink(Entry* e)
+        {
+            if(e->lru_prev) e->lru_prev->lru_next = e->lru_next; else mru = e->lru_next;
+            if(e->lru_next) e->lru_next->lru_prev = e->lru_prev; else lru = e->lru_prev;
+        }
+        void Rehash(size_t new_size)
+        {
+            std::vector<Entry*> new_buckets(new_size);
+            for(size_t b=0; b<buckets.size(); ++b)
+                for(Entry* e = buckets[b], *next; e; e = next)
+                {
+                    next = e->hash_next;
+                    Entry*& bucket = new_buckets[e->hash & (new_size-1)];
+                    e->hash_next = bucket;
+                    bucket = e;
+                }
+            buckets.swap(new_buckets);
+        }
+        void operator=(const Shard&);
+    };
+
+    static size_t Hash(KeyType key)
+    {
+        /* Fibonacci hashing; the low bits pick the bucket,
+         * the high bits pick the shard. */
+        const unsigned long long h = (unsigned long long)key * 0x9E3779B97F4A7C15ULL;
+        return (size_t)(h ^ (h >> 32));
+    }
+    Shard& GetShard(size_t hash)
+    {
+        return shards[(hash >> 24) % shards.size()];
+    }
+    /* Inserts the new entry in place of any old one with the same key,
+     * and evicts old entries if the cache is now over budget. */
+    void PutEntry(Entry* e, EvictedList* evicted)
+    {
+        Shard& shard = GetShard(e->hash);
+        {
+            ScopedLock lck(shard.lock);
+
+            Entry* old = shard.Find(e->key, e->hash);
+            if(old) shard.Remove(old);
+
+            shard.Insert(e);
+
+            while(num_bytes() > max_bytes && shard.lru != e)
+                Evict(shard, evicted);
+        }
+        TrimOthers(shard, evicted);
+    }
+    /* Evicts the least recently used entry of the shard,
+     * whose lock must be held. */
+    static void Evict(Shard& shard, EvictedList* evicted)
+    {
+        if(evicted)
+            evicted->push_back(std::make_pair(shard.lru->key, shard.lru->value));
+        shard.Remove(shard.lru);
+    }
+    /* Evicts from the shards other than the given one
+     * until the cache is within budget. */
+    void TrimOthers(Shard& shard, EvictedList* evicted)
     {
-        return a->second.first < b->second.first;
+        for(size_t s=0; s<shards.size() && num_bytes() > max_bytes; ++s)
+        {
+            Shard& other = shards[s];
+            if(&other == &shard) continue;
+            ScopedLock lck(other.lock);
+            while(other.lru && num_bytes() > max_bytes)
+                Evict(other, evicted);
+        }
     }
 
 private:
-    MutexType writelock;
-    std::map<KeyType, std::pair<time_t, ValueType> > data;
-    size_t max_size;
-    int max_age;
+    std::vector<Shard> shards;
+    size_t max_bytes;
+    mutable volatile size_t total_entries;
+    mutable volatile size_t total_bytes;
+
+private:
+    DataCache(const DataCache&);
+    void operator=(const DataCache&);
 };
+
+#endif
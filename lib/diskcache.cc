@@ -0,0 +1,246 @@
+#define _LARGEFILE64_SOURCE
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <cerrno>
+#include <cstring>
+
+#include "diskcache.hh"
+#include "newhash.h"
+#include "fadvise.hh"
+
+/* The layout of the file:
+ *   0x0000  "CRDCACHE"
+ *   0x0008  u32 version
+ *   0x000C  u32 slot size
+ *   0x0010  u32 number of slots
+ *   0x0014  u32 length of the identity
+ *   0x0018  the identity
+ *   0x1000  the index: for each slot, u64 key+1 (0 = empty),
+ *           u32 length and u32 checksum (newhash) of the data
+ *   then the slots, each beginning at a multiple of the page size.
+ */
+static const char Magic[8] = {'C','R','D','C','A','C','H','E'};
+static const uint_fast32_t Version      = 1;
+static const uint_fast32_t PageSize     = 4096;
+static const uint_fast32_t HeaderSize   = PageSize;
+static const uint_fast32_t IndexEntrySize = 16;
+static const uint_fast32_t MaxIdentity  = HeaderSize - 0x18;
+
+static uint_fast64_t RoundUp(uint_fast64_t value)
+{
+    return (value + PageSize-1) & ~(uint_fast64_t)(PageSize-1);
+}
+
+static bool ReadAll(int fd, unsigned char* target, size_t length, uint_fast64_t pos)
+{
+    while(length > 0)
+    {
+        ssize_t r = pread64(fd, target, length, pos);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) return false;
+        target += r; length -= r; pos += r;
+    }
+    return true;
+}
+
+static bool WriteAll(int fd, const unsigned char* data, size_t length, uint_fast64_t pos)
+{
+    while(length > 0)
+    {
+        ssize_t r = pwrite64(fd, data, length, pos);
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) return false;
+        data += r; length -= r; pos += r;
+    }
+    return true;
+}
+
+DiskCache::DiskCache()
+    : fd(-1), slot_size(0), data_offs(0), index()
+{
+}
+
+DiskCache::~DiskCache()
+{
+    Close();
+}
+
+void DiskCache::Close()
+{
+    if(fd >= 0) close(fd); // Also releases the flock
+    fd = -1;
+    index.clear();
+}
+
+bool DiskCache::Open(const std::string& filename,
+                     uint_fast64_t max_bytes,
+                     uint_fast32_t size,
+                     const std::vector<unsigned char>& identity)
+{
+    Close();
+    if(size == 0 || identity.size() > MaxIdentity) return false;
+
+    size = RoundUp(size);
+    uint_fast64_t count = max_bytes > HeaderSize
+                        ? (max_bytes - HeaderSize) / (size + IndexEntrySize) : 0;
+    if(count > 0xFFFFFFFFUL) count = 0xFFFFFFFFUL;
+    if(count == 0) return false;
+
+    fd = open(filename.c_str(), O_RDWR | O_CREAT | O_LARGEFILE, 0600);
+    if(fd < 0) return false;
+    if(flock(fd, LOCK_EX | LOCK_NB) < 0)
+    {
+        /* Some other process is using it. */
+        Close();
+        return false;
+    }
+
+    unsigned char header[HeaderSize] = { 0 };
+    bool ok = ReadAll(fd, header, HeaderSize, 0)
+           && LoadIndex(header, size, count, identity);
+    if(!ok) ok = Initialize(size, count, identity);
+    if(!ok)
+    {
+        Close();
+        return false;
+    }
+
+    FadviseRandom(fd, 0, 0);
+    return true;
+}
+
+bool DiskCache::LoadIndex(const unsigned char* header,
+                          uint_fast32_t size, uint_fast32_t count,
+                          const std::vector<unsigned char>& identity)
+{
+    if(std::memcmp(header, Magic, sizeof(Magic)) != 0
+    || get_32(header+0x08) != Version
+    || get_32(header+0x0C) != size
+    || get_32(header+0x10) != count
+    || get_32(header+0x14) != identity.size()
+    || (!identity.empty()
+        && std::memcmp(header+0x18, &identity[0], identity.size()) != 0))
+    {
+        return false;
+    }
+
+    slot_size = size;
+    data_offs = HeaderSize + RoundUp((uint_fast64_t)count * IndexEntrySize);
+
+    std::vector<unsigned char> buf((size_t)count * IndexEntrySize);
+    if(!ReadAll(fd, &buf[0], buf.size(), HeaderSize)) return false;
+
+    index.resize(count);
+    for(uint_fast32_t a=0; a<count; ++a)
+    {
+        const unsigned char* p = &buf[(size_t)a * IndexEntrySize];
+        index[a].key      = get_64(p);
+        index[a].length   = get_32(p+8);
+        index[a].checksum = get_32(p+12);
+        if(index[a].length == 0 || index[a].length > slot_size)
+            index[a].key = 0;
+    }
+    return true;
+}
+
+bool DiskCache::Initialize(uint_fast32_t size, uint_fast32_t count,
+                           const std::vector<unsigned char>& identity)
+{
+    slot_size = size;
+    data_offs = HeaderSize + RoundUp((uint_fast64_t)count * IndexEntrySize);
+
+    /* Truncating the file first empties the index and frees the old
+     * slots. The header is written last, so that the file is not
+     * recognized if this is interrupted. */
+    if(ftruncate64(fd, 0) < 0
+    || ftruncate64(fd, data_offs + (uint_fast64_t)count * slot_size) < 0)
+        return false;
+
+    unsigned char header[HeaderSize] = { 0 };
+    std::memcpy(header, Magic, sizeof(Magic));
+    put_32(header+0x08, Version);
+    put_32(header+0x0C, slot_size);
+    put_32(header+0x10, count);
+    put_32(header+0x14, identity.size());
+    if(!identity.empty())
+        std::memcpy(header+0x18, &identity[0], identity.size());
+    if(!WriteAll(fd, header, HeaderSize, 0)) return false;
+
+    Slot empty = { 0, 0, 0 };
+    index.assign(count, empty);
+    return true;
+}
+
+/* Must be called with the lock of the slot held. */
+bool DiskCache::WriteSlot(uint_fast32_t slotno)
+{
+    unsigned char buf[IndexEntrySize];
+    put_64(buf,    index[slotno].key);
+    put_32(buf+8,  index[slotno].length);
+    put_32(buf+12, index[slotno].checksum);
+    return WriteAll(fd, buf, IndexEntrySize, HeaderSize + (uint_fast64_t)slotno * IndexEntrySize);
+}
+
+uint_fast32_t DiskCache::Find(uint_fast64_t key) const
+{
+    if(index.empty()) return 0;
+    const uint_fast32_t slotno = SlotFor(key);
+    ScopedLock lck(slot_locks[slotno % SLOT_LOCK_COUNT]);
+    const Slot& slot = index[slotno];
+    return slot.key == key+1 ? slot.length : 0;
+}
+
+bool DiskCache::Read(uint_fast64_t key, unsigned char* target, uint_fast32_t length)
+{
+    if(index.empty()) return false;
+    const uint_fast32_t slotno = SlotFor(key);
+    ScopedLock lck(slot_locks[slotno % SLOT_LOCK_COUNT]);
+    Slot& slot = index[slotno];
+    if(slot.key != key+1 || slot.length != length) return false;
+
+    if(!ReadAll(fd, target, length, DataPos(slotno))) return false;
+    if(newhash_calc(target, length) != slot.checksum)
+    {
+        /* Torn by a crash, or the file was tampered with. */
+        slot.key = 0;
+        WriteSlot(slotno);
+        return false;
+    }
+    return true;
+}
+
+void DiskCache::Put(uint_fast64_t key, const unsigned char* data, uint_fast32_t length)
+{
+    if(index.empty() || length == 0 || length > slot_size) return;
+    const uint_fast32_t slotno = SlotFor(key);
+    const uint_fast32_t checksum = newhash_calc(data, length);
+
+    ScopedLock lck(slot_locks[slotno % SLOT_LOCK_COUNT]);
+    Slot& slot = index[slotno];
+    if(slot.key == key+1 && slot.length == length && slot.checksum == checksum)
+        return; // Already there
+
+    /* The slot is marked empty while the data is being written,
+     * so that a crash meanwhile cannot leave a stale index entry. */
+    slot.key = 0;
+    if(!WriteSlot(slotno)
+    || !WriteAll(fd, data, length, DataPos(slotno)))
+        return;
+
+    slot.key      = key+1;
+    slot.length   = length;
+    slot.checksum = checksum;
+    if(!WriteSlot(slotno)) slot.key = 0;
+}
+
+uint_fast32_t DiskCache::num_used() const
+{
+    uint_fast32_t result = 0;
+    for(size_t a=0; a<index.size(); ++a)
+    {
+        ScopedLock lck(slot_locks[a % SLOT_LOCK_COUNT]);
+        if(index[a].key) ++result;
+    }
+    return result;
+}
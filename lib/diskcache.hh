@@ -0,0 +1,96 @@
+#ifndef bqtDiskCacheHH
+#define bqtDiskCacheHH
+
+#include "endian.hh"
+#include "threadfun.hh"
+
+#include <vector>
+#include <string>
+
+/* A cache of fixed-size slots in a file, meant to hold data that
+ * is expensive to recreate (such as decompressed fblocks) across
+ * restarts of the program.
+ *
+ * The file begins with a header that identifies what the cache is
+ * for (an arbitrary string of bytes given to Open()). If it does not
+ * match, the cache is emptied. The header is followed by an index,
+ * which has for each slot the key, the length and a checksum of the
+ * data stored in it, and then the slots.
+ *
+ * The cache is direct-mapped: each key has exactly one slot, and
+ * a Put() replaces whatever was in it. The data is never synced to
+ * the disk. If the program dies in the middle of a Put(), the data
+ * in the slot does not match its checksum, and Read() rejects it.
+ *
+ * The file is locked with flock(), so that two programs never
+ * use the same cache file at the same time.
+ *
+ * All methods may be called from several threads at once.
+ */
+class DiskCache
+{
+public:
+    DiskCache();
+    ~DiskCache();
+
+    /* Opens the cache file, creating it if needed. It will have room
+     * for as many slots of slot_size bytes as fit in max_bytes.
+     * Returns false if the cache cannot be used, in which case
+     * Find() never finds anything and Put() does nothing.
+     */
+    bool Open(const std::string& filename,
+              uint_fast64_t max_bytes,
+              uint_fast32_t slot_size,
+              const std::vector<unsigned char>& identity);
+    void Close();
+
+    bool IsOpen() const { return fd >= 0; }
+
+    /* Returns the length of the data stored for the key, 0 if none. */
+    uint_fast32_t Find(uint_fast64_t key) const;
+
+    /* Reads the data stored for the key into target, if it is still
+     * there, its length is the given one, and it matches its checksum.
+     */
+    bool Read(uint_fast64_t key, unsigned char* target, uint_fast32_t length);
+
+    /* Stores the data for the key. Does nothing if the data
+     * is longer than a slot. */
+    void Put(uint_fast64_t key, const unsigned char* data, uint_fast32_t length);
+
+    uint_fast32_t num_slots() const { return index.size(); }
+    uint_fast32_t num_used() const;
+
+private:
+    struct Slot
+    {
+        uint_fast64_t key;     // key+1, 0 = empty
+        uint_fast32_t length;
+        uint_fast32_t checksum;
+    };
+    enum { SLOT_LOCK_COUNT = 16 };
+
+    bool Initialize(uint_fast32_t slot_size, uint_fast32_t slot_count,
+                    const std::vector<unsigned char>& identity);
+    bool LoadIndex(const unsigned char* header,
+                   uint_fast32_t slot_size, uint_fast32_t slot_count,
+                   const std::vector<unsigned char>& identity);
+    bool WriteSlot(uint_fast32_t slotno);
+
+    uint_fast32_t SlotFor(uint_fast64_t key) const { return key % index.size(); }
+    uint_fast64_t DataPos(uint_fast32_t slotno) const
+        { return data_offs + (uint_fast64_t)slotno * slot_size; }
+
+private:
+    int fd;
+    uint_fast32_t slot_size;
+    uint_fast64_t data_offs;
+    std::vector<Slot> index;
+    mutable MutexType slot_locks[SLOT_LOCK_COUNT];
+
+private:
+    DiskCache(const DiskCache&);
+    void operator=(const DiskCache&);
+};
+
+#endif
@@ -320,3 +320,193 @@ newhash_t newhash_calc_upd(newhash_t c, const unsigned char* buf, unsigned long
     return c;
 #endif
 }
+
+/* The 64-bit fingerprint. It is the algorithm of the 64-bit platforms,
+ * in plain 64-bit arithmetic, so that it is the same everywhere. On the
+ * 64-bit platforms, its lowest 32 bits are what newhash_calc() gives.
+ */
+struct newhash_lane
+{
+    uint_least64_t a,b,c;
+    const unsigned char* buf;
+    unsigned long len;
+
+    void begin(uint_least64_t init, const unsigned char* data, unsigned long size)
+    {
+        a = UINT64_C(0x9e3779b97f4a7c13) + init + size;
+        b = c = a;
+        buf = data;
+        len = size;
+    }
+    /* The rest of the hash from where the lane is. */
+    uint_least64_t end()
+    {
+        while(len >= 8*3)
+        {
+            a += get_64(buf+0);
+            b += get_64(buf+8);
+            c += get_64(buf+16);
+            mix64z(a,b,c);
+            buf += 24; len -= 24;
+        }
+        if(len > 0)
+        {
+            if(len >= 16)     { a += get_64(buf); b += get_64(buf+8); c += get_n(buf+16,len-16); }
+            else if(len >= 8) { a += get_64(buf); b += get_n(buf+8, len-8); }
+            else              { a += get_n(buf, len); }
+            final64z(a,b,c);
+        }
+        return c;
+    }
+};
+
+newhash64_t newhash64_calc(const unsigned char* buf, unsigned long size)
+{
+    return newhash64_calc_upd(0, buf, size);
+}
+newhash64_t newhash64_calc_upd(newhash64_t c, const unsigned char* buf, unsigned long size)
+{
+    newhash_lane l;
+    l.begin(c, buf, size);
+    return l.end();
+}
+
+/* Several hashes at once, for when there are many blocks to hash.
+ * The mixing of one hash is a serial chain of dependent operations,
+ * so a single hash cannot use SIMD. But the hashes of different
+ * blocks are independent, and fit side by side in SIMD registers,
+ * two in SSE2 and four in AVX2. Each lane computes exactly what
+ * newhash64_calc_upd() does.
+ */
+#if defined(SIXTY_BIT_PLATFORM) && !defined(USE_MMX) \
+ && defined(__GNUC__) && defined(__x86_64__) && !defined(__ICC)
+# define NEWHASH_VECTORS
+#endif
+
+#ifdef NEWHASH_VECTORS
+typedef uint_least64_t newhash_v2 __attribute__((vector_size(16)));
+typedef uint_least64_t newhash_v4 __attribute__((vector_size(32)));
+
+static inline newhash_v2 rol(newhash_v2 v, int n) { return (v<<n) | (v>>(64-n)); }
+
+/* Runs the mixing loop of two lanes for the given number of rounds. */
+static void newhash_lanes_sse2(newhash_lane* l, unsigned long rounds)
+{
+    newhash_v2 a = { l[0].a, l[1].a };
+    newhash_v2 b = { l[0].b, l[1].b };
+    newhash_v2 c = { l[0].c, l[1].c };
+    const unsigned char* p0 = l[0].buf;
+    const unsigned char* p1 = l[1].buf;
+    for(unsigned long n = rounds; n-- > 0; p0 += 24, p1 += 24)
+    {
+        newhash_v2 x = { get_64(p0+0),  get_64(p1+0)  }; a += x;
+        newhash_v2 y = { get_64(p0+8),  get_64(p1+8)  }; b += y;
+        newhash_v2 z = { get_64(p0+16), get_64(p1+16) }; c += z;
+        mix64z(a,b,c);
+    }
+    for(unsigned n=0; n<2; ++n)
+    {
+        l[n].a = a[n]; l[n].b = b[n]; l[n].c = c[n];
+        l[n].buf += rounds*24; l[n].len -= rounds*24;
+    }
+}
+
+# define NEWHASH_AVX2 __attribute__((target("avx2")))
+
+static inline NEWHASH_AVX2 __attribute__((always_inline))
+    newhash_v4 rol(newhash_v4 v, int n) { return (v<<n) | (v>>(64-n)); }
+
+/* Same, for four lanes. */
+static NEWHASH_AVX2 void newhash_lanes_avx2(newhash_lane* l, unsigned long rounds)
+{
+    newhash_v4 a = { l[0].a, l[1].a, l[2].a, l[3].a };
+    newhash_v4 b = { l[0].b, l[1].b, l[2].b, l[3].b };
+    newhash_v4 c = { l[0].c, l[1].c, l[2].c, l[3].c };
+    const unsigned char* p0 = l[0].buf;
+    const unsigned char* p1 = l[1].buf;
+    const unsigned char* p2 = l[2].buf;
+    const unsigned char* p3 = l[3].buf;
+    for(unsigned long n = rounds; n-- > 0; p0 += 24, p1 += 24, p2 += 24, p3 += 24)
+    {
+        newhash_v4 x = { get_64(p0+0),  get_64(p1+0),  get_64(p2+0),  get_64(p3+0)  }; a += x;
+        newhash_v4 y = { get_64(p0+8),  get_64(p1+8),  get_64(p2+8),  get_64(p3+8)  }; b += y;
+        newhash_v4 z = { get_64(p0+16), get_64(p1+16), get_64(p2+16), get_64(p3+16) }; c += z;
+        mix64z(a,b,c);
+    }
+    for(unsigned n=0; n<4; ++n)
+    {
+        l[n].a = a[n]; l[n].b = b[n]; l[n].c = c[n];
+        l[n].buf += rounds*24; l[n].len -= rounds*24;
+    }
+}
+
+static unsigned newhash_lanes()
+{
+  #ifdef __AVX2__
+    return 4;
+  #else
+    static const unsigned lanes = __builtin_cpu_supports("avx2") ? 4 : 2;
+    return lanes;
+  #endif
+}
+#endif // NEWHASH_VECTORS
+
+template<typename R>
+static void newhash_multi(R* results,
+                         const unsigned char* const* bufs,
+                         const unsigned long* sizes,
+                         unsigned long count,
+                         R (*scalar)(R, const unsigned char*, unsigned long))
+{
+    unsigned long n = 0;
+#ifdef NEWHASH_VECTORS
+    /* On this platform, newhash_calc_upd() is the 64-bit one truncated. */
+    const unsigned width = newhash_lanes();
+    for(; n + width <= count; n += width)
+    {
+        newhash_lane l[4];
+        unsigned long rounds = ~0UL;
+        for(unsigned a=0; a<width; ++a)
+        {
+            l[a].begin(results[n+a], bufs[n+a], sizes[n+a]);
+            rounds = std::min(rounds, sizes[n+a] / 24);
+        }
+        /* The lanes go together as long as all of them have data.
+         * If the sizes differ, the rest is done one lane at a time. */
+        if(width == 4)
+            newhash_lanes_avx2(l, rounds);
+        else
+            newhash_lanes_sse2(l, rounds);
+        for(unsigned a=0; a<width; ++a)
+            results[n+a] = l[a].end();
+    }
+#endif
+    for(; n < count; ++n)
+        results[n] = scalar(results[n], bufs[n], sizes[n]);
+}
+
+void newhash_calc_multi_upd(newhash_t* results,
+                            const unsigned char* const* bufs,
+                            const unsigned long* sizes,
+                            unsigned long count)
+{
+    newhash_multi(results, bufs, sizes, count, newhash_calc_upd);
+}
+
+void newhash_calc_multi(newhash_t* results,
+                        const unsigned char* const* bufs,
+                        const unsigned long* sizes,
+                        unsigned long count)
+{
+    std::fill(results, results+count, 0);
+    newhash_calc_multi_upd(results, bufs, sizes, count);
+}
+
+void newhash64_calc_multi(newhash64_t* results,
+                          const unsigned char* const* bufs,
+                          const unsigned long* sizes,
+                          unsigned long count)
+{
+    std::fill(results, results+count, 0);
+    newhash_multi(results, bufs, sizes, count, newhash64_calc_upd);
+}
@@ -8,10 +8,34 @@ extern "C" {
 #include "endian.hh"
 
 typedef uint_least32_t newhash_t;
+typedef uint_least64_t newhash64_t;
 
 extern newhash_t newhash_calc(const unsigned char* buf, unsigned long size);
 extern newhash_t newhash_calc_upd(newhash_t c, const unsigned char* buf, unsigned long size);
 
+/* Computes count hashes at once, faster than one by one where SIMD
+ * is available. The _upd version continues from the values in results,
+ * like newhash_calc_upd() does, and the other one from 0.
+ */
+extern void newhash_calc_multi(newhash_t* results,
+                               const unsigned char* const* bufs,
+                               const unsigned long* sizes,
+                               unsigned long count);
+extern void newhash_calc_multi_upd(newhash_t* results,
+                                   const unsigned char* const* bufs,
+                                   const unsigned long* sizes,
+                                   unsigned long count);
+
+/* The same hash with 64 bits, for when 32 bits collide too often.
+ * Its lowest 32 bits are not necessarily what newhash_calc() gives.
+ */
+extern newhash64_t newhash64_calc(const unsigned char* buf, unsigned long size);
+extern newhash64_t newhash64_calc_upd(newhash64_t c, const unsigned char* buf, unsigned long size);
+extern void newhash64_calc_multi(newhash64_t* results,
+                                 const unsigned char* const* bufs,
+                                 const unsigned long* sizes,
+                                 unsigned long count);
+
 #ifdef __cplusplus
 }
 #endif
@@ -314,8 +314,10 @@ bool is_zero_block(const unsigned char* data, std::size_t size)
 
 #else
  #if 1
-    /* Memchr might use an algorithm optimized for aligned word-size access */
-    return !std::memchr(data, '\0', size);
+    /* Memcmp might use an algorithm optimized for aligned word-size access.
+     * The block is all zero if its first byte is zero and every byte
+     * equals the one after it. */
+    return size == 0 || (data[0] == 0 && std::memcmp(data, data+1, size-1) == 0);
  #else
     /* attempt of a faster implementation using aligned word access where possible */
 
@@ -386,7 +388,7 @@ bool SparseWrite(int fd,
     std::size_t SkippedSize = 0;
 
     {
-    uint_fast64_t NextBlockBoundary = (WritePos + BlockSize-1) & uint_fast64_t(~BlockSize);
+    uint_fast64_t NextBlockBoundary = (WritePos + BlockSize-1) & ~uint_fast64_t(BlockSize-1);
     uint_fast64_t UnalignedRemainder = std::min((uint_fast64_t)BufSize, NextBlockBoundary-WritePos);
     if(UnalignedRemainder) AppendBuf(UnalignedRemainder);
     }
@@ -10,8 +10,16 @@
 
 #include <sstream>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <cstring>
 
+uint_fast64_t GetTimeMicros()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * (uint_fast64_t)1000000 + tv.tv_usec;
+}
+
 const std::string ReportSize(uint_fast64_t size)
 {
     std::stringstream st;
@@ -8,4 +8,7 @@ const std::string ReportSize(uint_fast64_t size);
 
 const std::string TranslateMode(unsigned mode);
 
+/* Wall clock time in microseconds, for measuring durations. */
+uint_fast64_t GetTimeMicros();
+
 #endif
@@ -0,0 +1,288 @@
+/*
+cromfs - Copyright (C) 1992,2014 Bisqwit (http://iki.fi/bisqwit/)
+Licence: GPL3
+
+libcromfs.cc: The functions of libcromfs.h. Like fuse-ops.cc, it
+translates calls into operations performed by the cromfs class,
+and the errno values thrown by it into return values.
+
+*/
+
+#define _LARGEFILE64_SOURCE
+#include "cromfs.hh"
+#include "libcromfs.h"
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define LIBCROMFS_TRY \
+    try {
+
+#define LIBCROMFS_CATCH() \
+    } \
+    catch(cromfs_exception e) \
+    { \
+        return -(int)e; \
+    } \
+    catch(const std::bad_alloc&) \
+    { \
+        return -ENOMEM; \
+    }
+
+struct libcromfs_cache
+{
+    cromfs_fblock_cache fblocks;
+
+    explicit libcromfs_cache(size_t max_bytes) : fblocks(max_bytes, 16) { }
+};
+
+struct libcromfs_image
+{
+    int    fd;
+    cromfs fs;
+
+    libcromfs_image(int fild, libcromfs_cache* cache)
+        : fd(fild), fs(fild, cache ? &cache->fblocks : 0) { }
+};
+
+struct libcromfs_file
+{
+    libcromfs_image*      image;
+    cromfs_inodenum_t     inonum;
+    cromfs_inode_internal inode; // With the block list
+};
+
+struct libcromfs_dir
+{
+    cromfs_dirinfo                 entries;
+    cromfs_dirinfo::const_iterator pos;
+};
+
+static void stat_inode(struct stat& attr, cromfs_inodenum_t ino, const cromfs_inode_internal& i)
+{
+    std::memset(&attr, 0, sizeof(attr));
+    attr.st_dev     = 0;
+    attr.st_ino     = ino;
+    attr.st_mode    = i.mode;
+    attr.st_nlink   = i.links;
+    attr.st_uid     = i.uid ? i.uid : getuid();
+    attr.st_gid     = i.gid ? i.gid : getgid();
+    attr.st_size    = i.bytesize;
+    attr.st_blksize = 4096;
+    attr.st_blocks  = (i.bytesize + 511) / 512;
+    attr.st_atime   = i.time;
+    attr.st_mtime   = i.time;
+    attr.st_ctime   = i.time;
+    attr.st_rdev    = i.rdev;
+}
+
+extern "C" {
+
+libcromfs_cache* libcromfs_cache_new(uint64_t max_bytes)
+{
+    try
+    {
+        return new libcromfs_cache(max_bytes);
+    }
+    catch(const std::bad_alloc&)
+    {
+        return 0;
+    }
+}
+
+void libcromfs_cache_free(libcromfs_cache* cache)
+{
+    delete cache;
+}
+
+int libcromfs_open_image(const char* filename, libcromfs_cache* cache,
+                         libcromfs_image** result)
+{
+    int fd = open(filename, O_RDONLY | O_LARGEFILE);
+    if(fd < 0) return -errno;
+
+    libcromfs_image* image = 0;
+    LIBCROMFS_TRY
+        try
+        {
+            image = new libcromfs_image(fd, cache);
+            image->fs.Initialize();
+        }
+        catch(...)
+        {
+            delete image;
+            close(fd);
+            throw;
+        }
+        *result = image;
+        return 0;
+    LIBCROMFS_CATCH()
+}
+
+void libcromfs_close_image(libcromfs_image* image)
+{
+    if(!image) return;
+    const int fd = image->fd;
+    delete image;
+    close(fd);
+}
+
+int libcromfs_resolve(libcromfs_image* image, const char* path,
+                      libcromfs_ino_t* result)
+{
+    LIBCROMFS_TRY
+        /* cromfs directories do not know their parents,
+         * so the way here is remembered for "..". */
+        std::vector<cromfs_inodenum_t> trail(1, LIBCROMFS_ROOT_INO);
+
+        for(const char* p = path; *p; )
+        {
+            const char* end = std::strchr(p, '/');
+            if(!end) end = p + std::strlen(p);
+            const std::string name(p, end);
+            p = *end ? end+1 : end;
+
+            if(name.empty() || name == ".") continue;
+            if(name == "..")
+            {
+                if(trail.size() > 1) trail.pop_back();
+                continue;
+            }
+            const cromfs_inodenum_t inonum = image->fs.dir_lookup(trail.back(), name);
+            if(!inonum) return -ENOENT;
+            trail.push_back(inonum);
+        }
+        *result = trail.back();
+        return 0;
+    LIBCROMFS_CATCH()
+}
+
+int libcromfs_stat(libcromfs_image* image, libcromfs_ino_t ino,
+                   struct stat* result)
+{
+    LIBCROMFS_TRY
+        stat_inode(*result, ino, image->fs.read_inode(ino));
+        return 0;
+    LIBCROMFS_CATCH()
+}
+
+int libcromfs_open(libcromfs_image* image, libcromfs_ino_t ino,
+                   libcromfs_file** result)
+{
+    LIBCROMFS_TRY
+        const cromfs_inode_internal inode = image->fs.read_inode(ino);
+        if(S_ISDIR(inode.mode)) return -EISDIR;
+
+        libcromfs_file* file = new libcromfs_file;
+        file->image  = image;
+        file->inonum = ino;
+        try
+        {
+            file->inode = image->fs.read_inode_and_blocks(ino);
+        }
+        catch(...)
+        {
+            delete file;
+            throw;
+        }
+        *result = file;
+        return 0;
+    LIBCROMFS_CATCH()
+}
+
+void libcromfs_close(libcromfs_file* file)
+{
+    delete file;
+}
+
+int libcromfs_fstat(libcromfs_file* file, struct stat* result)
+{
+    stat_inode(*result, file->inonum, file->inode);
+    return 0;
+}
+
+ssize_t libcromfs_pread(libcromfs_file* file, void* buf, size_t size,
+                        uint64_t offset)
+{
+    LIBCROMFS_TRY
+        return file->image->fs.read_file_data(
+            file->inode, offset, (unsigned char*)buf, size, "libcromfs");
+    LIBCROMFS_CATCH()
+}
+
+ssize_t libcromfs_preadv(libcromfs_file* file, const struct iovec* iov,
+                         int iovcnt, uint64_t offset)
+{
+    LIBCROMFS_TRY
+        uint_fast64_t size = 0;
+        for(int a=0; a<iovcnt; ++a) size += iov[a].iov_len;
+
+        std::vector<cromfs_data_segment> segments;
+        const uint_fast64_t result =
+            file->image->fs.map_file_data(file->inode, offset, size, segments);
+
+        /* Copy the segments into the buffers. Either may end
+         * in the middle of the other. */
+        int      bufno = 0;
+        size_t   bufpos = 0;
+        for(size_t a=0; a<segments.size(); ++a)
+        {
+            const cromfs_data_segment& seg = segments[a];
+            for(uint_fast32_t segpos = 0; segpos < seg.size; )
+            {
+                while(bufpos == iov[bufno].iov_len) { ++bufno; bufpos = 0; }
+
+                const size_t n = std::min((size_t)(seg.size - segpos),
+                                          iov[bufno].iov_len - bufpos);
+                unsigned char* target = (unsigned char*)iov[bufno].iov_base + bufpos;
+                if(seg.fblock)
+                    std::memcpy(target, seg.fblock->data() + seg.offset + segpos, n);
+                else
+                    std::memset(target, 0, n); // A hole
+                segpos += n;
+                bufpos += n;
+            }
+        }
+        return result;
+    LIBCROMFS_CATCH()
+}
+
+int libcromfs_opendir(libcromfs_image* image, libcromfs_ino_t ino,
+                      libcromfs_dir** result)
+{
+    LIBCROMFS_TRY
+        libcromfs_dir* dir = new libcromfs_dir;
+        try
+        {
+            dir->entries = image->fs.read_dir(ino, 0, (uint_fast32_t)~0U);
+        }
+        catch(...)
+        {
+            delete dir;
+            throw;
+        }
+        dir->pos = dir->entries.begin();
+        *result = dir;
+        return 0;
+    LIBCROMFS_CATCH()
+}
+
+int libcromfs_readdir(libcromfs_dir* dir, const char** name,
+                      libcromfs_ino_t* ino)
+{
+    if(dir->pos == dir->entries.end()) return 0;
+    *name = dir->pos->first.c_str();
+    *ino  = dir->pos->second;
+    ++dir->pos;
+    return 1;
+}
+
+void libcromfs_closedir(libcromfs_dir* dir)
+{
+    delete dir;
+}
+
+} /* extern "C" */
@@ -0,0 +1,99 @@
+#ifndef bqtLibCromfsH
+#define bqtLibCromfsH
+
+/*
+libcromfs - Copyright (C) 1992,2014 Bisqwit (http://iki.fi/bisqwit/)
+Licence: GPL3
+
+An interface for reading cromfs images from programs of your own,
+without Fuse. It is a thin layer over the cromfs class (see
+doc/WritingFrontends.txt) that can be used from C as well as C++.
+
+Every function that can fail returns a negative errno value on
+failure (such as -ENOENT), and 0 or a positive value on success.
+They never throw exceptions.
+
+Images and file handles may be used by any number of threads at once.
+A directory handle may only be used by one thread at a time, like DIR*.
+
+Link with libcromfs.a (or libcromfs.so) and -fopenmp.
+*/
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct libcromfs_cache libcromfs_cache;
+typedef struct libcromfs_image libcromfs_image;
+typedef struct libcromfs_file  libcromfs_file;
+typedef struct libcromfs_dir   libcromfs_dir;
+typedef uint64_t libcromfs_ino_t;
+
+/* The inode number of the root directory. */
+#define LIBCROMFS_ROOT_INO 1
+
+/* Creates a cache of decompressed fblocks, holding at most max_bytes
+ * bytes, which any number of images may share. The images that use it
+ * must be closed before it is freed. Returns NULL if out of memory.
+ */
+libcromfs_cache* libcromfs_cache_new(uint64_t max_bytes);
+void libcromfs_cache_free(libcromfs_cache* cache);
+
+/* Opens the image in the given file. If cache is NULL, the image
+ * gets a cache of its own, with the default size.
+ * Returns -EINVAL if the file is not a cromfs image.
+ */
+int libcromfs_open_image(const char* filename, libcromfs_cache* cache,
+                         libcromfs_image** result);
+void libcromfs_close_image(libcromfs_image* image);
+
+/* Finds the inode number of the given path. The path is relative to
+ * the root directory of the image, whether it begins with a slash or
+ * not. "." and ".." are understood, but symlinks are not followed.
+ */
+int libcromfs_resolve(libcromfs_image* image, const char* path,
+                      libcromfs_ino_t* result);
+
+/* Fills in the attributes of the inode, like stat(). */
+int libcromfs_stat(libcromfs_image* image, libcromfs_ino_t ino,
+                   struct stat* result);
+
+/* Opens the inode for reading. Returns -EISDIR for directories.
+ * The contents of a symlink are its target. */
+int libcromfs_open(libcromfs_image* image, libcromfs_ino_t ino,
+                   libcromfs_file** result);
+void libcromfs_close(libcromfs_file* file);
+
+int libcromfs_fstat(libcromfs_file* file, struct stat* result);
+
+/* Like pread() and preadv(): returns the number of bytes read,
+ * which is less than requested only at the end of the file.
+ * libcromfs_preadv() copies straight from the decompressed
+ * fblocks into the buffers, without an intermediate copy.
+ */
+ssize_t libcromfs_pread(libcromfs_file* file, void* buf, size_t size,
+                        uint64_t offset);
+ssize_t libcromfs_preadv(libcromfs_file* file, const struct iovec* iov,
+                         int iovcnt, uint64_t offset);
+
+/* Opens the directory for listing. Returns -ENOTDIR if it is not one. */
+int libcromfs_opendir(libcromfs_image* image, libcromfs_ino_t ino,
+                      libcromfs_dir** result);
+/* Returns the next entry of the directory: 1 if there was one, 0 at
+ * the end. The name stays valid until the next call with the handle.
+ * The entries come in the order of their names, without "." and "..".
+ */
+int libcromfs_readdir(libcromfs_dir* dir, const char** name,
+                      libcromfs_ino_t* ino);
+void libcromfs_closedir(libcromfs_dir* dir);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -427,20 +427,24 @@ for resource testing (RAM).
 cromfs-driver requires an amount of RAM proportional to a few factors.
 It can be approximated with this formula:<p />
  <code>
-  Max_RAM_usage = FBLOCK_CACHE_MAX_SIZE &times; fblock_size + READDIR_CACHE_MAX_SIZE &times; 60k + 8 &times; num_blocks
+  Max_RAM_usage = fblock_cache + readdir_cache + 8 &times; num_blocks
  </code><p />
 Where
 <ul>
- <li>fblock_size is the value of \"--fblock\" used when the filesystem was created</li>
- <li>FBLOCK_CACHE_MAX_SIZE is a constant defined in cromfs.cc (default: 10)</li>
- <li>READDIR_CACHE_MAX_SIZE is a constant defined in cromfs.cc (default: 3)</li>
- <li>60k is an estimate of a large directory size (2000 files with average name length of 10-20 letters)</li>
+ <li>fblock_cache is the RAM budget for decompressed fblocks, set with
+     the \"-o fblock_cache=MB\" option of cromfs-driver (default: 32&nbsp;MB).
+     At least one fblock is always cached, so if the budget is smaller
+     than the \"--fblock\" size used when the filesystem was created,
+     the fblock size is used instead. fblocks are decompressed only as
+     far as they have been read, and only the decompressed part counts.</li>
+ <li>readdir_cache is the RAM budget for decoded directories, set with
+     the \"-o readdir_cache=MB\" option of cromfs-driver (default: 4&nbsp;MB)</li>
  <li>num_blocks is the number of block structures in the filesystem
      (maximum size is <code>ceil(total_size_of_files / block_size)</code>,
       but it may be smaller.)
 </ul>
-For example, for a 500 MB archive with 16&nbsp;kB blocks and 1&nbsp;MB fblocks,
-the memory usage would be around 10.2&nbsp;MB.
+For example, for a 500 MB archive with 16&nbsp;kB blocks,
+the memory usage would be around 36.2&nbsp;MB with the default settings.
 
 ", 'usage:1. Getting started' => "
 
@@ -465,7 +469,11 @@ the memory usage would be around 10.2&nbsp;MB.
   <pre>\$ make</pre>
    <p>
   This builds the programs \"cromfs-driver\", \"cromfs-driver-static\",
-  \"util/mkcromfs\", \"util/cvcromfs\" and \"util/unmkcromfs\".
+  \"util/mkcromfs\", \"util/cvcromfs\", \"util/unmkcromfs\"
+  and \"util/benchcromfs\", and the library libcromfs (libcromfs.a
+  and libcromfs.so, with the interface in libcromfs.h) for reading
+  cromfs images from programs of your own without Fuse.
+  See doc/WritingFrontends.txt.
    </li>
  <li>Create a sample filesystem:
   <pre>\$ util/mkcromfs . sample.cromfs</pre>
@@ -517,6 +525,11 @@ To improve the compression, try these tips:
      opportunity). Finding that two blocks are identical always
      means better compression.
   </li>
+ <li>If your data has several versions of the same files (such as
+     successive releases of a software tree), use --chunking cdc.
+     It finds the data that the versions share even when it has moved
+     within the file, and spends less time searching than --bruteforcelimit.
+  </li>
  <li>Sort your files. Files which have similar or partially
      identical content should be processed right after one other.</li>
  <li>Adjust the --bruteforcelimit option (-c). Larger values will require
@@ -589,9 +602,16 @@ To improve the filesystem generation speed, try these tips:
  <li>If you have a multicore system, add the --threads option.
      Select --threads 2 if you have a dual core system, for example.
      You can also use a larger value than the number of cores, but
-     same guidelines apply as with the -j in GNU make. Currently
-     this option does not affect compression power, so it is
-     recommended to use it.</li>
+     same guidelines apply as with the -j in GNU make. The threads
+     read and hash the files while the blocks are being placed,
+     and compress the fblocks that have already become full
+     (--latecompress leaves that to the end, saving some temporary
+     disk space), and the placement itself is done in order by one thread, so
+     this option does not affect where the data goes; it is
+     recommended to use it. (The threads also search for the best
+     LZMA parameters of each fblock when --lzmabits is \"auto\" or
+     \"full\", and that search may end slightly differently
+     from run to run.)</li>
    <li>Use \"--lzmabits 2,0,3\" (or other values of your choice) to
      make LZMA compression about 27 times faster, with a slight
      cost of compression power. The default option is \"auto\",
@@ -603,18 +623,58 @@ To improve the filesystem generation speed, try these tips:
 
 To control the memory usage, use these tips:
 <ul>
- <li>Adjust the fblock size (--fsize). The memory used by cromfs-driver
-     is directly proportional to the size of your fblocks. It keeps at
-     most 10 fblocks decompressed in the RAM at a time. If your fblocks
-     are 4 MB in size, it will use 40 MB at max.</li>
+ <li>Adjust the fblock size (--fsize). cromfs-driver keeps decompressed
+     fblocks in the RAM up to a budget of 32 MB by default. Smaller fblocks
+     let more of them fit in the same budget.</li>
  <li>In mkcromfs, adjust the --autoindexperiod option (-A). This will
      not have effect on the memory usage of cromfs-driver, but it will
      control the memory usage of mkcromfs. If you have lots of RAM, you
      should use smaller --autoindexperiod (because it will improve the chances
      of getting better compression results), and use bigger if you have less RAM.</li>
- <li>Find the CACHE_MAX_SIZE settings in cromfs.cc and edit them. This will
-     require recompiling the source. (In future, this should be made a command
-     line option for cromfs-driver.)</li>
+ <li>Use the \"-o fblock_cache=MB\" and \"-o readdir_cache=MB\" options
+     of cromfs-driver to adjust how much RAM it uses for caching.</li>
+ <li>The \"-o inodetab\" option of cromfs-driver decodes the headers of all
+     inodes into RAM (about 30 bytes per file) when the filesystem is first
+     accessed. This makes stat-heavy workloads such as find or rsync much
+     faster, because they no longer need to decompress anything.</li>
+ <li>The \"-o mmap\" option of cromfs-driver maps the whole image into
+     memory once, and decompresses the fblocks directly from the mapping.
+     This saves a system call and a copy of the compressed data for every
+     fblock that is read, but needs address space as large as the image,
+     so it is mostly useful on 64-bit systems. The mapped pages are
+     counted in the page cache, not in fblock_cache.</li>
+ <li>When a file is read sequentially, cromfs-driver decompresses the next
+     fblocks of the file in the background before they are asked for.
+     \"-o prefetch=N\" sets how many fblocks ahead to go (default: 2,
+     0 disables it) and \"-o prefetch_threads=N\" how many threads do it
+     (default: 1). The prefetched fblocks count against fblock_cache.</li>
+ <li>\"-o disk_cache=FILE\" makes cromfs-driver write the decompressed
+     fblocks that fall out of fblock_cache into FILE (preferably on a fast
+     local disk), and read them from there instead of decompressing them
+     again. The file persists across mounts, so a remounted filesystem
+     need not decompress its frequently used fblocks all over again.
+     It is emptied when it is used with a different image.
+     \"-o disk_cache_size=MB\" sets its size (default: 1024). Each fblock
+     number has a single place in the file, so the file should have room
+     for all the fblocks of the image to be fully effective.
+     The fblocks are written by a background thread; if it falls behind,
+     some of them are not written (\"disk_cache.skipped\" in the stats).</li>
+ <li>To see how well the caches work, read the file \".cromfs-stats\"
+     in the root directory of the mounted filesystem. It is not listed by
+     ls, and it is not in the image. It has counters of cache hits, misses
+     and evictions, of bytes read, decompressed and served, of prefetching,
+     and histograms of the time taken by decompression and by each Fuse
+     operation, as lines of \"name value\". For example, if
+     fblock.decompressed_bytes is much larger than fuse.read.bytes,
+     the same fblocks are decompressed over and over again, and a
+     larger fblock_cache (or a disk_cache) would help.</li>
+ <li>To compare settings without mounting anything, use util/benchcromfs.
+     It reads the image with a chosen workload (sequential reads of every
+     file, random reads, stat()s, directory listings, or operations replayed
+     from a trace file) in any number of threads, and reports the operations
+     per second, the megabytes per second, the latency percentiles and the
+     same counters as \".cromfs-stats\". It takes the caching options of
+     cromfs-driver as command line options; see <code>benchcromfs --help</code>.</li>
  <li>In mkcromfs, adjust the block size (--bsize). The RAM usage of mkcromfs
      is directly proportional to the number of blocks (and the filesystem size),
      so smaller blocks require more memory and larger require less.
@@ -638,6 +698,12 @@ To control the filesystem speed, use these tips:
    process for that period of time.</li>
  <li>The smaller your blocks (--bsize), the bigger the latencies are, because
    there will be more steps to process for handling the same amount of data.</li>
+ <li>LZMA decompresses at a few tens of megabytes per second. For the files
+   that are read the most, such as programs and libraries, use the
+   --fastfiles option of mkcromfs: their fblocks are compressed with LZO
+   instead, which takes more space but decompresses many times faster.
+   The --lzmamingain option does the same to the fblocks that LZMA does
+   not compress much better than LZO.</li>
  <li>Use the most powerful compiler and compiler settings available
    for building cromfs-driver. This helps the decompression and cache lookups.</li>
  <li>Use fast hardware&hellip;</li>
@@ -736,6 +802,9 @@ Each locator describes, where to find the particular
  <p/>
 At the end of the filesystem creation process, the blktab is compressed
 and becomes \"blkdata\" before being written into the filesystem.<br />
+With the --blktabchunk option of mkcromfs, it is compressed in
+chunks of the given number of locators, and cromfs-driver only
+decompresses the chunks that are actually needed.<br />
 (These names are only useful when referencing the
 <a href=\"http://bisqwit.iki.fi/src/cromfs-format.txt\">filesystem format
 documentation</a>; they are not found in the filesystem itself.
@@ -757,6 +826,9 @@ When mkcromfs stores blocks, it remembers where it stored them, so that
 if it later finds an identical block in another file (or the same file),
 it won't need to search fblocks again to find a best placement.<br />
 The index is a map of block hashes to data locators and block numbers.
+Blocks whose hashes match are compared byte by byte. The hashes are 32 bits;
+with millions of blocks, they match falsely often enough that the comparisons
+become significant, and --fingerprintbits 64 can be used to avoid that.
  <p/>
 The --autoindexperiod (-A) setting can be used to extend this mechanism, that
 in addition to the blocks it has already encoded, it will memorize more
@@ -767,6 +839,14 @@ This helps compression when the number of fblocks searched (--bruteforcelimit)
 is low compared to the number of fblocks generated, at the cost of memory
 consumed by mkcromfs, and has also potential to make mkcromfs faster
 (but also slower).
+ <p/>
+With --chunking cdc, mkcromfs also memorizes content-defined anchors in the
+fblocks: positions chosen by a rolling hash of the data itself, on average
+every few kilobytes (--cdcsizes). When a block is not found otherwise, the
+anchors in it are looked up, which finds its data wherever it begins in an
+fblock &mdash; such as in an earlier version of the same file, where some
+bytes were inserted or deleted before it. The blocks themselves keep their
+fixed size, so the resulting filesystem is readable by any cromfs version.
 
 ", 'concept_random_compress:1.1.1. Random compress period (mkcromfs only)' => "
 
@@ -926,10 +1006,6 @@ to this package.
    <li>A proof of concept example of utilizing cromfs
     in a root filesystem (with initramfs)</li>
    <li>Add appending support (theoretically doable, just not very fast)</li>
-   <li>Add threading in cromfs-driver.
-       Needs write-locks in fblock_cache and readdir_cache.
-       Possibly in BWT too.
-       Also blktab and fblktab if those are being changed.</li>
   </ul></li>
  <li>Topic: Documentation
   <ul>
@@ -89,3 +89,153 @@ if false; then
 	./test-hashmaps
 	rm -f test-hashmaps
 fi
+
+## TEST 6: DataCache
+if true; then
+	$CXX -o test-datacache -O3 test-datacache.cc -g -Wall -W -I../lib -fopenmp
+	echo "Testing DataCache..."
+	./test-datacache
+	rm -f test-datacache
+fi
+
+## TEST 7: BatchFileRead
+if true; then
+	$CXX -o test-batchread -O3 test-batchread.cc ../lib/batchread.cc \
+		-g -Wall -W -fopenmp -I../lib -DHAS_IO_URING \
+	|| $CXX -o test-batchread -O3 test-batchread.cc ../lib/batchread.cc \
+		-g -Wall -W -fopenmp -I../lib
+	echo "Testing BatchFileRead..."
+	./test-batchread
+	rm -f test-batchread
+fi
+
+## TEST 8: DiskCache
+if true; then
+	$CXX -o test-diskcache -O3 test-diskcache.cc ../lib/diskcache.cc \
+		../lib/newhash.cc ../lib/fadvise.cc -g -Wall -W -fopenmp -I../lib
+	echo "Testing DiskCache..."
+	./test-diskcache
+	rm -f test-diskcache
+fi
+
+## TEST 9: libcromfs
+if true; then
+	make -C ../util mkcromfs -j4
+	make -C .. libcromfs.a -j4
+	rm -f tmp.cromfs
+	../util/mkcromfs a tmp.cromfs -b256 -f4096 >/dev/null
+	$CXX -o test-libcromfs -O3 test-libcromfs.cc ../libcromfs.a \
+		-g -Wall -W -fopenmp
+	echo "Testing libcromfs..."
+	./test-libcromfs tmp.cromfs a
+	# Again with fblocks of every codec
+	rm -f tmp.cromfs
+	../util/mkcromfs a tmp.cromfs -b256 -f4096 --fastfiles '*.hh' --lzmamingain 10 >/dev/null
+	./test-libcromfs tmp.cromfs a
+	rm -f tmp.cromfs
+	../util/mkcromfs a tmp.cromfs -b256 -f4096 --fastfiles '*/dir2/*' --fastcodec store >/dev/null
+	./test-libcromfs tmp.cromfs a
+	# Again with 64-bit fingerprints
+	rm -f tmp.cromfs
+	../util/mkcromfs a tmp.cromfs -b256 -f4096 --fingerprintbits 64 --blockindexmethod prepass >/dev/null
+	./test-libcromfs tmp.cromfs a
+	rm -f tmp.cromfs
+	../util/mkcromfs a tmp.cromfs -b256 -f4096 --fingerprintbits 64 --blockindexmethod collect2 >/dev/null
+	./test-libcromfs tmp.cromfs a
+	# Again with content-defined chunking, over two versions of the files
+	rm -rf c tmp.cromfs
+	cp -pr a c
+	mkdir c/v2
+	for f in fblock.hh lzma.hh util.hh; do
+		( echo "An insertion"; cat a/$f ) > c/v2/$f
+	done
+	../util/mkcromfs c tmp.cromfs -b256 -f4096 --chunking cdc --cdcsizes 16,64,256 >/dev/null
+	./test-libcromfs tmp.cromfs c
+	# Again with several threads reading ahead, over several windows
+	# of blocks, and compressing the full fblocks meanwhile;
+	# the image must come out as with one thread, byte for byte
+	# (SOURCE_DATE_EPOCH fixes the time stamps of the image, and
+	# --lzmabits the LZMA parameters, whose search is threaded)
+	rm -f tmp.cromfs tmp2.cromfs
+	SOURCE_DATE_EPOCH=1 ../util/mkcromfs c tmp.cromfs -b32 -f4096 --lzmabits 2,0,3 --threads 1 >/dev/null
+	SOURCE_DATE_EPOCH=1 ../util/mkcromfs c tmp2.cromfs -b32 -f4096 --lzmabits 2,0,3 --threads 8 >/dev/null
+	./test-libcromfs tmp2.cromfs c
+	if ! cmp tmp.cromfs tmp2.cromfs; then
+		echo "*** TEST 9: FAIL: the image depends on --threads"
+		exit 1
+	fi
+	# Again, and the image must be the same as with --latecompress.
+	# The copy of the text in a fast-codec file reuses blocks of full
+	# fblocks, which then have to be compressed again, with that codec.
+	mkdir c/v3
+	cat a/*.hh | head -c 14000 > c/v3/1.txt
+	( printf x; cat c/v3/1.txt ) > c/v3/2.fast
+	rm -f tmp.cromfs tmp2.cromfs
+	SOURCE_DATE_EPOCH=1 ../util/mkcromfs c tmp.cromfs -b32 -f4096 --lzmabits 2,0,3 --fastfiles '*.fast' --latecompress >/dev/null
+	SOURCE_DATE_EPOCH=1 ../util/mkcromfs c tmp2.cromfs -b32 -f4096 --lzmabits 2,0,3 --fastfiles '*.fast' --threads 8 > tmp.log
+	./test-libcromfs tmp2.cromfs c
+	if ! cmp tmp.cromfs tmp2.cromfs \
+	|| ! grep -q "(while blockifying)" tmp.log \
+	|| ! grep -q "(compressed again)" tmp.log; then
+		echo "*** TEST 9: FAIL: compressing the full fblocks early"
+		exit 1
+	fi
+	rm -rf c test-libcromfs tmp.cromfs tmp2.cromfs tmp.log
+fi
+
+## TEST 10: SparseWrite
+if true; then
+	$CXX -o test-sparsewrite -O3 test-sparsewrite.cc ../lib/sparsewrite.cc \
+		-g -Wall -W -I../lib
+	echo "Testing SparseWrite..."
+	./test-sparsewrite
+	rm -f test-sparsewrite
+fi
+
+## TEST 11: newhash
+if true; then
+	$CXX -o test-newhash -O3 test-newhash.cc ../lib/newhash.cc \
+		-g -Wall -W -I../lib
+	echo "Testing newhash..."
+	./test-newhash
+	rm -f test-newhash
+fi
+
+## TEST 12: Directory indexes and a chunked block table
+if true; then
+	make -C ../util mkcromfs unmkcromfs -j4
+	rm -f tmp.cromfs
+	../util/mkcromfs a tmp.cromfs -b64 -f512 --dirindex 2 --blktabchunk 64 >/dev/null
+	rm -rf b
+	../util/unmkcromfs tmp.cromfs b -s >/dev/null
+
+	( cd a && tar cf - *) | tar tvvf - | sort > a.listing
+	( cd b && tar cf - *) | tar tvvf - | sort > b.listing
+
+	if diff -u a.listing b.listing; then
+		echo "*** TEST 12: PASS"
+	else
+		echo "*** TEST 12: FAIL"
+	fi
+	rm -rf a.listing b.listing b tmp.cromfs
+fi
+
+## TEST 13: Small fblocks of the fast codecs
+if true; then
+	make -C ../util mkcromfs unmkcromfs -j4
+	for codec in store lzo; do
+		for n in 4 7 88 130 133 136; do
+			rm -rf b d tmp.cromfs
+			mkdir d
+			head -c $n a/util.hh > d/file.fast
+			../util/mkcromfs d tmp.cromfs -b16 -f64 --minfreespace 0 --fastfiles '*' --fastcodec $codec >/dev/null
+			../util/unmkcromfs tmp.cromfs b >/dev/null
+			if ! diff -r d b; then
+				echo "*** TEST 13: FAIL ($n bytes, $codec)"
+				exit 1
+			fi
+		done
+	done
+	echo "*** TEST 13: PASS"
+	rm -rf b d tmp.cromfs
+fi
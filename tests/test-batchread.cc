@@ -0,0 +1,71 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <vector>
+#include <unistd.h>
+#include "../lib/batchread.hh"
+
+/* Reads random ranges of a temporary file with BatchFileRead
+ * and compares them with the file contents. Ranges that extend
+ * beyond the end of the file must fail with EIO.
+ */
+static long rand2(long min, long max)
+{
+    return min + std::rand() % (max-min+1);
+}
+
+int main()
+{
+    std::srand(15);
+
+    std::vector<unsigned char> contents(3000000);
+    for(size_t a=0; a<contents.size(); ++a)
+        contents[a] = std::rand();
+
+    FILE* fp = std::tmpfile();
+    if(!fp || std::fwrite(&contents[0], 1, contents.size(), fp) != contents.size()
+    || std::fflush(fp) != 0)
+    {
+        std::perror("tmpfile");
+        return 1;
+    }
+    const int fd = fileno(fp);
+
+    unsigned errors = 0;
+    for(unsigned round = 0; round < 50; ++round)
+    {
+        const size_t n = rand2(1, 200);
+        std::vector<size_t> pos(n), len(n);
+        std::vector< std::vector<unsigned char> > buffers(n);
+
+        BatchFileRead reader(fd);
+        for(size_t a=0; a<n; ++a)
+        {
+            pos[a] = rand2(0, contents.size() + 1000);
+            len[a] = rand2(1, 70000);
+            buffers[a].resize(len[a]);
+            reader.Add(pos[a], len[a], &buffers[a][0]);
+        }
+        reader.Submit();
+
+        const long count = n;
+      #pragma omp parallel for reduction(+:errors)
+        for(long a=0; a<count; ++a)
+        {
+            const int e = reader.Wait(a);
+            const bool beyond_eof = pos[a] + len[a] > contents.size();
+            if(beyond_eof ? e != EIO
+                          : (e != 0 || std::memcmp(&buffers[a][0], &contents[pos[a]], len[a])))
+            {
+                if(errors++ < 10)
+                    std::printf("Round %u: range %ld (%u bytes at %u): error %d\n",
+                        round, a, (unsigned)len[a], (unsigned)pos[a], e);
+            }
+        }
+    }
+    std::fclose(fp);
+
+    std::printf("%u errors\n", errors);
+    return errors ? 1 : 0;
+}
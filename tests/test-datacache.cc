@@ -0,0 +1,161 @@
+#include <cstdio>
+#include <cstdlib>
+#include <list>
+#include "../lib/datacache.hh"
+
+/* A straightforward LRU to compare DataCache against.
+ * With a single shard, DataCache must evict exactly the same entries.
+ */
+struct ReferenceLRU
+{
+    typedef std::pair<unsigned, std::vector<char> > entry;
+    std::list<entry> order; // front = most recently used
+    size_t max_bytes;
+
+    explicit ReferenceLRU(size_t mb) : order(), max_bytes(mb) { }
+
+    static size_t Cost(const std::vector<char>& v)
+        { return DataCacheCost< std::vector<char> >::Get(v); }
+
+    size_t Bytes() const
+    {
+        size_t result = 0;
+        for(std::list<entry>::const_iterator i = order.begin(); i != order.end(); ++i)
+            result += Cost(i->second);
+        return result;
+    }
+    bool Get(unsigned key, std::vector<char>& result)
+    {
+        for(std::list<entry>::iterator i = order.begin(); i != order.end(); ++i)
+            if(i->first == key)
+            {
+                result = i->second;
+                order.splice(order.begin(), order, i);
+                return true;
+            }
+        return false;
+    }
+    void Put(unsigned key, const std::vector<char>& value)
+    {
+        for(std::list<entry>::iterator i = order.begin(); i != order.end(); ++i)
+            if(i->first == key) { order.erase(i); break; }
+        order.push_front(entry(key, value));
+        while(Bytes() > max_bytes && order.size() > 1)
+            order.pop_back();
+    }
+};
+
+struct IsOdd
+{
+    bool operator() (unsigned key) const { return key & 1; }
+};
+
+static long rand2(long min, long max)
+{
+    return min + std::rand() % (max-min+1);
+}
+
+int main()
+{
+    std::srand(15);
+
+    const size_t budget = 20000;
+    DataCache<unsigned, std::vector<char> > cache(budget, 1);
+    ReferenceLRU reference(budget);
+
+    unsigned errors = 0;
+    for(unsigned round = 0; round < 200000; ++round)
+    {
+        unsigned key = rand2(0, 300);
+        if(std::rand() % 3)
+        {
+            std::vector<char> a, b;
+            bool found_a = cache.Get(key, a);
+            bool found_b = reference.Get(key, b);
+            if(found_a != found_b || a != b)
+            {
+                if(errors++ < 10)
+                    std::printf("Round %u: key %u: Get mismatch (%d vs %d)\n",
+                        round, key, (int)found_a, (int)found_b);
+            }
+        }
+        else
+        {
+            std::vector<char> value(rand2(0, 2000), (char)key);
+            reference.Put(key, value);
+            if(round & 1)
+                cache.Put(key, value);
+            else
+            {
+                cache.PutSwap(key, value);
+                if(!value.empty() && errors++ < 10)
+                    std::printf("Round %u: PutSwap left the value\n", round);
+            }
+            if(cache.num_bytes() != reference.Bytes()
+            || cache.num_entries() != reference.order.size())
+            {
+                if(errors++ < 10)
+                    std::printf("Round %u: size mismatch (%u bytes in %u entries vs %u bytes in %u entries)\n",
+                        round,
+                        (unsigned)cache.num_bytes(), (unsigned)cache.num_entries(),
+                        (unsigned)reference.Bytes(), (unsigned)reference.order.size());
+            }
+        }
+    }
+
+    /* With several shards, the budget must still be obeyed. */
+    DataCache<unsigned, std::vector<char> > sharded(budget, 8);
+    for(unsigned round = 0; round < 100000; ++round)
+    {
+        unsigned key = rand2(0, 100000);
+        sharded.Put(key, std::vector<char>(rand2(0, 2000)));
+        if(sharded.num_bytes() > budget)
+        {
+            if(errors++ < 10)
+                std::printf("Round %u: sharded cache is over budget: %u bytes\n",
+                    round, (unsigned)sharded.num_bytes());
+        }
+        if(!sharded.Has(key))
+        {
+            if(errors++ < 10)
+                std::printf("Round %u: key %u was not found right after Put\n",
+                    round, key);
+        }
+    }
+
+    /* EraseIf() removes exactly the entries it is asked to. */
+    sharded.clear();
+    for(unsigned key = 0; key < 500; ++key)
+        sharded.Put(key, std::vector<char>(1));
+    sharded.EraseIf(IsOdd());
+    for(unsigned key = 0; key < 500; ++key)
+        if(sharded.Has(key) != !(key & 1))
+        {
+            if(errors++ < 10)
+                std::printf("Key %u: wrong after EraseIf\n", key);
+        }
+    if(sharded.num_entries() != 250)
+    {
+        if(errors++ < 10)
+            std::printf("%u entries after EraseIf\n", (unsigned)sharded.num_entries());
+    }
+
+    /* Several threads at once; the totals must not lose updates. */
+    sharded.clear();
+  #pragma omp parallel for
+    for(long round = 0; round < 200000; ++round)
+    {
+        unsigned seed = round;
+        sharded.Put(rand_r(&seed) % 5000, std::vector<char>(rand_r(&seed) % 2000));
+    }
+    sharded.clear();
+    if(sharded.num_entries() != 0 || sharded.num_bytes() != 0)
+    {
+        if(errors++ < 10)
+            std::printf("%u entries, %u bytes after a threaded clear\n",
+                (unsigned)sharded.num_entries(), (unsigned)sharded.num_bytes());
+    }
+
+    std::printf("%u errors\n", errors);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,115 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <string>
+#include <unistd.h>
+#include "../lib/diskcache.hh"
+
+/* Stores random data in a DiskCache from several threads, and checks
+ * that what is read back is either what was stored or nothing. Then
+ * checks that the contents survive reopening the file, that a different
+ * identity empties the cache, and that corrupted slots are rejected.
+ */
+static const unsigned SlotSize = 20000;
+static const unsigned NumKeys  = 300;
+
+static void MakeData(unsigned key, std::vector<unsigned char>& data)
+{
+    data.resize(1 + (key * 7919) % SlotSize);
+    for(size_t a=0; a<data.size(); ++a)
+        data[a] = (unsigned char)(key * 31 + a * 17 + (a >> 8));
+}
+
+static unsigned CheckAll(DiskCache& cache, bool expect_all, unsigned& found)
+{
+    unsigned errors = 0, n_found = 0;
+  #pragma omp parallel for reduction(+:errors,n_found)
+    for(long key=0; key<(long)NumKeys; ++key)
+    {
+        std::vector<unsigned char> data, buf(SlotSize);
+        MakeData(key, data);
+        const uint_fast32_t length = cache.Find(key);
+        if(!length || (length == data.size() && !cache.Read(key, &buf[0], length)))
+            continue; // Not there, or rejected by the checksum
+        if(length != data.size()
+        || std::memcmp(&buf[0], &data[0], length) != 0)
+        {
+            if(errors++ < 10)
+                std::printf("Key %ld: wrong data\n", key);
+            continue;
+        }
+        ++n_found;
+    }
+    found = n_found;
+    if(expect_all && found != NumKeys)
+    {
+        std::printf("Only %u keys of %u found\n", found, NumKeys);
+        ++errors;
+    }
+    return errors;
+}
+
+int main()
+{
+    char filename[] = "/tmp/test-diskcache-XXXXXX";
+    int fd = mkstemp(filename);
+    if(fd < 0) { std::perror("mkstemp"); return 1; }
+    close(fd);
+
+    std::vector<unsigned char> identity(40, 'a'), other(40, 'b');
+    const uint_fast64_t max_bytes = (uint_fast64_t)NumKeys * 24576 + 65536;
+    unsigned errors = 0, found = 0;
+
+    {
+        DiskCache cache;
+        if(!cache.Open(filename, max_bytes, SlotSize, identity))
+            { std::printf("Open failed\n"); return 1; }
+
+        /* Readers and writers of the same keys at the same time. */
+      #pragma omp parallel for
+        for(long n=0; n<(long)NumKeys*4; ++n)
+        {
+            const unsigned key = n % NumKeys;
+            std::vector<unsigned char> data;
+            MakeData(key, data);
+            cache.Put(key, &data[0], data.size());
+        }
+        errors += CheckAll(cache, true, found);
+
+        /* A second user of the same file must be refused. */
+        DiskCache second;
+        if(second.Open(filename, max_bytes, SlotSize, identity))
+            { std::printf("Opened twice\n"); ++errors; }
+    }
+    {
+        DiskCache cache;
+        cache.Open(filename, max_bytes, SlotSize, identity);
+        errors += CheckAll(cache, true, found);
+    }
+    {
+        /* Overwrite the middle of every slot. */
+        FILE* fp = std::fopen(filename, "r+b");
+        for(long pos = 8192; pos < (long)max_bytes; pos += 4096)
+        {
+            std::fseek(fp, pos + 100, SEEK_SET);
+            std::fputs("garbage", fp);
+        }
+        std::fclose(fp);
+
+        DiskCache cache;
+        cache.Open(filename, max_bytes, SlotSize, identity);
+        errors += CheckAll(cache, false, found);
+        if(found == NumKeys) { std::printf("Corruption not detected\n"); ++errors; }
+    }
+    {
+        DiskCache cache;
+        cache.Open(filename, max_bytes, SlotSize, other);
+        errors += CheckAll(cache, false, found);
+        if(found) { std::printf("%u keys found with another identity\n", found); ++errors; }
+    }
+    unlink(filename);
+
+    std::printf("%u errors\n", errors);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,211 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdarg>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../libcromfs.h"
+
+/* Opens the image twice, sharing one small cache, and compares what
+ * libcromfs gives against the directory the image was made from:
+ * the directory listings, the attributes, and the contents read with
+ * pread and preadv in random pieces from several threads at once.
+ */
+static unsigned errors = 0;
+
+static void FAIL(const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+  #pragma omp critical
+    {
+        if(errors++ < 20) { std::vprintf(fmt, ap); std::printf("\n"); }
+    }
+    va_end(ap);
+}
+
+struct Entry
+{
+    std::string path;
+    struct stat st;
+    std::vector<unsigned char> data; // Contents, or the target of a symlink
+};
+
+static void ReadSource(const std::string& root, const std::string& path,
+                       std::vector<Entry>& entries)
+{
+    DIR* dir = opendir((root + path).c_str());
+    if(!dir) return;
+    while(struct dirent* ent = readdir(dir))
+    {
+        if(!std::strcmp(ent->d_name, ".") || !std::strcmp(ent->d_name, "..")) continue;
+        Entry e;
+        e.path = path + "/" + ent->d_name;
+        const std::string full = root + e.path;
+        lstat(full.c_str(), &e.st);
+        if(S_ISREG(e.st.st_mode))
+        {
+            FILE* fp = std::fopen(full.c_str(), "rb");
+            e.data.resize(e.st.st_size);
+            if(!fp || std::fread(e.data.empty() ? 0 : &e.data[0], 1, e.data.size(), fp) != e.data.size())
+                FAIL("%s: cannot read the source", full.c_str());
+            if(fp) std::fclose(fp);
+        }
+        else if(S_ISLNK(e.st.st_mode))
+        {
+            char Buf[4096];
+            ssize_t n = readlink(full.c_str(), Buf, sizeof(Buf));
+            e.data.assign(Buf, Buf + std::max(n, (ssize_t)0));
+        }
+        entries.push_back(e);
+        if(S_ISDIR(e.st.st_mode)) ReadSource(root, e.path, entries);
+    }
+    closedir(dir);
+}
+
+static void CheckListing(libcromfs_image* image, const std::string& path,
+                         const std::vector<Entry>& entries)
+{
+    std::vector<std::string> expected, got;
+    for(size_t a=0; a<entries.size(); ++a)
+        if(entries[a].path.compare(0, path.size()+1, path + "/") == 0
+        && entries[a].path.find('/', path.size()+1) == std::string::npos)
+            expected.push_back(entries[a].path.substr(path.size()+1));
+    std::sort(expected.begin(), expected.end());
+
+    libcromfs_ino_t ino;
+    libcromfs_dir* dir;
+    if(libcromfs_resolve(image, path.c_str(), &ino) < 0
+    || libcromfs_opendir(image, ino, &dir) < 0)
+    {
+        FAIL("%s: cannot open the directory", path.c_str());
+        return;
+    }
+    const char* name;
+    libcromfs_ino_t entry_ino;
+    while(libcromfs_readdir(dir, &name, &entry_ino) > 0)
+        got.push_back(name);
+    libcromfs_closedir(dir);
+
+    if(got != expected)
+        FAIL("%s: listing differs (%u entries vs %u)", path.c_str(),
+             (unsigned)got.size(), (unsigned)expected.size());
+}
+
+static void CheckFile(libcromfs_image* image, const Entry& e, unsigned seed)
+{
+    libcromfs_ino_t ino;
+    struct stat st;
+    int r = libcromfs_resolve(image, e.path.c_str(), &ino);
+    if(r < 0) { FAIL("%s: resolve: %s", e.path.c_str(), std::strerror(-r)); return; }
+    r = libcromfs_stat(image, ino, &st);
+    if(r < 0) { FAIL("%s: stat: %s", e.path.c_str(), std::strerror(-r)); return; }
+    if(st.st_mode != e.st.st_mode
+    || (!S_ISDIR(st.st_mode) && st.st_size != e.st.st_size))
+        FAIL("%s: attributes differ", e.path.c_str());
+    if(!S_ISREG(st.st_mode) && !S_ISLNK(st.st_mode)) return;
+
+    libcromfs_file* file;
+    r = libcromfs_open(image, ino, &file);
+    if(r < 0) { FAIL("%s: open: %s", e.path.c_str(), std::strerror(-r)); return; }
+
+    const size_t size = e.data.size();
+    for(unsigned round = 0; round < 50; ++round)
+    {
+        const size_t offset = rand_r(&seed) % (size + 10);
+        const size_t length = rand_r(&seed) % 20000;
+        const size_t expect = offset < size ? std::min(length, size - offset) : 0;
+        std::vector<unsigned char> buf(length + 1, 0xAA);
+
+        ssize_t n;
+        if(round & 1)
+        {
+            n = libcromfs_pread(file, &buf[0], length, offset);
+        }
+        else
+        {
+            /* Scatter into random pieces, some of them empty. */
+            std::vector<struct iovec> iov;
+            for(size_t pos = 0; pos < length; )
+            {
+                struct iovec v;
+                v.iov_base = &buf[pos];
+                v.iov_len  = std::min(length - pos, (size_t)(rand_r(&seed) % 3000));
+                iov.push_back(v);
+                pos += v.iov_len;
+            }
+            n = libcromfs_preadv(file, iov.empty() ? 0 : &iov[0], iov.size(), offset);
+        }
+        if(n != (ssize_t)expect
+        || (expect && std::memcmp(&buf[0], &e.data[offset], expect) != 0)
+        || buf[length] != 0xAA)
+        {
+            FAIL("%s: wrong data at %u..+%u (%d bytes)", e.path.c_str(),
+                 (unsigned)offset, (unsigned)length, (int)n);
+            break;
+        }
+    }
+    libcromfs_close(file);
+}
+
+int main(int argc, char** argv)
+{
+    if(argc != 3)
+    {
+        std::printf("Usage: test-libcromfs <image> <source dir>\n");
+        return 1;
+    }
+    std::vector<Entry> entries;
+    ReadSource(argv[2], "", entries);
+
+    /* Small enough that the images keep evicting each other's fblocks. */
+    libcromfs_cache* cache = libcromfs_cache_new(65536);
+    libcromfs_image* images[2];
+    for(unsigned a=0; a<2; ++a)
+    {
+        int r = libcromfs_open_image(argv[1], cache, &images[a]);
+        if(r < 0) { std::printf("%s: %s\n", argv[1], std::strerror(-r)); return 1; }
+    }
+
+    CheckListing(images[0], "", entries);
+    for(size_t a=0; a<entries.size(); ++a)
+        if(S_ISDIR(entries[a].st.st_mode))
+            CheckListing(images[1], entries[a].path, entries);
+
+  #pragma omp parallel for schedule(dynamic)
+    for(long n=0; n<(long)entries.size() * 8; ++n)
+        CheckFile(images[n % 2], entries[n / 8], n);
+
+    /* The errors. */
+    libcromfs_ino_t ino;
+    libcromfs_file* file;
+    libcromfs_dir* dir;
+    if(libcromfs_resolve(images[0], "/nonexistent", &ino) != -ENOENT)
+        FAIL("resolve of a missing file did not give ENOENT");
+    if(libcromfs_resolve(images[0], "md5.hh/x", &ino) != -ENOTDIR)
+        FAIL("resolve through a file did not give ENOTDIR");
+    if(libcromfs_resolve(images[0], "dir2/../../md5.hh", &ino) < 0)
+        FAIL("resolve with .. failed");
+    else if(libcromfs_opendir(images[0], ino, &dir) != -ENOTDIR)
+        FAIL("opendir of a file did not give ENOTDIR");
+    if(libcromfs_open(images[0], LIBCROMFS_ROOT_INO, &file) != -EISDIR)
+        FAIL("open of a directory did not give EISDIR");
+    if(libcromfs_open_image(argv[2], cache, &images[0]) >= 0)
+        FAIL("a directory was opened as an image");
+
+    /* The remaining image must not be disturbed by closing the other. */
+    libcromfs_close_image(images[0]);
+  #pragma omp parallel for schedule(dynamic)
+    for(long n=0; n<(long)entries.size(); ++n)
+        CheckFile(images[1], entries[n], n);
+    libcromfs_close_image(images[1]);
+    libcromfs_cache_free(cache);
+
+    std::printf("%u errors\n", errors);
+    return errors ? 1 : 0;
+}
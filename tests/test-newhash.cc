@@ -0,0 +1,98 @@
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <sys/time.h>
+#include "../lib/newhash.h"
+
+/* Checks that newhash_calc_multi() and newhash64_calc_multi() give
+ * the same hashes as newhash_calc() and newhash64_calc(),
+ * whatever the sizes and alignments, and reports how fast both are,
+ * so that a slowdown in either is noticed.
+ */
+static double Now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static void Benchmark(const std::vector<unsigned char>& data, unsigned long bsize)
+{
+    const unsigned long count = data.size() / bsize;
+    std::vector<const unsigned char*> bufs(count);
+    std::vector<unsigned long> sizes(count, bsize);
+    std::vector<newhash_t> results(count);
+    for(unsigned long a=0; a<count; ++a) bufs[a] = &data[a * bsize];
+
+    const unsigned rounds = 8;
+    newhash_t sum = 0;
+    double begin = Now();
+    for(unsigned r=0; r<rounds; ++r)
+        for(unsigned long a=0; a<count; ++a)
+            sum += newhash_calc(bufs[a], bsize);
+    const double scalar = Now() - begin;
+
+    begin = Now();
+    for(unsigned r=0; r<rounds; ++r)
+    {
+        newhash_calc_multi(&results[0], &bufs[0], &sizes[0], count);
+        for(unsigned long a=0; a<count; ++a) sum -= results[a];
+    }
+    const double multi = Now() - begin;
+
+    const double bytes = (double)rounds * count * bsize;
+    std::printf("bsize %6lu: newhash_calc %6.2f GB/s, newhash_calc_multi %6.2f GB/s%s\n",
+        bsize, bytes / scalar * 1e-9, bytes / multi * 1e-9,
+        sum ? " (MISMATCH)" : "");
+}
+
+int main()
+{
+    std::vector<unsigned char> data(64 << 20);
+    unsigned seed = 1;
+    for(size_t a=0; a<data.size(); ++a) data[a] = rand_r(&seed) >> 7;
+
+    unsigned errors = 0;
+    for(unsigned round = 0; round < 20000; ++round)
+    {
+        /* Sometimes all the same size, like blocks; sometimes not. */
+        const unsigned long count = 1 + rand_r(&seed) % 11;
+        const unsigned long common = rand_r(&seed) % 5000;
+        const bool same = rand_r(&seed) & 1;
+
+        std::vector<const unsigned char*> bufs(count);
+        std::vector<unsigned long> sizes(count);
+        std::vector<newhash_t> results(count), expect(count);
+        for(unsigned long a=0; a<count; ++a)
+        {
+            sizes[a]   = same ? common : rand_r(&seed) % 5000;
+            bufs[a]    = &data[rand_r(&seed) % (data.size() - 5000)];
+            results[a] = (round & 2) ? rand_r(&seed) : 0;
+            expect[a]  = newhash_calc_upd(results[a], bufs[a], sizes[a]);
+        }
+        if(round & 2)
+            newhash_calc_multi_upd(&results[0], &bufs[0], &sizes[0], count);
+        else
+            newhash_calc_multi(&results[0], &bufs[0], &sizes[0], count);
+
+        for(unsigned long a=0; a<count; ++a)
+            if(results[a] != expect[a] && errors++ < 20)
+                std::printf("Round %u: hash %lu of %lu (%lu bytes) is %08X, should be %08X\n",
+                    round, a, count, sizes[a],
+                    (unsigned)results[a], (unsigned)expect[a]);
+
+        std::vector<newhash64_t> results64(count);
+        newhash64_calc_multi(&results64[0], &bufs[0], &sizes[0], count);
+        for(unsigned long a=0; a<count; ++a)
+            if(results64[a] != newhash64_calc(bufs[a], sizes[a]) && errors++ < 20)
+                std::printf("Round %u: 64-bit hash %lu of %lu (%lu bytes) differs\n",
+                    round, a, count, sizes[a]);
+    }
+
+    Benchmark(data, 65536);
+    Benchmark(data, 4096);
+    Benchmark(data, 256);
+
+    std::printf("%u errors\n", errors);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,96 @@
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <fcntl.h>
+#include "../lib/sparsewrite.hh"
+
+/* Checks that is_zero_block() tells exactly which blocks are all
+ * zeros, and that SparseWrite() writes the same file as pwrite() would,
+ * at any alignment, whatever mix of zero and nonzero data it is given.
+ * Like in mkcromfs, every range is written only once.
+ */
+static unsigned errors = 0;
+
+static void Fill(std::vector<unsigned char>& data, unsigned& seed)
+{
+    /* Runs of zeros, of bytes that are never zero, and of random bytes. */
+    for(size_t pos = 0; pos < data.size(); )
+    {
+        const size_t run = std::min(data.size() - pos, (size_t)(rand_r(&seed) % 4000));
+        const unsigned kind = rand_r(&seed) % 3;
+        for(size_t a=0; a<run; ++a)
+            data[pos+a] = kind == 0 ? 0
+                        : kind == 1 ? 1 + rand_r(&seed) % 255
+                        : rand_r(&seed);
+        pos += run;
+    }
+}
+
+int main()
+{
+    unsigned seed = 1;
+
+    for(unsigned round = 0; round < 10000; ++round)
+    {
+        /* All zeros; one nonzero byte; or no zero bytes at all. */
+        std::vector<unsigned char> data(1 + rand_r(&seed) % 3000, 0);
+        if(round % 3 == 1)
+            data[rand_r(&seed) % data.size()] = 1 + rand_r(&seed) % 255;
+        if(round % 3 == 2)
+            for(size_t a=0; a<data.size(); ++a) data[a] = 1 + rand_r(&seed) % 255;
+
+        const size_t begin = rand_r(&seed) % data.size();
+        bool expect = true;
+        for(size_t a=begin; a<data.size(); ++a) if(data[a]) expect = false;
+
+        if(is_zero_block(&data[begin], data.size() - begin) != expect && errors++ < 20)
+            std::printf("is_zero_block(%u bytes) gave %d\n",
+                (unsigned)(data.size() - begin), !expect);
+    }
+    if(!is_zero_block(0, 0) && errors++ < 20)
+        std::printf("is_zero_block() of nothing was false\n");
+
+    char fn[] = "/tmp/test-sparsewrite-XXXXXX";
+    const int fd = mkstemp(fn);
+    if(fd < 0) { std::perror(fn); return 1; }
+    unlink(fn);
+
+    std::vector<unsigned char> expect;
+    for(unsigned round = 0; round < 2000; ++round)
+    {
+        /* A gap of zeros, then a piece at any alignment. */
+        const size_t pos = expect.size() + rand_r(&seed) % 3000;
+        std::vector<unsigned char> data(rand_r(&seed) % 10000);
+        Fill(data, seed);
+        expect.resize(pos, 0);
+        expect.insert(expect.end(), data.begin(), data.end());
+
+        if(!SparseWrite(fd, data.empty() ? 0 : &data[0], data.size(), pos)
+        && errors++ < 20)
+            std::printf("SparseWrite(%u bytes at %u) failed\n",
+                (unsigned)data.size(), (unsigned)pos);
+    }
+    if(ftruncate(fd, expect.size()) < 0) { std::perror("ftruncate"); return 1; }
+
+    std::vector<unsigned char> got(expect.size());
+    if(pread(fd, &got[0], got.size(), 0) != (ssize_t)got.size())
+    {
+        std::printf("cannot read back the file\n");
+        ++errors;
+    }
+    else
+        for(size_t a=0; a<got.size(); ++a)
+            if(got[a] != expect[a])
+            {
+                if(errors++ < 20)
+                    std::printf("Byte %u is %02X, should be %02X\n",
+                        (unsigned)a, got[a], expect[a]);
+                break;
+            }
+    close(fd);
+
+    std::printf("%u errors\n", errors);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,547 @@
+#define _LARGEFILE64_SOURCE
+#define __STDC_CONSTANT_MACROS
+
+#include "../cromfs.hh"
+#include "lib/util.hh"
+
+#ifdef _OPENMP
+# include <omp.h>
+#endif
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstdio>
+#include <errno.h>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <sys/stat.h>
+
+#include <getopt.h>
+
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+
+/* benchcromfs: Measures the reading side of cromfs, by driving the
+ * cromfs class directly with a chosen workload, without Fuse.
+ *
+ * The image is first walked with one cromfs object to find out what
+ * is in it. The workload is then run from several threads on another,
+ * freshly created cromfs object, so that it begins with cold caches
+ * (as far as the page cache of the image allows).
+ */
+
+enum WorkloadType { W_SEQ, W_RANDOM, W_STAT, W_WALK, W_TRACE };
+static const char* const WorkloadNames[] = { "seq", "random", "stat", "walk", "trace" };
+
+static WorkloadType  Workload   = W_SEQ;
+static unsigned      UseThreads = 1;
+static unsigned      Passes     = 1;
+static uint_fast64_t NumOps     = 100000;
+static uint_fast32_t ReadSize   = 0; // 0 = the default of the workload
+static unsigned      Seed       = 1;
+static bool          UseMap     = false;
+static bool          ShowStats  = true;
+static std::string   TraceFile;
+
+/* Monotonic time in nanoseconds. */
+static uint_fast64_t GetTimeNanos()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* What the setup walk found in the image. */
+struct Entry
+{
+    std::string           path;
+    std::string           name;
+    cromfs_inodenum_t     inonum;
+    cromfs_inodenum_t     parent;
+    cromfs_inode_internal inode; // With the block list, for regular files
+};
+static std::vector<Entry> entries;
+static std::vector<size_t> files; // Indexes of regular files in entries
+static std::vector<size_t> dirs;  // Indexes of directories in entries
+static std::map<std::string, size_t> entry_by_path;
+
+static void Walk(cromfs& fs, cromfs_inodenum_t dirnum, const std::string& path)
+{
+    const cromfs_dirinfo dirinfo = fs.read_dir(dirnum, 0, ~(uint_fast32_t)0);
+    for(cromfs_dirinfo::const_iterator i = dirinfo.begin(); i != dirinfo.end(); ++i)
+    {
+        Entry e;
+        e.path   = path + "/" + i->first;
+        e.name   = i->first;
+        e.inonum = i->second;
+        e.parent = dirnum;
+        e.inode  = fs.read_inode(e.inonum);
+        if(S_ISREG(e.inode.mode)) e.inode = fs.read_inode_and_blocks(e.inonum);
+
+        const size_t index = entries.size();
+        entries.push_back(e);
+        entry_by_path[e.path] = index;
+
+        if(S_ISDIR(e.inode.mode))
+        {
+            dirs.push_back(index);
+            Walk(fs, e.inonum, e.path);
+        }
+        else if(S_ISREG(e.inode.mode))
+            files.push_back(index);
+    }
+}
+
+/* One operation of a recorded trace. */
+struct TraceOp
+{
+    enum { READ, STAT, READDIR } type;
+    size_t        entry;
+    uint_fast64_t offset;
+    uint_fast32_t length;
+};
+static std::vector<TraceOp> trace;
+
+/* Trace lines are "read <path> <offset> <length>", "stat <path>"
+ * and "readdir <path>". The paths begin with a slash and may not
+ * contain spaces. Empty lines and lines beginning with # are ignored.
+ */
+static bool LoadTrace(const std::string& filename)
+{
+    FILE* fp = std::fopen(filename.c_str(), "r");
+    if(!fp) { std::perror(filename.c_str()); return false; }
+
+    char Buf[8192];
+    unsigned lineno = 0;
+    while(std::fgets(Buf, sizeof(Buf), fp))
+    {
+        ++lineno;
+        char type[64], path[4096];
+        unsigned long long offset = 0, length = 0;
+        if(Buf[0] == '#' || std::sscanf(Buf, "%63s", type) != 1) continue;
+        const int n = std::sscanf(Buf, "%63s %4095s %llu %llu", type, path, &offset, &length);
+
+        TraceOp op;
+        if(n == 4 && !std::strcmp(type, "read"))         op.type = TraceOp::READ;
+        else if(n >= 2 && !std::strcmp(type, "stat"))    op.type = TraceOp::STAT;
+        else if(n >= 2 && !std::strcmp(type, "readdir")) op.type = TraceOp::READDIR;
+        else
+        {
+            std::fprintf(stderr, "%s:%u: syntax error\n", filename.c_str(), lineno);
+            std::fclose(fp);
+            return false;
+        }
+        std::map<std::string, size_t>::const_iterator i = entry_by_path.find(path);
+        if(i == entry_by_path.end())
+        {
+            std::fprintf(stderr, "%s:%u: %s is not in the image\n", filename.c_str(), lineno, path);
+            continue;
+        }
+        op.entry  = i->second;
+        op.offset = offset;
+        op.length = length;
+        trace.push_back(op);
+    }
+    std::fclose(fp);
+    return true;
+}
+
+/* The results of one thread. */
+struct ThreadResult
+{
+    std::vector<uint_least32_t> latencies; // nanoseconds, saturated
+    uint_fast64_t bytes;
+    uint_fast64_t errors;
+
+    ThreadResult() : latencies(), bytes(0), errors(0) { }
+};
+
+class Runner
+{
+public:
+    Runner(cromfs& f, ThreadResult& r) : fs(f), result(r), buffer(), begin(0) { }
+
+    void Read(const cromfs_inode_internal& inode, uint_fast64_t offset, uint_fast32_t length)
+    {
+        if(buffer.size() < length) buffer.resize(length);
+        Begin();
+        try
+        {
+            int_fast64_t n;
+            if(UseMap)
+            {
+                std::vector<cromfs_data_segment> segments;
+                n = fs.map_file_data(inode, offset, length, segments);
+            }
+            else
+                n = fs.read_file_data(inode, offset, &buffer[0], length, "bench");
+            result.bytes += n;
+        }
+        catch(cromfs_exception)      { ++result.errors; }
+        catch(const std::bad_alloc&) { ++result.errors; }
+        End();
+    }
+
+    void Stat(const Entry& e)
+    {
+        /* What the kernel asks for when a path is stat()ed. */
+        Begin();
+        try
+        {
+            const cromfs_inodenum_t inonum = fs.dir_lookup(e.parent, e.name);
+            if(inonum != e.inonum) ++result.errors;
+            else fs.read_inode(inonum);
+        }
+        catch(cromfs_exception)      { ++result.errors; }
+        catch(const std::bad_alloc&) { ++result.errors; }
+        End();
+    }
+
+    void ReadDir(cromfs_inodenum_t inonum)
+    {
+        /* What "ls -l" needs: the entries and their attributes. */
+        Begin();
+        try
+        {
+            const cromfs_dirinfo dirinfo = fs.read_dir(inonum, 0, ~(uint_fast32_t)0);
+            std::vector<cromfs_inodenum_t> inonums;
+            std::vector<cromfs_inode_internal> inodes;
+            for(cromfs_dirinfo::const_iterator i = dirinfo.begin(); i != dirinfo.end(); ++i)
+                inonums.push_back(i->second);
+            fs.read_inodes(inonums, inodes);
+        }
+        catch(cromfs_exception)      { ++result.errors; }
+        catch(const std::bad_alloc&) { ++result.errors; }
+        End();
+    }
+
+    void Prefetch(const cromfs_inode_internal& inode, uint_fast64_t offset)
+    {
+        try { fs.prefetch_file_data(inode, offset); }
+        catch(cromfs_exception)      { }
+        catch(const std::bad_alloc&) { }
+    }
+
+private:
+    void Begin() { begin = GetTimeNanos(); }
+    void End()
+    {
+        const uint_fast64_t t = GetTimeNanos() - begin;
+        result.latencies.push_back(t > 0xFFFFFFFFUL ? 0xFFFFFFFFUL : t);
+    }
+
+private:
+    cromfs&       fs;
+    ThreadResult& result;
+    std::vector<unsigned char> buffer;
+    uint_fast64_t begin;
+};
+
+/* Picks a random file position, so that each byte
+ * of the files is equally likely to be picked. */
+static size_t PickFile(const std::vector<uint_fast64_t>& cumulative, unsigned& seed,
+                       uint_fast64_t& offset)
+{
+    const uint_fast64_t r = ((uint_fast64_t)rand_r(&seed) << 31 | rand_r(&seed))
+                          % cumulative.back();
+    const size_t f = std::upper_bound(cumulative.begin(), cumulative.end(), r) - cumulative.begin();
+    offset = r - (f ? cumulative[f-1] : 0);
+    return f;
+}
+
+static void RunThread(cromfs& fs, unsigned threadno, volatile long& next, ThreadResult& result)
+{
+    Runner run(fs, result);
+    unsigned seed = Seed + threadno * 7919;
+
+    switch(Workload)
+    {
+        case W_SEQ:
+        {
+            /* Each thread reads whole files in order, in read() sized pieces,
+             * and prefetches like cromfs-driver does for sequential readers. */
+            const uint_fast32_t size = ReadSize ? ReadSize : 131072;
+            for(long n; (n = __sync_fetch_and_add(&next, 1)) < (long)(files.size() * Passes); )
+            {
+                const cromfs_inode_internal& inode = entries[files[n % files.size()]].inode;
+                for(uint_fast64_t pos = 0; pos < inode.bytesize; pos += size)
+                {
+                    run.Read(inode, pos, size);
+                    if(pos > 0) run.Prefetch(inode, pos + size);
+                }
+            }
+            break;
+        }
+        case W_RANDOM:
+        {
+            const uint_fast32_t size = ReadSize ? ReadSize : 4096;
+            std::vector<uint_fast64_t> cumulative(files.size());
+            uint_fast64_t total = 0;
+            for(size_t a=0; a<files.size(); ++a)
+                cumulative[a] = total += entries[files[a]].inode.bytesize;
+            if(!total) break;
+
+            while(__sync_fetch_and_add(&next, 1) < (long)NumOps)
+            {
+                uint_fast64_t offset;
+                const size_t f = PickFile(cumulative, seed, offset);
+                run.Read(entries[files[f]].inode, offset - offset % size, size);
+            }
+            break;
+        }
+        case W_STAT:
+        {
+            for(long n; (n = __sync_fetch_and_add(&next, 1)) < (long)(entries.size() * Passes); )
+                run.Stat(entries[n % entries.size()]);
+            break;
+        }
+        case W_WALK:
+        {
+            /* The root directory is not in entries. */
+            const long count = dirs.size() + 1;
+            for(long n; (n = __sync_fetch_and_add(&next, 1)) < count * (long)Passes; )
+            {
+                const long d = n % count;
+                run.ReadDir(d == 0 ? 1 : entries[dirs[d-1]].inonum);
+            }
+            break;
+        }
+        case W_TRACE:
+        {
+            for(long n; (n = __sync_fetch_and_add(&next, 1)) < (long)(trace.size() * Passes); )
+            {
+                const TraceOp& op = trace[n % trace.size()];
+                const Entry& e = entries[op.entry];
+                switch(op.type)
+                {
+                    case TraceOp::READ:
+                        if(S_ISREG(e.inode.mode)) run.Read(e.inode, op.offset, op.length);
+                        break;
+                    case TraceOp::STAT:
+                        run.Stat(e);
+                        break;
+                    case TraceOp::READDIR:
+                        if(S_ISDIR(e.inode.mode)) run.ReadDir(e.inonum);
+                        break;
+                }
+            }
+            break;
+        }
+    }
+}
+
+static void PrintResults(const std::vector<ThreadResult>& results, double seconds)
+{
+    std::vector<uint_least32_t> latencies;
+    uint_fast64_t bytes = 0, errors = 0;
+    for(size_t a=0; a<results.size(); ++a)
+    {
+        latencies.insert(latencies.end(), results[a].latencies.begin(), results[a].latencies.end());
+        bytes  += results[a].bytes;
+        errors += results[a].errors;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    uint_fast64_t total_ns = 0;
+    for(size_t a=0; a<latencies.size(); ++a) total_ns += latencies[a];
+
+    std::printf("bench.workload %s\n", WorkloadNames[Workload]);
+    std::printf("bench.threads %u\n", UseThreads);
+    std::printf("bench.ops %lu\n", (unsigned long)latencies.size());
+    std::printf("bench.errors %lu\n", (unsigned long)errors);
+    std::printf("bench.seconds %.3f\n", seconds);
+    std::printf("bench.ops_per_sec %.1f\n", latencies.size() / seconds);
+    std::printf("bench.bytes %llu\n", (unsigned long long)bytes);
+    std::printf("bench.mb_per_sec %.2f\n", bytes / seconds / 1e6);
+    if(latencies.empty()) return;
+
+    static const struct { const char* name; double fraction; } percentiles[] =
+    {
+        { "p50", 0.50 }, { "p90", 0.90 }, { "p99", 0.99 }, { "p999", 0.999 }
+    };
+    std::printf("bench.latency_usec_mean %.2f\n", total_ns / 1e3 / latencies.size());
+    for(unsigned a=0; a<sizeof(percentiles)/sizeof(*percentiles); ++a)
+    {
+        const size_t index = (size_t)(percentiles[a].fraction * (latencies.size()-1));
+        std::printf("bench.latency_usec_%s %.2f\n", percentiles[a].name, latencies[index] / 1e3);
+    }
+    std::printf("bench.latency_usec_max %.2f\n", latencies.back() / 1e3);
+}
+
+int main(int argc, char** argv)
+{
+    for(;;)
+    {
+        int option_index = 0;
+        static struct option long_options[] =
+        {
+            {"help",        0, 0,'h'},
+            {"version",     0, 0,'V'},
+            {"workload",    1, 0,'w'},
+            {"threads",     1, 0,'t'},
+            {"passes",      1, 0,'p'},
+            {"ops",         1, 0,'n'},
+            {"size",        1, 0,'s'},
+            {"trace",       1, 0,'T'},
+            {"seed",        1, 0,5001},
+            {"map",         0, 0,5002},
+            {"nostats",     0, 0,5003},
+            {"fblock-cache",1, 0,5004},
+            {"readdir-cache",1,0,5005},
+            {"inodetab",    0, 0,5006},
+            {"mmap",        0, 0,5007},
+            {"prefetch",    1, 0,5008},
+            {"disk-cache",  1, 0,5009},
+            {0,0,0,0}
+        };
+        int c = getopt_long(argc, argv, "hVw:t:p:n:s:T:", long_options, &option_index);
+        if(c==-1) break;
+        switch(c)
+        {
+            case 'V':
+            {
+                std::printf("%s\n", VERSION);
+                return 0;
+            }
+            case 'h':
+            {
+                std::printf(
+                    "benchcromfs v" VERSION " - Copyright (C) 1992,2014 Bisqwit (http://iki.fi/bisqwit/)\n"
+                    "\n"
+                    "Measures how fast a cromfs image can be read, without mounting it.\n"
+                    "The results are printed as lines of \"name value\", followed by\n"
+                    "the statistics of the filesystem engine.\n"
+                    "\n"
+                    "Usage: benchcromfs [<options>] <image>\n"
+                    " --help, -h         This help\n"
+                    " --version, -V      Displays version information\n"
+                    " --workload, -w <name>\n"
+                    "                    seq:    read every file from start to end (default)\n"
+                    "                    random: read random aligned pieces of the files\n"
+                    "                    stat:   look up and stat every file\n"
+                    "                    walk:   list every directory, with attributes\n"
+                    "                    trace:  replay the operations in --trace\n"
+                    " --threads, -t <n>  Run the workload with n threads (default: 1)\n"
+                    " --passes, -p <n>   Repeat seq, stat, walk and trace n times (default: 1)\n"
+                    " --ops, -n <n>      Number of reads in the random workload (default: 100000)\n"
+                    " --size, -s <bytes> Size of each read (default: 131072 for seq, 4096 for random)\n"
+                    " --trace, -T <file> The operations to replay, one per line:\n"
+                    "                    \"read <path> <offset> <length>\", \"stat <path>\"\n"
+                    "                    or \"readdir <path>\"\n"
+                    " --seed <n>         Seed for the random workload\n"
+                    " --map              Read with map_file_data() (as cromfs-driver does\n"
+                    "                    with Fuse 2.7 and later) instead of read_file_data()\n"
+                    " --nostats          Do not print the statistics of the engine\n"
+                    " --fblock-cache <MB>, --readdir-cache <MB>, --inodetab, --mmap,\n"
+                    " --prefetch <n>, --disk-cache <file>\n"
+                    "                    Like the corresponding -o options of cromfs-driver\n"
+                    "\n");
+                return 0;
+            }
+            case 'w':
+            {
+                unsigned a;
+                for(a=0; a<sizeof(WorkloadNames)/sizeof(*WorkloadNames); ++a)
+                    if(!std::strcmp(optarg, WorkloadNames[a])) break;
+                if(a == sizeof(WorkloadNames)/sizeof(*WorkloadNames))
+                {
+                    std::fprintf(stderr, "benchcromfs: Unknown workload: %s\n", optarg);
+                    return -1;
+                }
+                Workload = (WorkloadType)a;
+                break;
+            }
+            case 't':
+            {
+                long size = std::strtol(optarg, 0, 10);
+                if(size < 1 || size > 1024)
+                {
+                    std::fprintf(stderr, "benchcromfs: Threads value may be 1..1024. You gave %ld.\n", size);
+                    return -1;
+                }
+                UseThreads = size;
+                break;
+            }
+            case 'p': Passes = std::max(1L, std::strtol(optarg, 0, 10)); break;
+            case 'n': NumOps = std::strtoull(optarg, 0, 10); break;
+            case 's': ReadSize = std::max(1L, std::strtol(optarg, 0, 10)); break;
+            case 'T': TraceFile = optarg; Workload = W_TRACE; break;
+            case 5001: Seed = std::strtoul(optarg, 0, 10); break;
+            case 5002: UseMap = true; break;
+            case 5003: ShowStats = false; break;
+            case 5004: FBLOCK_CACHE_MAX_BYTES  = std::strtoul(optarg, 0, 10) * (size_t)1048576; break;
+            case 5005: READDIR_CACHE_MAX_BYTES = std::strtoul(optarg, 0, 10) * (size_t)1048576; break;
+            case 5006: USE_INODE_TABLE = true; break;
+            case 5007: USE_MMAP = true; break;
+            case 5008: PREFETCH_FBLOCKS = std::strtoul(optarg, 0, 10); break;
+            case 5009: DISK_CACHE_FILE = optarg; break;
+        }
+    }
+
+    if(argc != optind+1)
+    {
+        std::fprintf(stderr, "benchcromfs: invalid parameters. See `benchcromfs --help'\n");
+        return 1;
+    }
+    const char* fsfile = argv[optind];
+
+    int fd = open(fsfile, O_RDONLY | O_LARGEFILE);
+    if(fd < 0) { std::perror(fsfile); return -1; }
+
+    try
+    {
+        /* The setup walk must not warm up the caches of the measured object. */
+        {
+            const std::string disk_cache = DISK_CACHE_FILE;
+            DISK_CACHE_FILE.clear();
+            cromfs setup(fd);
+            setup.Initialize();
+            Walk(setup, 1, "");
+            DISK_CACHE_FILE = disk_cache;
+        }
+        if(Workload == W_TRACE)
+        {
+            if(TraceFile.empty())
+            {
+                std::fprintf(stderr, "benchcromfs: The trace workload needs --trace.\n");
+                return -1;
+            }
+            if(!LoadTrace(TraceFile)) return -1;
+        }
+
+        cromfs fs(fd);
+        fs.Initialize();
+
+        std::vector<ThreadResult> results(UseThreads);
+        volatile long next = 0;
+        const uint_fast64_t begin = GetTimeNanos();
+
+        /* Exceptions must not leave the OpenMP region. RunThread()
+         * catches those of the operations; anything else is fatal. */
+      #pragma omp parallel for num_threads(UseThreads) schedule(static,1)
+        for(long t=0; t<(long)UseThreads; ++t)
+            RunThread(fs, t, next, results[t]);
+
+        const double seconds = (GetTimeNanos() - begin) / 1e9;
+
+        PrintResults(results, seconds);
+        if(ShowStats) std::printf("%s", fs.GetStatistics().c_str());
+    }
+    catch(cromfs_exception e)
+    {
+        errno=e;
+        std::perror("cromfs");
+        return -1;
+    }
+    catch(const std::bad_alloc&)
+    {
+        errno=ENOMEM;
+        std::perror("cromfs");
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
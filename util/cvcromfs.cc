@@ -2,6 +2,7 @@
 #define __STDC_CONSTANT_MACROS
 
 #include "lzma.hh"
+#include "cromfs-fblockcodec.hh"
 #include "cromfs-defs.hh"
 #include "longfileread.hh"
 #include "longfilewrite.hh"
@@ -159,7 +160,7 @@ static uint_fast64_t ConvertBuffer
 
     if(was_compressed && (!want_compressed || recompress || touch_block.NeedsData()))
     {
-        Buffer = LZMADeCompress(Buffer);
+        Buffer = FblockDeCompress(Buffer);
         was_compressed = false;
     }
 
@@ -324,6 +325,12 @@ static bool Convert(const std::string& fsfile, const std::string& outfn,
     std::printf("\n");
     std::fflush(stdout);
 
+    if(old_storage_opts & CROMFS_OPT_CHUNKED_BLKTAB)
+    {
+        std::fprintf(stderr, "Error: Converting a chunked block table (mkcromfs --blktabchunk) is not supported\n");
+        goto ErrorExit;
+    }
+
     std::printf("Converting the block table...\n- ");
     BlkTabConverter ConvertBlkTab;
     ConvertBlkTab.HadPacked = old_storage_opts & CROMFS_OPT_PACKED_BLOCKS;
@@ -355,6 +362,11 @@ static bool Convert(const std::string& fsfile, const std::string& outfn,
 
     sblock.fblktab_offs = write_offs;
 
+    /* The fblocks may change size, so the fblock directory is not kept. */
+    sblock.fblkdir_offs = write_offs;
+    sblock.fblkdir_size = 0;
+    sblock.fblkdir_room = 0;
+
     for(unsigned fblockno=0;;)
     {
         if(read_offs >= read_end) break;
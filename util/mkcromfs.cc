@@ -35,6 +35,7 @@
 #include "sparsewrite.hh"
 
 #include "lzma.hh"
+#include "cromfs-fblockcodec.hh"
 #include "datasource.hh"
 #include "datasource_detail.hh"
 #include "cromfs-inodefun.hh"
@@ -53,6 +54,7 @@
 int LZMA_HeavyCompress = 1;
 bool SortByFilename = true;
 bool DecompressWhenLookup = false;
+bool CompressSealedFblocks = true;
 bool FollowSymlinks = false;
 unsigned UseThreads = 0;
 unsigned RandomCompressPeriod = 20000;
@@ -61,11 +63,17 @@ uint_fast32_t AutoIndexPeriod = 256; // once every 256 bytes
 uint_fast32_t MaxFblockCountForBruteForce = 2;
 uint_fast32_t OverlapGranularity = 1;
 bool MayPackBlocks = true;
+unsigned DirIndexMinEntries = 0;
+uint_fast32_t BlktabChunkBlocks = 0;
 bool MayAutochooseBlocknumSize = true;
 bool MaySuggestDecompression = true;
 std::string ReuseListFile;
 
 BlockHashingMethods BlockHashing_Method = BlockHashing_All;
+unsigned FingerprintBits = 32;
+
+ChunkingMethods Chunking_Method = Chunking_Fixed;
+uint_fast32_t CDCMinSize = 0, CDCAvgSize = 0, CDCMaxSize = 0; // 0 = by bsize
 
 
 long FSIZE = 2097152;
@@ -81,6 +89,11 @@ double BlktabInflateFactor  = 1;
 
 static MatchingFileListType exclude_files;
 
+/* Which fblocks to compress with something else than LZMA */
+static MatchingFileListType fastcodec_files;
+static CromfsFblockCodec FastCodec = CROMFS_FBLOCK_LZO;
+static unsigned LZMAMinimumGain = 0; // percent; 0 = always LZMA
+
 /* Order in which to parse different types of directory entries */
 static struct
 {
@@ -123,6 +136,47 @@ long CalcBSIZEfor(const std::string& pathfn)
     return result;
 }
 
+/* The time of the root directory and of inotab. SOURCE_DATE_EPOCH,
+ * if set, overrides the current time, so that an image can be built
+ * again bit for bit (see https://reproducible-builds.org/).
+ */
+static time_t CreationTime()
+{
+    const char* epoch = std::getenv("SOURCE_DATE_EPOCH");
+    if(epoch && *epoch) return std::strtoul(epoch, 0, 10);
+    return time(NULL);
+}
+
+bool UseFastCodecFor(const std::string& pathfn)
+{
+    return MatchFileFrom(pathfn, fastcodec_files, false);
+}
+
+/* Compresses the fblock with LZMA, unless it was asked to be
+ * compressed with the fast codec, or unless LZMA would save
+ * less than LZMAMinimumGain percent over the fast codec.
+ */
+const std::vector<unsigned char> CompressFblockData(
+    bool prefer_fast, const unsigned char* data, std::size_t length, const char* why)
+{
+    std::vector<unsigned char> fast;
+    if(prefer_fast || LZMAMinimumGain)
+    {
+        if(FastCodec == CROMFS_FBLOCK_LZO)
+            fast = LZOCompressFblock(data, length);
+        /* What LZO cannot shrink is stored as such. */
+        if(fast.empty() || fast.size() > length+1)
+            fast = StoreFblock(data, length);
+        if(prefer_fast) return fast;
+    }
+
+    std::vector<unsigned char> lzma = DoLZMACompress(LZMA_HeavyCompress, data, length, why);
+    if(LZMAMinimumGain
+    && lzma.size() * 100.0 > fast.size() * (100.0 - LZMAMinimumGain))
+        return fast;
+    return lzma;
+}
+
 namespace cromfs_creator
 {
     /*******************/
@@ -153,6 +207,91 @@ namespace cromfs_creator
         }
     }
 
+    /* Compresses the block table in chunks of chunk_blocks data
+     * locators each, so that they can be decompressed separately
+     * (see CHUNKED BLKDATA in doc/FORMAT). */
+    static const std::vector<unsigned char> CompressChunkedBlockTable
+        (const std::vector<unsigned char>& raw_blktab,
+         uint_fast32_t storage_opts,
+         int heavy_option,
+         uint_fast32_t chunk_blocks)
+    {
+        const unsigned onesize = DATALOCATOR_SIZE_BYTES();
+        const size_t chunk_bytes = chunk_blocks * (size_t)onesize;
+
+        const uint_fast32_t num_blocks = raw_blktab.size() / onesize;
+        const size_t num_chunks = (num_blocks + (size_t)chunk_blocks-1) / chunk_blocks;
+
+        std::vector< std::vector<unsigned char> > chunks(num_chunks);
+        #pragma omp parallel for schedule(dynamic)
+        for(long a=0; a<(long)num_chunks; ++a)
+        {
+            const size_t begin = a * chunk_bytes;
+            const size_t end   = std::min(raw_blktab.size(), begin + chunk_bytes);
+            chunks[a] = CompressBlockTable(
+                std::vector<unsigned char>(raw_blktab.begin()+begin, raw_blktab.begin()+end),
+                storage_opts, heavy_option);
+        }
+
+        std::vector<unsigned char> result(8 + (num_chunks+1) * 8);
+        put_32(&result[0], num_blocks);
+        put_32(&result[4], chunk_blocks);
+        for(size_t a=0; a<num_chunks; ++a)
+        {
+            put_64(&result[8 + a*8], result.size());
+            result.insert(result.end(), chunks[a].begin(), chunks[a].end());
+        }
+        put_64(&result[8 + num_chunks*8], result.size());
+        return result;
+    }
+
+    /* The fblock directory (FBLKDIR in doc/FORMAT) lists the compressed
+     * sizes of the fblocks, so that cromfs does not need to visit every
+     * fblock to find them. Its room is reserved before the fblocks are
+     * compressed, so it must allow for LZMA making it larger.
+     */
+    static uint_fast64_t FblockDirectoryRoom(size_t num_fblocks)
+    {
+        const uint_fast64_t raw_size = num_fblocks * UINT64_C(4);
+        return raw_size + raw_size / 8 + 256;
+    }
+
+    /* Writes the fblock directory into its room and updates the superblock.
+     * If it does not fit, the image is left without one.
+     */
+    static void WriteFblockDirectory(
+        int out_fd,
+        cromfs_superblock_internal& sblock,
+        const std::vector<uint_least32_t>& fblock_lengths)
+    {
+        if(fblock_lengths.empty()) return;
+
+        std::vector<unsigned char> raw_fblkdir(fblock_lengths.size() * 4);
+        for(size_t a=0; a<fblock_lengths.size(); ++a)
+            put_32(&raw_fblkdir[a*4], fblock_lengths[a]);
+
+        const std::vector<unsigned char> compressed = LZMACompress(raw_fblkdir, 2,2,0);
+        if(compressed.size() > sblock.fblkdir_room) return;
+
+        SparseWrite(out_fd, &compressed[0], compressed.size(), sblock.fblkdir_offs);
+        sblock.fblkdir_size = compressed.size();
+
+        cromfs_superblock_internal::BufferType Superblock;
+        sblock.WriteToBuffer(Superblock);
+        LongFileWrite(out_fd, 0, sblock.GetSize(), Superblock);
+    }
+
+    static const char* FblockCodecName(const std::vector<unsigned char>& data)
+    {
+        switch(GetFblockCodec(&data[0], data.size()))
+        {
+            case CROMFS_FBLOCK_LZO:    return " (lzo)";
+            case CROMFS_FBLOCK_STORED: return " (stored)";
+            case CROMFS_FBLOCK_LZMA:   break;
+        }
+        return "";
+    }
+
     static void FinalCompressFblock(
         cromfs_fblocknum_t fblocknum,
         cromfs_fblocknum_t fblockcount,
@@ -163,37 +302,46 @@ namespace cromfs_creator
         DataReadBuffer buf; uint_fast32_t fblock_rawlength;
         fblock.InitDataReadBuffer(buf, fblock_rawlength);
 
-        char why[512];std::sprintf(why,"fblock %u", (unsigned)fblocknum);
-        std::vector<unsigned char>
-            fblock_lzma = DoLZMACompress(LZMA_HeavyCompress, buf.Buffer,fblock_rawlength, why);
+        /* A sealed fblock may have been compressed already. */
+        std::vector<unsigned char> fblock_compressed = fblock.get_precompressed();
+        const bool was_precompressed = !fblock_compressed.empty();
+        if(!was_precompressed)
+        {
+            char why[512];std::sprintf(why,"fblock %u", (unsigned)fblocknum);
+            fblock_compressed = CompressFblockData(fblock.prefers_fast_codec(),
+                                                   buf.Buffer,fblock_rawlength, why);
+        }
 
         if(false)
         {
             bool is_ok = true;
-            LZMADeCompress(fblock_lzma, is_ok);
+            FblockDeCompress(fblock_compressed, is_ok);
             if(!is_ok)
             {
                 std::fprintf(stderr,
-                    "Error: LZMA compression produced invalid LZMA data!\n"
+                    "Error: Compression produced invalid data!\n"
                     "       This should never happen. Sorry.\n");
             }
         }
 
-        fblock.put_compressed(fblock_lzma);
+        fblock.put_compressed(fblock_compressed);
 
         if(DisplayEndProcess)
         {
-            std::printf(" [%ld/%ld] %u -> %u\n",
+            std::printf(" [%ld/%ld] %u -> %u%s%s\n",
                 (long)fblocknum, (long)fblockcount,
                 (unsigned)fblock_rawlength,
-                (unsigned)fblock_lzma.size());
+                (unsigned)fblock_compressed.size(),
+                FblockCodecName(fblock_compressed),
+                was_precompressed ? " (while blockifying)"
+              : fblock.is_sealed() ? " (compressed again)" : "");
             std::fflush(stdout);
         }
 
       #pragma omp atomic
         uncompressed_total += fblock_rawlength;
       #pragma omp atomic
-        compressed_total   += fblock_lzma.size();
+        compressed_total   += fblock_compressed.size();
     }
 
     struct DataSourceList
@@ -618,7 +766,7 @@ namespace cromfs_creator
                 // simulate that it was, in order to be able to create new
                 // inode numbers
                 if(S_ISDIR(ent.st.st_mode))
-                    ent.bytesize = calc_encoded_directory_size(*ent.dirinfo);
+                    ent.bytesize = calc_encoded_directory_size(*ent.dirinfo, DirIndexMinEntries);
                 uint_fast64_t num_blocks = CalcSizeInBlocks(ent.bytesize, CalcBSIZEfor(ent.pathname));
 
                 inotab_size += INODE_SIZE_BYTES(num_blocks);
@@ -711,7 +859,7 @@ namespace cromfs_creator
                 inode.links = dirinfo.size();
 
                 dataclass = DataClassOrder.Directory;
-                datasrc_for_blockify = NewVectorDatasource(encode_directory(dirinfo), pathname);
+                datasrc_for_blockify = NewVectorDatasource(encode_directory(dirinfo, DirIndexMinEntries), pathname);
             }
             else if(S_ISLNK(st.st_mode))
             {
@@ -824,14 +972,14 @@ namespace cromfs_creator
 
                 cromfs_inode_internal root_inode;
                 root_inode.mode  = S_IFDIR | 0555;
-                root_inode.time  = time(NULL);
+                root_inode.time  = CreationTime();
                 root_inode.links = dirinfo.size();
                 root_inode.uid   = 0;
                 root_inode.gid   = 0;
                 root_inode.blocksize = BSIZE;
 
                 datasource_t* datasrc =
-                    NewVectorDatasource(encode_directory(dirinfo), "root dir");
+                    NewVectorDatasource(encode_directory(dirinfo, DirIndexMinEntries), "root dir");
 
                 PutInodeSize(root_inode, datasrc->size());
 
@@ -883,7 +1031,7 @@ namespace cromfs_creator
             {
                 cromfs_inode_internal inotab_inode;
                 inotab_inode.mode = storage_opts;
-                inotab_inode.time = time(NULL);
+                inotab_inode.time = CreationTime();
                 inotab_inode.links = 1;
                 inotab_inode.blocksize = CalcBSIZEfor("INOTAB");
 
@@ -958,10 +1106,16 @@ namespace cromfs_creator
                 std::fflush(stdout);
             }
 
-            compressed_blktab
-                = CompressBlockTable(
-                    EncodeBlockTable(*blocks, storage_opts, FSIZE),
-                    storage_opts, LZMA_HeavyCompress);
+            if(storage_opts & CROMFS_OPT_CHUNKED_BLKTAB)
+                compressed_blktab
+                    = CompressChunkedBlockTable(
+                        EncodeBlockTable(*blocks, storage_opts, FSIZE),
+                        storage_opts, LZMA_HeavyCompress, BlktabChunkBlocks);
+            else
+                compressed_blktab
+                    = CompressBlockTable(
+                        EncodeBlockTable(*blocks, storage_opts, FSIZE),
+                        storage_opts, LZMA_HeavyCompress);
 
             if(DisplayEndProcess)
             {
@@ -985,6 +1139,10 @@ namespace cromfs_creator
         sblock.inotab_room  = uint_fast64_t(sblock.inotab_size  * InotabInflateFactor);
         sblock.blktab_room  = uint_fast64_t(sblock.blktab_size  * BlktabInflateFactor);
 
+        /* The fblock directory is written after the fblocks. */
+        sblock.fblkdir_size = 0;
+        sblock.fblkdir_room = FblockDirectoryRoom(fblocks.size());
+
         sblock.fsize          = FSIZE;
         sblock.bsize          = BSIZE;
         sblock.bytes_of_files = bytes_of_files;
@@ -1041,6 +1199,7 @@ namespace cromfs_creator
       #endif
 
         uint_fast64_t fblk_offset = sblock.fblktab_offs;
+        std::vector<uint_least32_t> fblock_lengths;
 
         /* Note: Using "long" for loop iteration variable, because OpenMP
          * requires the loop iteration variable to be of _signed_ type,
@@ -1074,11 +1233,11 @@ namespace cromfs_creator
             if(true)
             {
                 bool is_ok = true;
-                LZMADeCompress(lzma_buffer.Buffer, lzma_length, is_ok);
+                FblockDeCompress(lzma_buffer.Buffer, lzma_length, is_ok);
                 if(!is_ok)
                 {
                     std::fprintf(stderr,
-                        "Error: Compressed fblock %ld ended up being invalid LZMA data!\n"
+                        "Error: Compressed fblock %ld ended up being invalid data!\n"
                         "       This should never happen. Sorry.\n",
                         fblocknum);
                     terminate_for = true;
@@ -1094,6 +1253,7 @@ namespace cromfs_creator
             }
 
             SparseWrite(out_fd, lzma_buffer.Buffer, lzma_length, fblk_offset);
+            fblock_lengths.push_back(lzma_length);
 
             if(storage_opts & CROMFS_OPT_SPARSE_FBLOCKS)
             {
@@ -1141,6 +1301,8 @@ namespace cromfs_creator
 
         ftruncate64(out_fd, fblk_offset);
 
+        WriteFblockDirectory(out_fd, sblock, fblock_lengths);
+
         if(DisplayEndProcess)
         {
             uint_fast64_t file_size = fblk_offset;
@@ -1186,6 +1348,7 @@ namespace cromfs_creator
          * Not even the "ordered" OpenMP clause can help this.
          */
         bool error = false;
+        std::vector<uint_least32_t> fblock_lengths;
         for(size_t fblocknum=0; /*fblocknum<max_num_fblocks*/; ++fblocknum)
         {
             std::printf("checking the state of fblock %u... (supposedly at file position 0x%X)\n",
@@ -1206,14 +1369,15 @@ namespace cromfs_creator
 
                 bool is_ok = true;
 
-                /*if(fblocknum >= 190)*/ LZMADeCompress(fblockdata, is_ok);
+                /*if(fblocknum >= 190)*/ FblockDeCompress(fblockdata, is_ok);
                 if(!is_ok)
                 {
-                    std::printf(" but it is not valid LZMA data!\n");
+                    std::printf(" but it is not valid compressed data!\n");
                     error = true;
                     throw EINVAL;
                 }
 
+                fblock_lengths.push_back(fblock_lzma_size);
                 fblock_pos += fblock_lzma_size + 4;
                 continue;
             }
@@ -1250,6 +1414,7 @@ namespace cromfs_creator
                   LongFileWrite(out_fd, fblock_pos, 4, SizeBuffer); }
 
                 SparseWrite(out_fd, lzma_buffer.Buffer, lzma_length, fblock_pos+4);
+                fblock_lengths.push_back(lzma_length);
 
                 if(storage_opts & CROMFS_OPT_SPARSE_FBLOCKS)
                 {
@@ -1276,7 +1441,12 @@ namespace cromfs_creator
             }
         }
         std::printf("Done\n");
-        if(!error) ftruncate64(out_fd, fblock_pos);
+        if(!error)
+        {
+            ftruncate64(out_fd, fblock_pos);
+            if(sblock.fblkdir_room)
+                WriteFblockDirectory(out_fd, sblock, fblock_lengths);
+        }
 
         return 0;
     }
@@ -1551,10 +1721,19 @@ int main(int argc, char** argv)
             {"blockifyoptimizemethod",  1,0,3003},
             {"blockifyoptimisemethod",  1,0,3003},
             {"blockindexmethod",        1,0,3004},
+            {"chunking",                1,0,3005},
+            {"cdcsizes",                1,0,3006},
+            {"fingerprintbits",         1,0,3007},
+            {"latecompress",            0,0,3008},
             {"32bitblocknums",          0,0,'4'},
             {"24bitblocknums",          0,0,'3'},
             {"16bitblocknums",          0,0,'2'},
             {"nopackedblocks",          0,0,6001},
+            {"dirindex",                1,0,6002},
+            {"blktabchunk",             1,0,6003},
+            {"fastcodec",               1,0,6004},
+            {"fastfiles",               1,0,6005},
+            {"lzmamingain",             1,0,6006},
             {"lzmafastbytes",           1,0,4001},
             {"lzmabits",                1,0,4002},
             {"threads",                 1,0,4003},
@@ -1617,11 +1796,19 @@ int main(int argc, char** argv)
                     "     The value has no effect on the compression ratio of the filesystem,\n"
                     "     but smaller values mean slower filesystem creation and bigger values\n"
                     "     mean more diskspace used by temporary files.\n"
+                    " --latecompress\n"
+                    "     Compress every fblock in the final phase. By default, an fblock\n"
+                    "     is compressed as soon as nothing more can be added to it, which\n"
+                    "     needs some more memory and temporary diskspace.\n"
                     " --threads <value>\n"
                     "     Use the given number of threads.\n"
-                    "     The threads will be used in the substring finder and the fblock compressor.\n"
-                    "     This option only makes sense if the value is smaller\n"
-                    "     or equal to the value of --bruteforcelimit.\n"
+                    "     The threads read and hash the files ahead of the block placement,\n"
+                    "     and compress the fblocks, beginning with those that are full\n"
+                    "     while the blocks are still being placed. The blocks are placed\n"
+                    "     by one thread, in order, so the placement does not depend on the\n"
+                    "     number of threads. With \"--lzmabits auto\" or \"full\", the\n"
+                    "     threads also search the LZMA parameters, and the search may end\n"
+                    "     differently from run to run.\n"
                     "     Use 0 or 1 to disable threads. (Default)\n"
                     " --finish-interrupted <fblock_path_prefix>\n"
                     "     Use this option to finish a cromfs filesystem, if for some\n"
@@ -1688,6 +1875,17 @@ int main(int argc, char** argv)
                     "     a filesystem that may be write-extended).\n"
                     "     This option supersedes the old --packedblocks (-k) with opposite\n"
                     "     semantics.\n"
+                    " --dirindex <value>\n"
+                    "     Directories having at least this many entries are given a hash\n"
+                    "     index, which makes looking up a file in them faster. The index\n"
+                    "     takes 8-16 bytes per entry. Default: 0 (no index)\n"
+                    "     The images remain readable by older versions of cromfs.\n"
+                    " --blktabchunk <value>\n"
+                    "     Compresses the block table in chunks of this many blocks, so\n"
+                    "     that cromfs-driver needs to decompress only the parts of it\n"
+                    "     that are used, instead of all of it at once. Suggested: 4096\n"
+                    "     Default: 0 (no chunks)\n"
+                    "     Older versions of cromfs cannot read such images.\n"
                     "\n"
                     "Compression algorithm parameters:\n"
                     " --minfreespace, -s <value>\n"
@@ -1725,6 +1923,23 @@ int main(int argc, char** argv)
                     "     try every possible option. Beware it will consume lots of time.\n"
                     "     \"--lzmabits auto\" is a lighter alternative to \"--lzmabits full\",\n"
                     "     and enabled by default.\n"
+                    " --fastfiles <pattern>\n"
+                    "     The fblocks that get data from files matching <pattern> are\n"
+                    "     compressed with the fast codec (see --fastcodec) instead of LZMA.\n"
+                    "     They take more space, but are decompressed many times faster.\n"
+                    "     Use for the files that are read most often, such as programs\n"
+                    "     and libraries. You can specify this option multiple times.\n"
+                    "     Note: The pathname seen by the pattern\n"
+                    "           matcher includes the source path.\n"
+                    " --lzmamingain <value>\n"
+                    "     Compresses every fblock with the fast codec as well, and uses\n"
+                    "     it instead of LZMA if LZMA saves less than <value> percent of\n"
+                    "     its size. Default: 0 (always LZMA)\n"
+                    " --fastcodec <value>\n"
+                    "     The codec used by --fastfiles and --lzmamingain:\n"
+                    "       lzo   = LZO1X (default). What it cannot shrink is stored as such.\n"
+                    "       store = no compression at all\n"
+                    "     Older versions of cromfs cannot read such images.\n"
                     " --blockifyorder <value>\n"
                     "     Specifies the priorities for blockifying different types of data\n"
                     "     Default: dir=1,link=2,file=3,inotab=4\n"
@@ -1763,6 +1978,28 @@ int main(int argc, char** argv)
                     "            and requires relatively little virtual memory. It\n"
                     "            neglects most of cromfs's power, though.\n"
                     "            Use it if \"all2\" consumes too much virtual memory.\n"
+                    " --fingerprintbits <value>\n"
+                    "     The size of the block hashes used by --blockindexmethod, 32 or 64.\n"
+                    "     Blocks whose hashes match are compared by reading them both.\n"
+                    "     With millions of blocks, 32-bit hashes match falsely often enough\n"
+                    "     to slow down mkcromfs; 64 avoids that, at the cost of 4 bytes of\n"
+                    "     memory per block. Default: 32\n"
+                    " --chunking <value>\n"
+                    "     Controls how data that is not identical to an earlier block\n"
+                    "     is found in the fblocks.\n"
+                    "       --chunking fixed (default)\n"
+                    "            Only at the positions indexed by --autoindexperiod,\n"
+                    "            and by brute force in the last fblocks.\n"
+                    "       --chunking cdc\n"
+                    "            Also by content-defined anchors, wherever it is.\n"
+                    "            Finds the data of earlier versions of a file after\n"
+                    "            insertions and deletions. Use for versioned datasets,\n"
+                    "            such as successive releases of the same tree.\n"
+                    "            The blocks themselves are still bsize long.\n"
+                    " --cdcsizes <min>,<avg>,<max>\n"
+                    "     The distances between the anchors of --chunking cdc.\n"
+                    "     <avg> is rounded down to a power of two.\n"
+                    "     Default: bsize/64, bsize/16, bsize/4 (at least 64,256,1024)\n"
                     " --nosortbyfilename\n"
                     "     Disables sorting by filename when blockifying. Use when\n"
                     "     you have made attempts to affect manually the order in which\n"
@@ -1999,6 +2236,67 @@ int main(int argc, char** argv)
                 MayPackBlocks = false;
                 break;
             }
+            case 6002: // dirindex
+            {
+                char* arg = optarg;
+                long value = strtol(arg, &arg, 10);
+                if(value < 0)
+                {
+                    std::fprintf(stderr, "mkcromfs: The value for --dirindex may not be negative.\n");
+                    return -1;
+                }
+                DirIndexMinEntries = value;
+                break;
+            }
+            case 6003: // blktabchunk
+            {
+                char* arg = optarg;
+                long value = strtol(arg, &arg, 10);
+                if(value < 0 || value > 0x7FFFFFFFL)
+                {
+                    std::fprintf(stderr, "mkcromfs: The value for --blktabchunk must be between 0 and 2147483647.\n");
+                    return -1;
+                }
+                BlktabChunkBlocks = value;
+                if(value > 0)
+                    storage_opts |= CROMFS_OPT_CHUNKED_BLKTAB;
+                else
+                    storage_opts &= ~CROMFS_OPT_CHUNKED_BLKTAB;
+                break;
+            }
+            case 6004: // fastcodec
+            {
+                if(!strcmp(optarg, "lzo"))
+                    FastCodec = CROMFS_FBLOCK_LZO;
+                else if(!strcmp(optarg, "store"))
+                    FastCodec = CROMFS_FBLOCK_STORED;
+                else
+                {
+                    std::fprintf(stderr, "mkcromfs: Fastcodec may only be lzo or store. You gave %s.\n", optarg);
+                    return -1;
+                }
+                break;
+            }
+            case 6005: // fastfiles
+            {
+                AddFilePattern(fastcodec_files, optarg);
+                storage_opts |= CROMFS_OPT_FBLOCK_CODECS;
+                break;
+            }
+            case 6006: // lzmamingain
+            {
+                char* arg = optarg;
+                long value = strtol(arg, &arg, 10);
+                if(value < 0 || value > 100)
+                {
+                    std::fprintf(stderr, "mkcromfs: The value for --lzmamingain must be between 0 and 100. You gave %ld%s.\n", value, arg);
+                    return -1;
+                }
+                LZMAMinimumGain = value;
+                if(value > 0)
+                    storage_opts |= CROMFS_OPT_FBLOCK_CODECS;
+                break;
+            }
             case 4001: // lzmafastbytes
             {
                 char* arg = optarg;
@@ -2118,6 +2416,53 @@ int main(int argc, char** argv)
                 }
                 break;
             }
+            case 3005: // chunking
+            {
+                char* arg = optarg;
+                if(!strcmp(arg, "fixed"))
+                    Chunking_Method = Chunking_Fixed;
+                else if(!strcmp(arg, "cdc"))
+                    Chunking_Method = Chunking_CDC;
+                else
+                {
+                    std::fprintf(stderr, "mkcromfs: Chunking may only be fixed or cdc. You gave %s.\n", arg);
+                    return -1;
+                }
+                break;
+            }
+            case 3006: // cdcsizes
+            {
+                char* arg = optarg;
+                long min = strtol(arg, &arg, 10); if(*arg == ',') ++arg;
+                long avg = strtol(arg, &arg, 10); if(*arg == ',') ++arg;
+                long max = strtol(arg, &arg, 10);
+                if(*arg || min < 1 || avg < 64 || min > avg || avg > max)
+                {
+                    std::fprintf(stderr, "mkcromfs: Invalid value(s) for --cdcsizes. See `mkcromfs --help'\n");
+                    return -1;
+                }
+                CDCMinSize = min;
+                CDCAvgSize = avg;
+                CDCMaxSize = max;
+                break;
+            }
+            case 3007: // fingerprintbits
+            {
+                char* arg = optarg;
+                long bits = strtol(arg, &arg, 10);
+                if(bits != 32 && bits != 64)
+                {
+                    std::fprintf(stderr, "mkcromfs: Fingerprintbits may only be 32 or 64. You gave %ld%s.\n", bits,arg);
+                    return -1;
+                }
+                FingerprintBits = bits;
+                break;
+            }
+            case 3008: // latecompress
+            {
+                CompressSealedFblocks = false;
+                break;
+            }
             case 4003: // threads
             {
                 char* arg = optarg;
@@ -2269,6 +2614,13 @@ int main(int argc, char** argv)
             (long)AutoIndexPeriod, Buf);
     }
 
+    if(!CDCAvgSize)
+    {
+        CDCAvgSize = std::max(BSIZE / 16, 256l);
+        CDCMinSize = CDCAvgSize / 4;
+        CDCMaxSize = CDCAvgSize * 4;
+    }
+
     path  = argv[optind+0];
     outfn = argv[optind+1];
 
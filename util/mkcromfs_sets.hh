@@ -4,9 +4,11 @@
 #include <vector>
 #include <string>
 #include <utility>
+#include <cstddef>
 
 extern int LZMA_HeavyCompress;
 extern bool DecompressWhenLookup;
+extern bool CompressSealedFblocks;
 extern bool MayAutochooseBlocknumSize;
 extern bool MayPackBlocks;
 extern bool DisplayBlockSelections;
@@ -40,8 +42,19 @@ enum BlockHashingMethods
       BlockHashing_None
     };
 extern BlockHashingMethods BlockHashing_Method;
+extern unsigned FingerprintBits;
 extern std::string ReuseListFile;
 
+enum ChunkingMethods
+    { Chunking_Fixed,
+      Chunking_CDC
+    };
+extern ChunkingMethods Chunking_Method;
+extern uint_fast32_t CDCMinSize, CDCAvgSize, CDCMaxSize;
+
 long CalcBSIZEfor(const std::string& pathfn); // from mkcromfs.cc
+bool UseFastCodecFor(const std::string& pathfn); // from mkcromfs.cc
+const std::vector<unsigned char> CompressFblockData( // from mkcromfs.cc
+    bool prefer_fast, const unsigned char* data, std::size_t length, const char* why);
 
 #endif
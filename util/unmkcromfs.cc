@@ -18,6 +18,7 @@
 #include <utime.h>
 #include <stdarg.h>
 #include <cstring>
+#include <ctime>
 
 #ifdef HAS_LUTIMES
  #include <sys/time.h>
@@ -308,12 +309,16 @@ private:
      * know whether we actually want to extract.
      */
     std::set<cromfs_inodenum_t> extra_dirs;
+
+    /* The whole block table, as every block will be needed. */
+    std::vector<cromfs_block_internal> blktab;
 public:
     cromfs_decoder(int fd)
         : cromfs(fd),
-          fblock_users(), inode_files(), dir(), extra_dirs() // -Weffc++
+          fblock_users(), inode_files(), dir(), extra_dirs(), blktab() // -Weffc++
     {
         cromfs::Initialize();
+        read_blktab(blktab);
 
         BSIZE = sblock.bsize;
         FSIZE = sblock.fsize;
@@ -746,7 +751,7 @@ public:
             do_extract(fblocknum, targetdir, expect_size, total_written);
         }
 
-        fblock_cache.clear(); // save RAM
+        forget_fblocks(); // save RAM
 
         if(verbose >= 1)
             std::printf("Total written: %s\n", ReportSize(total_written).c_str());
@@ -817,12 +822,10 @@ public:
                  );
         }
 
-        // Copy the fblock (don't create reference), because
-        // read_inode_and_blocks() may cause the fblock to be
-        // removed from the cache while it's still in use.
-        // Also, read it uncached so that we don't accidentally
+        // Read it uncached so that we don't accidentally
         // cause the inode-table fblocks to be removed from cache.
-        cromfs_cached_fblock fblock = read_fblock_uncached(fblocknum);
+        // Holding fblock keeps the data alive while we use it.
+        const cromfs_cached_fblock fblock = read_fblock_uncached(fblocknum);
 
         FadviseDontNeed(fd, fblktab[fblocknum].filepos,
                             fblktab[fblocknum].length);
@@ -836,7 +839,7 @@ public:
 
         if(verbose >= 1)
         {
-            ThreadSafeConsole.printf("%s; -> %u targets... ", ReportSize(fblock.size()).c_str(), nfiles);
+            ThreadSafeConsole.printf("%s; -> %u targets... ", ReportSize(fblock->size()).c_str(), nfiles);
         }
 
         uint_fast64_t wrote_size = 0;
@@ -905,7 +908,7 @@ public:
                     if(a+1 == ino.blocklist.size())
                         read_size = ino.bytesize - (ino.blocklist.size()-1) * block_size;
 
-                    if(block_startoffs + read_size > fblock.size())
+                    if(block_startoffs + read_size > fblock->size())
                     {
                         ThreadSafeConsole.erroroneliner("block %u (block #%u/%u of inode %u, %"LL_FMT"u/%"LL_FMT"u bytes) is corrupt (points to bytes %"LL_FMT"u-%"LL_FMT"u, fblock %u size is %"LL_FMT"u)\n",
                             (unsigned)ino.blocklist[a],
@@ -916,12 +919,12 @@ public:
                             (unsigned long long)(block_startoffs),
                             (unsigned long long)(block_startoffs + read_size-1),
                             (unsigned)fblocknum,
-                            (unsigned long long)fblock.size()
+                            (unsigned long long)fblock->size()
                                 );
                         continue;
                     }
 
-                    file.write(&fblock[block_startoffs], read_size, file_offset, use_sparse);
+                    file.write(fblock->data() + block_startoffs, read_size, file_offset, use_sparse);
                     wrote_size += read_size;
                 }
 